@@ -30,6 +30,7 @@ void setColoursByVel() {
     int i;
     particle_t *p;
     particleDetail_t *pd;
+    float *mass;
     float d;
     float velMax = 0;
     float velSpeed;
@@ -37,6 +38,9 @@ void setColoursByVel() {
     VectorNew(zero);
     VectorZero(zero);
 
+    // the masses of the frame that is shown
+    mass = particleMasses(state.currentFrame);
+
     // works out the highest velocity
     for (i = 0; i < state.particleCount; i++) {
 
@@ -64,7 +68,7 @@ void setColoursByVel() {
 
         d = velSpeed / velMax;
         colourFromNormal(pd->col, (float)fabs((double)d));
-        pd->particleSprite = colourSprite(pd->col, pd->mass);
+        pd->particleSprite = colourSprite(pd->col, mass[i]);
 
     }
 
@@ -75,6 +79,7 @@ void setColoursByKinetic() {
     int i;
     particle_t *p;
     particleDetail_t *pd;
+    float *mass;
     float d;
     float kinMax = 0;
     float kinValue;
@@ -83,6 +88,9 @@ void setColoursByKinetic() {
     VectorNew(zero);
     VectorZero(zero);
 
+    // the masses of the frame that is shown
+    mass = particleMasses(state.currentFrame);
+
     for (i = 0; i < state.particleCount; i++) {
 
         p = getParticleCurrentFrame(i);
@@ -90,7 +98,7 @@ void setColoursByKinetic() {
 
         distance(zero, p->vel, velocity);
         velocity = fabs(velocity);
-        kinValue = velocity * velocity * fabs(pd->mass) * 0.5;
+        kinValue = velocity * velocity * fabs(mass[i]) * 0.5;
 
         if (i == 0) {
 
@@ -112,11 +120,11 @@ void setColoursByKinetic() {
         pd = getParticleDetail(i);
 
         distance(zero, p->vel, velocity);
-        kinValue = velocity * velocity * pd->mass * 0.5;
+        kinValue = velocity * velocity * mass[i] * 0.5;
 
         d = kinValue / kinMax;
         colourFromNormal(pd->col, (float)fabs((double)d));
-        pd->particleSprite = colourSprite(pd->col, pd->mass);
+        pd->particleSprite = colourSprite(pd->col, mass[i]);
 
     }
 
@@ -127,6 +135,7 @@ void setColoursByMomentum() {
     int i;
     particle_t *p;
     particleDetail_t *pd;
+    float *mass;
     float d;
     float kinMax = 0;
     float kinValue;
@@ -135,6 +144,9 @@ void setColoursByMomentum() {
     VectorNew(zero);
     VectorZero(zero);
 
+    // the masses of the frame that is shown
+    mass = particleMasses(state.currentFrame);
+
     for (i = 0; i < state.particleCount; i++) {
 
         p = getParticleCurrentFrame(i);
@@ -142,7 +154,7 @@ void setColoursByMomentum() {
 
         distance(zero, p->vel, velocity);
         velocity = fabs(velocity);
-        kinValue = velocity * fabs(pd->mass);
+        kinValue = velocity * fabs(mass[i]);
 
         if (i == 0) {
 
@@ -164,11 +176,11 @@ void setColoursByMomentum() {
         pd = getParticleDetail(i);
 
         distance(zero, p->vel, velocity);
-        kinValue = velocity * pd->mass;
+        kinValue = velocity * mass[i];
 
         d = kinValue / kinMax;
         colourFromNormal(pd->col, (float)fabs((double)d));
-        pd->particleSprite = colourSprite(pd->col, pd->mass);
+        pd->particleSprite = colourSprite(pd->col, mass[i]);
 
     }
 
@@ -179,6 +191,7 @@ void setColoursByAcceleration() {
     int i;
     particle_t *p, *plast;
     particleDetail_t *pd;
+    float *mass;
     float d;
     float accMax = 0;
     float accCurrent;
@@ -193,11 +206,14 @@ void setColoursByAcceleration() {
         return;
     }
 
+    // the masses of the frame that is shown
+    mass = particleMasses(state.currentFrame);
+
     for (i = 0; i < state.particleCount; i++) {
 
         p = getParticleCurrentFrame(i);
         pd = getParticleDetail(i);
-        plast = state.particleHistory + state.particleCount * (state.currentFrame-1) + i;
+        plast = historyParticle(state.currentFrame-1, i);
 
         //acceleration = delta between current and last velocity
         distance(plast->vel, p->vel, velSpeed1);
@@ -225,14 +241,14 @@ void setColoursByAcceleration() {
 
         p = getParticleCurrentFrame(i);
         pd = getParticleDetail(i);
-        plast = state.particleHistory + state.particleCount * (state.currentFrame-1) + i;
+        plast = historyParticle(state.currentFrame-1, i);
         distance(zero, p->vel, velSpeed1);
         distance(zero, plast->vel, velSpeed2);
         accCurrent = velSpeed1 - velSpeed2;
 
         d = accCurrent / accMax;
         colourFromNormal(pd->col, (float)fabs((double)d));
-        pd->particleSprite = colourSprite(pd->col, pd->mass);
+        pd->particleSprite = colourSprite(pd->col, mass[i]);
 
     }
 
@@ -243,24 +259,28 @@ void setColoursByMass() {
 
     int i;
     particleDetail_t *pd;
+    float *mass;
     float d;
 
+    // the masses of the frame that is shown
+    mass = particleMasses(state.currentFrame);
+
     for (i = 0; i < state.particleCount; i++) {
 
         pd = getParticleDetail(i);
 
         if (i == 0) {
 
-            state.massRange[0] = pd->mass;
-            state.massRange[1] = pd->mass;
+            state.massRange[0] = mass[i];
+            state.massRange[1] = mass[i];
 
         } else {
 
-            if (pd->mass < state.massRange[0])
-                state.massRange[0] = pd->mass;
+            if (mass[i] < state.massRange[0])
+                state.massRange[0] = mass[i];
 
-            if (pd->mass > state.massRange[1])
-                state.massRange[1] = pd->mass;
+            if (mass[i] > state.massRange[1])
+                state.massRange[1] = mass[i];
 
         }
 
@@ -270,7 +290,7 @@ void setColoursByMass() {
 
         pd = getParticleDetail(i);
 
-        d = pd->mass / state.massRange[1];
+        d = mass[i] / state.massRange[1];
         colourFromNormal(pd->col, (float)fabs(d));
 
         if (d < 0) {
@@ -280,7 +300,7 @@ void setColoursByMass() {
             pd->col[2] = 1 - pd->col[2];
 
         }
-        pd->particleSprite = colourSprite(pd->col, pd->mass);
+        pd->particleSprite = colourSprite(pd->col, mass[i]);
     }
 
 }
@@ -37,6 +37,7 @@ cmd_t cmd[] = {
     ,{ "load",						cmdLoadFrameDump,		NULL,						NULL,								NULL }
     ,{ "save",						cmdSaveFrameDump,		NULL,						NULL,								NULL }
     ,{ "saveauto",					NULL,					NULL,						&state.autoSave,					NULL }
+    ,{ "savecompression",			NULL,					NULL,						&state.saveCompression,				NULL }
     ,{ "savelist",					cmdSaveList,			NULL,						NULL,								NULL }
     ,{ "savedelete",				cmdSaveDelete,			NULL,						NULL,								NULL }
 
@@ -46,6 +47,8 @@ cmd_t cmd[] = {
 
     ,{ "memoryavailable",			NULL,					NULL,						&state.memoryAvailable,				NULL }
     ,{ "memorypercentage",			NULL,					NULL,						&state.memoryPercentage,      			NULL }
+    ,{ "historydisk",				NULL,					NULL,						&state.historyDisk,					NULL }
+    ,{ "historycompact",			NULL,					NULL,						&state.historyCompact,				NULL }
 
 #ifndef NO_GUI
 
@@ -132,6 +135,19 @@ cmd_t cmd[] = {
     ,{ "verbose",					NULL,					NULL,						&view.verboseMode,					NULL }
 
     ,{ "processors",				NULL,					NULL,						&state.processFrameThreads,			NULL }
+    ,{ "solver",					cmdSolver,				NULL,						NULL,								NULL }
+    ,{ "integrator",				cmdIntegrator,			NULL,						NULL,								NULL }
+    ,{ "physics",					cmdPhysics,				NULL,						NULL,								NULL }
+    ,{ "fmmorder",					cmdFmmOrderCheck,		NULL,						&state.fmmOrder,					NULL }
+    ,{ "theta",						cmdThetaCheck,			&state.theta,				NULL,								NULL }
+    ,{ "quadrupole",				NULL,					NULL,						&state.quadrupole,					NULL }
+    ,{ "timesteps",					cmdTimeStepsCheck,		NULL,						&state.timeSteps,					NULL }
+    ,{ "timestepaccuracy",			cmdTimeStepAccuracyCheck,	&state.timeStepAccuracy,	NULL,								NULL }
+    ,{ "softening",					cmdSofteningCheck,		&state.softening,			NULL,								NULL }
+    ,{ "mixedprecision",			cmdMixedPrecisionCheck,	NULL,						&state.mixedPrecision,				NULL }
+    ,{ "collisionradius",			cmdCollisionRadiusCheck,	&state.collisionRadius,		NULL,								NULL }
+    ,{ "diagnostics",				cmdDiagnosticsCheck,	NULL,						&state.diagnostics,					NULL }
+    ,{ "diagnosticslog",			cmdDiagnosticsLog,		NULL,						NULL,								NULL }
 
     ,{ "zoom",						NULL,					&view.zoom,					NULL,								NULL }
     ,{ "zoomfit",					cmdZoomFit,				NULL,						NULL,								NULL }
@@ -426,9 +442,13 @@ cmdSpawnRestartSpawning:
 
     state.particleCount = state.particlesToSpawn;
 
-    memoryAvailable = getMemoryAvailable();
+    // a history on disk can be a lot bigger than memory
+    if (state.historyDisk > 0)
+        memoryAvailable = state.historyDisk;
+    else
+        memoryAvailable = getMemoryAvailable();
 
-    state.historyFrames = (unsigned int)(((size_t)memoryAvailable * 1024 * 1024) / (size_t)FRAMESIZE);
+    state.historyFrames = historyFramesFor((size_t)memoryAvailable * 1024 * 1024);
 
     if (!initFrame()) {
         conAdd(LERR, "Could not init frame");
@@ -771,40 +791,30 @@ void cmdSaveFrameDump(char *arg) {
     }
 
     conAdd(LNORM, "Saving %s...", arg);
-    conAdd(LNORM, "Please Wait...");
-    runVideo();
-
-    // dump raw data to files
 
-    fileName = va("%s/%s.info", SAVE_PATH, arg);
-    if (!SaveMemoryDump(fileName, (unsigned char *)&si, sizeof(si))) {
-        conAdd(LERR, "Failed to create %s", fileName);
-        return;
-    }
-
-    fileName = va("%s/%s.particledetail", SAVE_PATH, arg);
-    if (!SaveMemoryDump(fileName, (unsigned char *)sd, SAVEDETAILSIZE)) {
-        conAdd(LERR, "Failed to create %s", fileName);
-        return;
-    }
-
-    fileName = va("%s/%s.particles", SAVE_PATH, arg);
-    if (!SaveMemoryDump(fileName, (unsigned char *)state.particleHistory, FRAMESIZE * (state.frame+1))) {
+    // one file, written in the background, see save.c
+    fileName = va("%s/%s.%s", SAVE_PATH, arg, SAVE_EXTENSION);
+    if (!saveWrite(fileName, &si, sd, state.frame+1)) {
         conAdd(LERR, "Failed to create %s", fileName);
+        free(sd);
         return;
     }
-    conAdd(LNORM, "Simulation saved sucesfully!");
 
     free(sd);
     setFileName(arg);
 
+    // the next autosave only has to add what is recorded from now on
+    state.lastSave = state.totalFrames;
+
 }
 
 void cmdLoadFrameDump(char *arg) {
 
     saveInfo_t si;
     saveDetail_t *sd;
+    saveFile_t f;
     char *fileName;
+    int legacy;
     int i;
     size_t bytes;
 
@@ -826,11 +836,27 @@ void cmdLoadFrameDump(char *arg) {
 
     if (!checkHomePath()) return;
 
-    fileName = va("%s/%s.info", SAVE_PATH, arg);
-    if ((bytes = LoadMemoryDump(fileName, (unsigned char *)&si, sizeof(si), sizeof(int))) < (5*sizeof(int))) {
-        // invalid info file
-        conAdd(LERR, "Failed to load %s (%ld bytes)", fileName, (long)bytes);
-        return;
+    // a save of this file might still be running
+    saveCancel();
+
+    fileName = va("%s/%s.%s", SAVE_PATH, arg, SAVE_EXTENSION);
+    legacy = !saveOpen(&f, fileName);
+
+    if (!legacy) {
+
+        si = f.info;
+        bytes = sizeof(si);
+
+    } else {
+
+        // saves from before the .gravit format
+        fileName = va("%s/%s.info", SAVE_PATH, arg);
+        if ((bytes = LoadMemoryDump(fileName, (unsigned char *)&si, sizeof(si), sizeof(int))) < (5*sizeof(int))) {
+            // invalid info file
+            conAdd(LERR, "Failed to load %s (%ld bytes)", fileName, (long)bytes);
+            return;
+        }
+
     }
 
     // for mallocing in initFrame
@@ -843,6 +869,7 @@ void cmdLoadFrameDump(char *arg) {
 
     if (!initFrame()) {
         conAdd(LERR, "Could not init frame");
+        saveClose(&f);
         return;
     }
 
@@ -858,7 +885,7 @@ void cmdLoadFrameDump(char *arg) {
         VectorCopy(si.face, view.face);
         VectorCopy(si.lastCenter, view.lastCenter);
         view.glow = si.glow;
-        state.physics = si.physics;
+        state.physics = (si.physics >= 0 && si.physics < PH_LAST) ? si.physics : PH_CLASSIC;
         state.g = si.g;
         state.gbase = si.gbase;
     } else {
@@ -869,25 +896,42 @@ void cmdLoadFrameDump(char *arg) {
     sd = (saveDetail_t *) calloc(sizeof(saveDetail_t),state.particleCount);
     if (!sd) {
         conAdd(LERR, "Could not allocate %lu bytes of memory for saveDetail", (unsigned long)(SAVEDETAILSIZE));
-        free(sd);
+        saveClose(&f);
         return;
     }
 
-    conAdd(LNORM, "Please Wait...");
-    runVideo();
+    if (!legacy) {
 
-    fileName = va("%s/%s.particledetail", SAVE_PATH, arg);
-    bytes = SAVEDETAILSIZE;
-    if (LoadMemoryDump(fileName, (unsigned char *)sd, bytes, 0) < bytes) {
-        conAdd(LERR, "Failed to load %s", fileName);
-        return;
-    }
+        // the frames after the first one are loaded in the background
+        if (!saveReadDetail(&f, sd) || !saveReadMerged(&f, state.particleMerged) || !saveRead(&f, state.frame+1)) {
+            conAdd(LERR, "Failed to load %s", fileName);
+            saveClose(&f);
+            free(sd);
+            return;
+        }
+
+        saveClose(&f);
+
+    } else {
+
+        conAdd(LNORM, "Please Wait...");
+        runVideo();
+
+        fileName = va("%s/%s.particledetail", SAVE_PATH, arg);
+        bytes = SAVEDETAILSIZE;
+        if (LoadMemoryDump(fileName, (unsigned char *)sd, bytes, 0) < bytes) {
+            conAdd(LERR, "Failed to load %s", fileName);
+            free(sd);
+            return;
+        }
+
+        fileName = va("%s/%s.particles", SAVE_PATH, arg);
+        if (!historyLoad(fileName, state.frame+1)) {
+            conAdd(LERR, "Failed to load %s", fileName);
+            free(sd);
+            return;
+        }
 
-    fileName = va("%s/%s.particles", SAVE_PATH, arg);
-    bytes = FRAMESIZE * (state.frame+1);
-    if (LoadMemoryDump(fileName, (unsigned char *)state.particleHistory, bytes, 0) < bytes) {
-        conAdd(LERR, "Failed to load %s", fileName);
-        return;
     }
 
     // get particleDetail from saveDetail
@@ -900,7 +944,8 @@ void cmdLoadFrameDump(char *arg) {
         pd->col[2] = sd[i].col[2];
         pd->col[3] = sd[i].col[3];
 	pd->particleSprite=SPRITE_DEFAULT;
-	VectorZero(pd->accel);
+        if (state.particleMerged[i] >= 0)
+            state.particlesMerged++;
     }
 
     state.currentFrame = 0;
@@ -910,6 +955,7 @@ void cmdLoadFrameDump(char *arg) {
 
     free(sd);
     setFileName(arg);
+    state.lastSave = state.totalFrames;
 
     view.zoomTarget = view.zoom;
     view.zoomSpeed = 0;
@@ -936,6 +982,112 @@ void cmdFrameSkip(char *arg) {
 
 }
 
+/*
+ * which of the count names arg is, by name or by number.
+ * returns -1 if it is neither, also for numbers with anything after them
+ */
+static int cmdLookup(char *arg, char **names, int count) {
+
+    char *end;
+    long n;
+    int i;
+
+    for (i = 0; i < count; i++)
+        if (!strcmp(arg, names[i]))
+            return i;
+
+    if (!isdigit((unsigned char)arg[0]))
+        return -1;
+
+    n = strtol(arg, &end, 10);
+    if (*end != '\0' || n >= count)
+        return -1;
+
+    return (int)n;
+
+}
+
+void cmdSolver(char *arg) {
+
+    int i;
+
+    if (arg) {
+
+        i = cmdLookup(arg, solverNames, SOLVER_LAST);
+
+        if (i < 0) {
+            conAdd(LERR, "solver: unknown solver \"%s\"", arg);
+            conAdd(LNORM, "valid solvers: auto pp sse vector ot fmm");
+            return;
+        }
+
+#ifndef HAVE_SSE
+        if (i == SOLVER_PP_SSE)
+            conAdd(LNORM, "SSE support is not compiled in, using \"vector\" instead");
+#endif
+
+        state.solver = i;
+
+    }
+
+    if (state.solver == SOLVER_AUTO)
+        conAdd(LNORM, "solver = auto (%s)", solverNames[getSolver()]);
+    else
+        conAdd(LNORM, "solver = %s", solverNames[state.solver]);
+
+}
+
+void cmdIntegrator(char *arg) {
+
+    int i;
+
+    if (arg) {
+
+        i = cmdLookup(arg, integratorNames, INTEGRATOR_LAST);
+
+        if (i < 0) {
+            conAdd(LERR, "integrator: unknown integrator \"%s\"", arg);
+            conAdd(LNORM, "valid integrators: leapfrog yoshida hermite");
+            return;
+        }
+
+        state.integrator = i;
+
+    }
+
+    if (state.integrator != getIntegrator())
+        conAdd(LNORM, "integrator = %s (%s with this solver)", integratorNames[state.integrator], integratorNames[getIntegrator()]);
+    else
+        conAdd(LNORM, "integrator = %s", integratorNames[state.integrator]);
+
+}
+
+void cmdPhysics(char *arg) {
+
+    int i;
+
+    if (arg) {
+
+        i = cmdLookup(arg, physicsNames, PH_LAST);
+
+        if (i < 0) {
+            conAdd(LERR, "physics: unknown physics \"%s\"", arg);
+            conAdd(LNORM, "valid physics: classic modified proper");
+            return;
+        }
+
+        // the accelerations of the current frame are not right any more
+        if (state.physics != (physics_t)i)
+            state.have_old_accel = 0;
+
+        state.physics = (physics_t)i;
+
+    }
+
+    conAdd(LNORM, "physics = %s", physicsNames[state.physics]);
+
+}
+
 void cmdStatus(char *arg) {
 
     if (state.mode & SM_RECORD)
@@ -951,6 +1103,12 @@ void cmdStatus(char *arg) {
     DUH("record frame      ", va("%i", state.frame));
     DUH("max frames        ", va("%i", state.historyFrames));
     DUH("particles         ", va("%i", state.particleCount));
+    DUH("solver            ", solverNames[getSolver()]);
+    DUH("integrator        ", integratorNames[getIntegrator()]);
+    DUH("physics           ", physicsNames[state.physics]);
+    DUH("softening         ", va("%.3f", state.softening));
+    DUH("mixed precision   ", state.mixedPrecision ? "on" : "off");
+    DUH("merged particles  ", va("%i", state.particlesMerged));
     DUH("frametime         ", va("%ims", view.deltaVideoFrame));
     DUH("fps               ", va("%3.2f", (float)1000 / view.deltaVideoFrame));
     DUH("particle vertices", va("%i", view.vertices));
@@ -993,6 +1151,114 @@ void cmdRunScript(char *arg) {
 
 }
 
+void cmdFmmOrderCheck(char *arg) {
+
+    if (state.fmmOrder < 1 || state.fmmOrder > FMM_MAX_ORDER) {
+        conAdd(LNORM, "fmmorder %i is not valid. fmmorder is now %i.", state.fmmOrder, FMM_DEFAULT_ORDER);
+        state.fmmOrder = FMM_DEFAULT_ORDER;
+    }
+
+}
+
+void cmdThetaCheck(char *arg) {
+
+    if (state.theta < 0) {
+        conAdd(LNORM, "theta %f is not valid. theta is now %.1f.", state.theta, OT_DEFAULT_THETA);
+        state.theta = OT_DEFAULT_THETA;
+    }
+
+}
+
+void cmdTimeStepsCheck(char *arg) {
+
+    if (state.timeSteps < 0 || state.timeSteps > TIMESTEP_MAX_LEVELS) {
+        conAdd(LNORM, "timesteps %i is not valid. timesteps is now 0.", state.timeSteps);
+        state.timeSteps = 0;
+    }
+
+}
+
+void cmdTimeStepAccuracyCheck(char *arg) {
+
+    if (state.timeStepAccuracy <= 0) {
+        conAdd(LNORM, "timestepaccuracy %f is not valid. timestepaccuracy is now %.1f.", state.timeStepAccuracy, TIMESTEP_DEFAULT_ACCURACY);
+        state.timeStepAccuracy = TIMESTEP_DEFAULT_ACCURACY;
+    }
+
+}
+
+void cmdSofteningCheck(char *arg) {
+
+    if (state.softening < 0) {
+        conAdd(LNORM, "softening %f is not valid. softening is now %.2f.", state.softening, SOFTENING_DEFAULT);
+        state.softening = SOFTENING_DEFAULT;
+    }
+
+    // the stored accelerations were computed with the old softening
+    if (arg)
+        state.have_old_accel = 0;
+
+}
+
+void cmdMixedPrecisionCheck(char *arg) {
+
+    if (state.mixedPrecision)
+        state.mixedPrecision = 1;
+
+    // positions are relative to another origin now, load them again
+    if (arg)
+        workingSet.valid = 0;
+
+}
+
+void cmdCollisionRadiusCheck(char *arg) {
+
+    if (state.collisionRadius < 0) {
+        conAdd(LNORM, "collisionradius %f is not valid. collisionradius is now 0.", state.collisionRadius);
+        state.collisionRadius = 0;
+    }
+
+}
+
+void cmdDiagnosticsCheck(char *arg) {
+
+    if (state.diagnostics < 0) {
+        conAdd(LNORM, "diagnostics %i is not valid. diagnostics is now 0.", state.diagnostics);
+        state.diagnostics = 0;
+    }
+
+}
+
+void cmdDiagnosticsLog(char *arg) {
+
+    char *fileName;
+
+    if (!arg) {
+        diagnosticsLog(NULL);
+        conAdd(LNORM, "diagnostics log closed");
+        return;
+    }
+
+    if (!checkHomePath()) return;
+
+    if (!mymkdir(SAVE_PATH)) {
+        conAdd(LERR, "Could not create %s directory", SAVE_PATH);
+        return;
+    }
+
+    fileName = va("%s/%s.csv", SAVE_PATH, arg);
+
+    if (!diagnosticsLog(fileName)) {
+        conAdd(LERR, "Could not open %s", fileName);
+        return;
+    }
+
+    conAdd(LNORM, "writing diagnostics to %s", fileName);
+    if (!state.diagnostics)
+        conAdd(LNORM, "set diagnostics to more than 0 to compute them");
+
+}
+
 void cmdTailSkipCheck(char *arg) {
 
     if (view.tailSkip <= 0) {
@@ -1326,10 +1592,45 @@ void cmdList(char *arg) {
 
 }
 
+// list file if it is a save (name.gravit, or name.info from before that)
+static void cmdSaveListFile(char *file) {
+
+    saveInfo_t si;
+    saveFile_t f;
+    size_t len, ext;
+
+    len = strlen(file);
+    ext = strlen(SAVE_EXTENSION) + 1;
+
+    if (len > ext && file[len - ext] == '.' && !strcmp(&file[len - ext + 1], SAVE_EXTENSION)) {
+
+        if (!saveOpen(&f, va("%s/%s", SAVE_PATH, file))) {
+            conAdd(LERR, "Failed to load %s", file);
+            return;
+        }
+        file[len - ext] = 0;
+        conAdd(LNORM, "%s - %i particles, %i frames", file, f.info.particleCount, f.info.totalFrames);
+        saveClose(&f);
+        return;
+
+    }
+
+    if (len > 5 && !strcmp(&file[len-5], ".info")) {
+
+        if (LoadMemoryDump(va("%s/%s", SAVE_PATH, file), (unsigned char *)&si, sizeof(si), sizeof(int)) == 0) {
+            conAdd(LERR, "Failed to load %s", file);
+            return;
+        }
+        file[len-5] = 0;
+        conAdd(LNORM, "%s - %i particles, %i frames (old format)", file, si.particleCount, si.totalFrames);
+
+    }
+
+}
+
 void cmdSaveList(char *arg) {
 
     char *file;
-    saveInfo_t si;
 
 #ifdef WIN32
     HANDLE h;
@@ -1340,7 +1641,9 @@ void cmdSaveList(char *arg) {
 
 #ifdef WIN32
 
-    h = FindFirstFile(va("%s/*.info", SAVE_PATH), &fd);
+    h = FindFirstFile(va("%s/*", SAVE_PATH), &fd);
+    if (h == INVALID_HANDLE_VALUE)
+        return;
     while (1) {
 
         file = fd.cFileName;
@@ -1357,17 +1660,10 @@ void cmdSaveList(char *arg) {
 
     while ((f = readdir(d)) != NULL) {
         file = f->d_name;
-        if (strcmp(&file[strlen(file)-5], ".info"))
-            continue;
 
 #endif
 
-        if (LoadMemoryDump(va("%s/%s", SAVE_PATH, file), (unsigned char *)&si, sizeof(si), sizeof(int)) == 0) {
-            conAdd(LERR, "Failed to load %s", file);
-            return;
-        }
-        file[strlen(file)-5] = 0;
-        conAdd(LNORM, "%s - %i particles, %i frames", file, si.particleCount, si.totalFrames);
+        cmdSaveListFile(file);
 
 #ifdef WIN32
 
@@ -1393,6 +1689,17 @@ void cmdSaveDelete(char *arg) {
 
     if (!checkHomePath()) return;
 
+    // not while it is being saved
+    saveFinish();
+
+    file = va("%s/%s.%s", SAVE_PATH, arg, SAVE_EXTENSION);
+    if (myunlink(file)) {
+        conAdd(LNORM, "Deleted %s", arg);
+        freeFileName();
+        return;
+    }
+
+    // saves from before the .gravit format
     file = va("%s/%s.info", SAVE_PATH, arg);
     if (!myunlink(file)) {
         conAdd(LERR, "Unable to delete %s", file);
@@ -56,6 +56,15 @@ void cmdSpawn(char *arg);
 void cmdStatus(char *arg);
 void cmdFontFile(char *arg);
 void cmdRunScript(char *arg);
+void cmdFmmOrderCheck(char *arg);
+void cmdThetaCheck(char *arg);
+void cmdTimeStepsCheck(char *arg);
+void cmdTimeStepAccuracyCheck(char *arg);
+void cmdSofteningCheck(char *arg);
+void cmdMixedPrecisionCheck(char *arg);
+void cmdCollisionRadiusCheck(char *arg);
+void cmdDiagnosticsCheck(char *arg);
+void cmdDiagnosticsLog(char *arg);
 void cmdTailSkipCheck(char *arg);
 void cmdScreenshot(char *arg);
 void cmdScreenshotLoop(char *arg);
@@ -78,6 +87,9 @@ void cmdSaveDelete(char *arg);
 void cmdUnhelpful(char *arg);
 void cmdZoomFit(char *arg);
 void cmdFrameSkip(char *arg);
+void cmdSolver(char *arg);
+void cmdIntegrator(char *arg);
+void cmdPhysics(char *arg);
 void cmdPlayAudioStream(char *arg);
 
 #endif
@@ -0,0 +1,780 @@
+/*
+
+This file is part of
+Gravit - A gravity simulator
+Copyright 2003-2005 Gerald Kaszuba
+Copyright 2011-2014 Frank Moehle
+
+Gravit is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+Gravit is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Gravit; if not, write to the Free Software
+Foundation, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+
+*/
+
+#include "gravit.h"
+
+#ifdef _OPENMP
+// experimental OMP support
+#include <omp.h> // VC has to include this header to build the correct manifest to find vcom.dll or vcompd.dll
+#endif
+
+
+/*  Fast multipole method:
+    ======================
+    Uses the octree of frame-ot.c. Every cell gets a multipole expansion
+    (cartesian, up to state.fmmOrder) about its center of mass, built bottom
+    up (P2M, M2M). Then each cell collects a local expansion from all cells
+    that are far enough away (M2L), which is shifted down the tree (L2L)
+    and evaluated at the particles (L2P). Only neighbouring leaf cells are
+    added up particle by particle (P2P).
+    --> O(N) instead of O(N log N) for Barnes-Hut
+
+    In gravit, a particle j pulls particle i with g * m_i * m_j * dv / r^2,
+    which is the gradient of the potential m_j * ln(r). The expansions are
+    done for this kernel. With PROPER physics it is g * m_j * dv / r^3, the
+    gradient of -m_j / r: the same expansions, only the derivatives of the
+    kernel are different (see fmmDerivatives()). Softening only changes
+    r^2 into r^2 + softening^2 in these derivatives, the expansions stay
+    exact for the softened kernel.
+
+    The cells down to a certain size are "targets": each one is handled by
+    one thread, which only writes to the cells and particles below it.
+    With block time steps, only the targets with active particles are
+    handled, see fmmActiveTargets().
+*/
+
+// cells with at most this many particles are not split any further
+#define FMM_LEAF_SIZE 64
+
+// two cells interact by their expansions if (radius1 + radius2) < FMM_THETA * distance
+#define FMM_THETA 0.5f
+
+// number of multi-indices (nx, ny, nz) with nx + ny + nz <= FMM_MAX_ORDER
+#define FMM_MAX_TERMS ((FMM_MAX_ORDER + 1) * (FMM_MAX_ORDER + 2) * (FMM_MAX_ORDER + 3) / 6)
+
+// number of pairs of multi-indices a, b with |a| + |b| <= FMM_MAX_ORDER
+#define FMM_MAX_PAIRS ((FMM_MAX_ORDER + 1) * (FMM_MAX_ORDER + 2) * (FMM_MAX_ORDER + 3) * (FMM_MAX_ORDER + 4) * (FMM_MAX_ORDER + 5) * (FMM_MAX_ORDER + 6) / 720)
+
+#define fmmIsLeaf(n) ((n)->count <= FMM_LEAF_SIZE || !(n)->children)
+
+// multi-indices, sorted by degree. fmmTerms[p] is the number of terms up to degree p
+static int fmmTerms[FMM_MAX_ORDER + 2];
+static int fmmN[FMM_MAX_TERMS][3];
+static int fmmIndex[FMM_MAX_ORDER + 1][FMM_MAX_ORDER + 1][FMM_MAX_ORDER + 1];
+
+// for the recursions: term t = term fmmPrev[t] + one step in dimension fmmDim[t]
+static int fmmDim[FMM_MAX_TERMS];
+static int fmmPrev[FMM_MAX_TERMS];
+static int fmmPrev2[FMM_MAX_TERMS];     // two steps back in fmmDim[t], -1 if there is none
+static int fmmTablesDone = 0;
+
+// all shifts and M2L add up products of terms a and b into a + b.
+// pairs (b, a + b) for each a: fmmPairB/Sum[fmmPairStart[a] .. fmmPairStart[a+1]-1], for fmmPairsOrder
+static int fmmPairB[FMM_MAX_PAIRS];
+static int fmmPairSum[FMM_MAX_PAIRS];
+static int fmmPairStart[FMM_MAX_TERMS + 1];
+static int fmmPairsOrder = 0;
+
+static int fmmOrder = FMM_DEFAULT_ORDER;
+static int fmmTermsUsed = 0;
+static int fmmPhysics = PH_CLASSIC;
+static float fmmSoft2 = 0;
+
+// expansions, one block of fmmTermsUsed per cell. fmmCell[node] is the cell of a node
+static double *fmmM = NULL;
+static double *fmmL = NULL;
+static float *fmmRadius = NULL;
+static int *fmmCell = NULL;
+static int fmmCells = 0;
+static int fmmCellsSize = 0;
+static int fmmNodesSize = 0;
+
+// targets, see above
+static int *fmmTarget = NULL;
+static int fmmTargets = 0;
+static int fmmTargetCount = 0;      // a cell with more particles than this is split into targets
+
+static void fmmInitTables() {
+
+    int nx, ny, nz;
+    int p, t, i;
+
+    if (fmmTablesDone)
+        return;
+
+    memset(fmmIndex, -1, sizeof(fmmIndex));
+
+    t = 0;
+    for (p = 0; p <= FMM_MAX_ORDER; p++) {
+
+        for (nx = p; nx >= 0; nx--) {
+            for (ny = p - nx; ny >= 0; ny--) {
+
+                nz = p - nx - ny;
+
+                fmmN[t][0] = nx;
+                fmmN[t][1] = ny;
+                fmmN[t][2] = nz;
+                fmmIndex[nx][ny][nz] = t;
+                t++;
+
+            }
+        }
+
+        fmmTerms[p] = t;
+
+    }
+
+    for (t = 1; t < fmmTerms[FMM_MAX_ORDER]; t++) {
+
+        int n[3];
+
+        for (i = 0; i < 3; i++)
+            if (fmmN[t][i])
+                break;
+
+        n[0] = fmmN[t][0];
+        n[1] = fmmN[t][1];
+        n[2] = fmmN[t][2];
+
+        fmmDim[t] = i;
+        n[i]--;
+        fmmPrev[t] = fmmIndex[n[0]][n[1]][n[2]];
+
+        if (n[i]) {
+            n[i]--;
+            fmmPrev2[t] = fmmIndex[n[0]][n[1]][n[2]];
+        } else {
+            fmmPrev2[t] = -1;
+        }
+
+    }
+
+    fmmTablesDone = 1;
+
+}
+
+#define fmmDegree(t) (fmmN[t][0] + fmmN[t][1] + fmmN[t][2])
+
+static void fmmInitPairs(int p) {
+
+    int a, b, i;
+
+    if (fmmPairsOrder == p)
+        return;
+
+    i = 0;
+    for (a = 0; a < fmmTerms[p]; a++) {
+
+        fmmPairStart[a] = i;
+
+        for (b = 0; b < fmmTerms[p - fmmDegree(a)]; b++) {
+            fmmPairB[i] = b;
+            fmmPairSum[i] = fmmIndex[fmmN[a][0] + fmmN[b][0]][fmmN[a][1] + fmmN[b][1]][fmmN[a][2] + fmmN[b][2]];
+            i++;
+        }
+
+    }
+
+    fmmPairStart[a] = i;
+    fmmPairsOrder = p;
+
+}
+
+/*
+ * d^n / n! for all terms up to degree p
+ */
+static void fmmMonomials(double *d, int p, double *mono) {
+
+    int t;
+
+    mono[0] = 1;
+
+    for (t = 1; t < fmmTerms[p]; t++)
+        mono[t] = mono[fmmPrev[t]] * d[fmmDim[t]] / fmmN[t][fmmDim[t]];
+
+}
+
+/*
+ * all derivatives of ln(|r|) (PROPER: -1/|r|) up to degree p.
+ * with u = r^2 / 2 and F(u) = ln(|r|), D[m][n] = d^n/dr^n F^(m)(u), so
+ * D[m][n] = r_i * D[m+1][n - e_i] + (n_i - 1) * D[m+1][n - 2 e_i]
+ * F'(u) is 1/r^2 (PROPER: 1/r^3), and every further derivative of F
+ * multiplies with -2m/r^2 (PROPER: -(2m+1)/r^2). With softening,
+ * u = (r^2 + softening^2) / 2 instead, du/dr_i is still r_i
+ */
+static void fmmDerivatives(double *r, int p, double *deriv) {
+
+    double D[FMM_MAX_ORDER + 1][FMM_MAX_TERMS];
+    double r2;
+    int m, s, t;
+
+    r2 = r[0] * r[0] + r[1] * r[1] + r[2] * r[2] + fmmSoft2;
+
+    // derivatives of F(u)
+    if (fmmPhysics == PH_PROPER) {
+        D[0][0] = -1 / sqrt(r2);
+        D[1][0] = -D[0][0] / r2;
+        for (m = 1; m < p; m++)
+            D[m + 1][0] = D[m][0] * -(2 * m + 1) / r2;
+    } else {
+        D[0][0] = 0.5 * log(r2);
+        D[1][0] = 1 / r2;
+        for (m = 1; m < p; m++)
+            D[m + 1][0] = D[m][0] * -2 * m / r2;
+    }
+
+    for (s = 1; s <= p; s++) {
+
+        for (m = 0; m <= p - s; m++) {
+
+            for (t = fmmTerms[s - 1]; t < fmmTerms[s]; t++) {
+
+                int i = fmmDim[t];
+
+                D[m][t] = r[i] * D[m + 1][fmmPrev[t]];
+
+                if (fmmPrev2[t] >= 0)
+                    D[m][t] += (fmmN[t][i] - 1) * D[m + 1][fmmPrev2[t]];
+
+            }
+
+        }
+
+    }
+
+    memcpy(deriv, D[0], sizeof(double) * fmmTerms[p]);
+
+}
+
+void fmmFreeMemory() {
+
+    free(fmmM);
+    free(fmmL);
+    free(fmmRadius);
+    free(fmmCell);
+    free(fmmTarget);
+
+    fmmM = fmmL = NULL;
+    fmmRadius = NULL;
+    fmmCell = NULL;
+    fmmTarget = NULL;
+
+    fmmCells = fmmCellsSize = 0;
+    fmmNodesSize = 0;
+    fmmTargets = 0;
+    fmmTermsUsed = 0;
+
+}
+
+#define fmmIsTarget(n) (fmmIsLeaf(n) || (n)->count <= fmmTargetCount)
+
+// number the cells (nodes that are not below a leaf cell), and find the targets
+static void fmmAddCells(int node, int belowTarget) {
+
+    node_t *n = otNodes + node;
+    int i;
+
+    fmmCell[node] = fmmCells++;
+
+    if (!belowTarget && fmmIsTarget(n)) {
+        fmmTarget[fmmTargets++] = node;
+        belowTarget = 1;
+    }
+
+    if (fmmIsLeaf(n))
+        return;
+
+    for (i = 0; i < n->children; i++)
+        fmmAddCells(n->child + i, belowTarget);
+
+}
+
+/*
+ * set up the expansions for the current tree. Has to be called once per
+ * frame, after otBuildTree().
+ * returns the number of targets, 0 if there is nothing to do
+ */
+int fmmPrepare(int threads) {
+
+    node_t *root;
+    int terms;
+
+    fmmCells = 0;
+    fmmTargets = 0;
+
+    root = otGetRoot();
+    if (!root)
+        return 0;
+
+    fmmInitTables();
+
+    fmmPhysics = state.physics;
+    fmmSoft2 = state.softening * state.softening;
+
+    fmmOrder = state.fmmOrder;
+    if (fmmOrder < 1)
+        fmmOrder = 1;
+    if (fmmOrder > FMM_MAX_ORDER)
+        fmmOrder = FMM_MAX_ORDER;
+
+    terms = fmmTerms[fmmOrder];
+    fmmInitPairs(fmmOrder);
+
+    // enough targets to keep all threads busy
+    fmmTargetCount = workingSet.count / (threads * 16);
+    if (fmmTargetCount < FMM_LEAF_SIZE)
+        fmmTargetCount = FMM_LEAF_SIZE;
+
+    // (re-)allocate. there are never more cells or targets than nodes
+    if (fmmNodesSize < otNodesUsed) {
+
+        free(fmmCell);
+        free(fmmTarget);
+        fmmNodesSize = otNodesUsed;
+        fmmCell = malloc(sizeof(int) * fmmNodesSize);
+        fmmTarget = malloc(sizeof(int) * fmmNodesSize);
+
+        if (!fmmCell || !fmmTarget) {
+            conAdd(LERR, "Could not allocate %lu bytes of memory for FMM cells", (unsigned long)(2 * sizeof(int) * fmmNodesSize));
+            fmmFreeMemory();
+            return 0;
+        }
+
+    }
+
+    fmmAddCells(root - otNodes, 0);
+
+    if (fmmCellsSize < fmmCells || fmmTermsUsed != terms) {
+
+        free(fmmM);
+        free(fmmL);
+        free(fmmRadius);
+        fmmCellsSize = fmmCells;
+        fmmTermsUsed = terms;
+        fmmM = malloc(sizeof(double) * terms * fmmCellsSize);
+        fmmL = malloc(sizeof(double) * terms * fmmCellsSize);
+        fmmRadius = malloc(sizeof(float) * fmmCellsSize);
+
+        if (!fmmM || !fmmL || !fmmRadius) {
+            conAdd(LERR, "Could not allocate %lu bytes of memory for FMM expansions", (unsigned long)((2 * sizeof(double) * terms + sizeof(float)) * fmmCellsSize));
+            fmmFreeMemory();
+            return 0;
+        }
+
+    }
+
+    memset(fmmL, 0, sizeof(double) * terms * fmmCells);
+
+    return fmmTargets;
+
+}
+
+/*
+ * multipole expansion of node, and all nodes below it.
+ * top: only the nodes above the targets, the targets are done already
+ */
+static void fmmUpwardRecursive(int node, int top) {
+
+    node_t *n = otNodes + node;
+    double *M = fmmM + fmmCell[node] * fmmTermsUsed;
+    double mono[FMM_MAX_TERMS];
+    float radius = 0;
+    int i, t;
+
+    if (top && fmmIsTarget(n))
+        return;
+
+    memset(M, 0, sizeof(double) * fmmTermsUsed);
+
+    if (fmmIsLeaf(n)) {
+
+        // P2M
+        for (i = n->first; i < n->first + n->count; i++) {
+
+            int j = otIndex[i];
+            double d[3];
+            float r;
+
+            d[0] = n->cm[0] - workingSet.x[j];
+            d[1] = n->cm[1] - workingSet.y[j];
+            d[2] = n->cm[2] - workingSet.z[j];
+
+            r = (float)sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+            if (r > radius)
+                radius = r;
+
+            fmmMonomials(d, fmmOrder, mono);
+            for (t = 0; t < fmmTermsUsed; t++)
+                M[t] += workingSet.mass[j] * mono[t];
+
+        }
+
+    } else {
+
+        // M2M
+        for (i = 0; i < n->children; i++) {
+
+            int c = n->child + i;
+            node_t *b = otNodes + c;
+            double *Mc;
+            double d[3];
+            float r;
+
+            fmmUpwardRecursive(c, top);
+
+            Mc = fmmM + fmmCell[c] * fmmTermsUsed;
+
+            d[0] = n->cm[0] - b->cm[0];
+            d[1] = n->cm[1] - b->cm[1];
+            d[2] = n->cm[2] - b->cm[2];
+
+            r = (float)sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]) + fmmRadius[fmmCell[c]];
+            if (r > radius)
+                radius = r;
+
+            fmmMonomials(d, fmmOrder, mono);
+
+            // M[a + b] += d^a / a! * Mc[b]
+            for (t = 0; t < fmmTermsUsed; t++) {
+
+                int k;
+
+                for (k = fmmPairStart[t]; k < fmmPairStart[t + 1]; k++)
+                    M[fmmPairSum[k]] += mono[t] * Mc[fmmPairB[k]];
+
+            }
+
+        }
+
+    }
+
+    fmmRadius[fmmCell[node]] = radius;
+
+}
+
+/*
+ * multipole expansions of the targets handed out by workNext().
+ * With OpenMP, this is called once and spawns the threads itself.
+ */
+void fmmUpward(int thread) {
+
+    int t;
+#ifndef _OPENMP
+    int start, end;
+
+    while (workNext(thread, 1, &start, &end))
+        for (t = start; t < end; t++)
+            fmmUpwardRecursive(fmmTarget[t], 0);
+#else
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (t = 0; t < fmmTargets; t++)
+        fmmUpwardRecursive(fmmTarget[t], 0);
+#endif
+
+}
+
+// multipole expansions of the nodes above the targets, after fmmUpward()
+void fmmUpwardTop() {
+
+    node_t *root = otGetRoot();
+
+    if (root && fmmTargets)
+        fmmUpwardRecursive(root - otNodes, 1);
+
+}
+
+/*
+ * block time steps: drop the targets without active particles, after
+ * fmmUpwardTop() - the expansions still need all of them.
+ * returns the number of targets that are left
+ */
+int fmmActiveTargets() {
+
+    node_t *n;
+    int t, i, k;
+
+    if (workingSet.activeCount >= workingSet.count)
+        return fmmTargets;
+
+    k = 0;
+    for (t = 0; t < fmmTargets; t++) {
+
+        n = otNodes + fmmTarget[t];
+        for (i = n->first; i < n->first + n->count; i++)
+            if (workingSet.active[otIndex[i]])
+                break;
+
+        if (i < n->first + n->count)
+            fmmTarget[k++] = fmmTarget[t];
+
+    }
+
+    fmmTargets = k;
+    return k;
+
+}
+
+/*
+ * M2L: add the expansion of cell s to the local expansion of cell t
+ */
+static void fmmM2L(int t, int s, double *r) {
+
+    double D[FMM_MAX_TERMS];
+    double *M = fmmM + fmmCell[s] * fmmTermsUsed;
+    double *L = fmmL + fmmCell[t] * fmmTermsUsed;
+    int k, n;
+
+    fmmDerivatives(r, fmmOrder, D);
+
+    // L[k] += sum over n of M[n] * D[n + k], up to the expansion order
+    for (k = 0; k < fmmTermsUsed; k++) {
+
+        double sum = 0;
+
+        for (n = fmmPairStart[k]; n < fmmPairStart[k + 1]; n++)
+            sum += M[fmmPairB[n]] * D[fmmPairSum[n]];
+
+        L[k] += sum;
+
+    }
+
+}
+
+/*
+ * P2P: add the particles of s to the particles of t, one by one.
+ * the sum (without g and the mass of the target particle) goes to workingSet.ax
+ */
+KERNEL_INLINE void fmmP2PKernel(node_t *t, node_t *s, const int physics) {
+
+    int i, j;
+
+    for (i = t->first; i < t->first + t->count; i++) {
+
+        int pi = otIndex[i];
+        VectorNew(pos);
+        VectorNew(acc);
+
+        // block time steps: the others keep their acceleration
+        if (workingSet.activeCount < workingSet.count && !workingSet.active[pi])
+            continue;
+
+        pos[0] = workingSet.x[pi];
+        pos[1] = workingSet.y[pi];
+        pos[2] = workingSet.z[pi];
+        VectorZero(acc);
+
+        for (j = s->first; j < s->first + s->count; j++) {
+
+            int pj = otIndex[j];
+            VectorNew(dv);
+            float d;
+            float force;
+
+            dv[0] = pos[0] - workingSet.x[pj];
+            dv[1] = pos[1] - workingSet.y[pj];
+            dv[2] = pos[2] - workingSet.z[pj];
+            d = dv[0] * dv[0] + dv[1] * dv[1] + dv[2] * dv[2];
+
+            // also skips the particle itself
+            if (!d)
+                continue;
+            d += fmmSoft2;
+
+            force = workingSet.mass[pj] / ppLawDivisor(d, physics);
+            VectorMultiplyAdd(dv, force, acc);
+
+        }
+
+        workingSet.ax[pi] += acc[0];
+        workingSet.ay[pi] += acc[1];
+        workingSet.az[pi] += acc[2];
+
+    }
+
+}
+
+static void fmmP2P(node_t *t, node_t *s) {
+
+    if (fmmPhysics == PH_PROPER)
+        fmmP2PKernel(t, s, PH_PROPER);
+    else
+        fmmP2PKernel(t, s, PH_CLASSIC);
+
+}
+
+/*
+ * everything that cell s does to cell t: expansions if they are far enough
+ * apart, otherwise split the bigger one. only writes to t and below.
+ */
+static void fmmInteract(int t, int s) {
+
+    node_t *nt = otNodes + t;
+    node_t *ns = otNodes + s;
+    float rt, rs;
+    double r[3];
+    int i;
+
+    if (ns->mass == 0)
+        return;
+
+    rt = fmmRadius[fmmCell[t]];
+    rs = fmmRadius[fmmCell[s]];
+
+    r[0] = nt->cm[0] - ns->cm[0];
+    r[1] = nt->cm[1] - ns->cm[1];
+    r[2] = nt->cm[2] - ns->cm[2];
+
+    if (t != s && (rt + rs) * (rt + rs) < FMM_THETA * FMM_THETA * (r[0] * r[0] + r[1] * r[1] + r[2] * r[2])) {
+        fmmM2L(t, s, r);
+        return;
+    }
+
+    if (fmmIsLeaf(nt) && fmmIsLeaf(ns)) {
+        fmmP2P(nt, ns);
+        return;
+    }
+
+    if (fmmIsLeaf(nt) || (!fmmIsLeaf(ns) && rs > rt)) {
+
+        for (i = 0; i < ns->children; i++)
+            fmmInteract(t, ns->child + i);
+
+    } else {
+
+        for (i = 0; i < nt->children; i++)
+            fmmInteract(nt->child + i, s);
+
+    }
+
+}
+
+/*
+ * shift the local expansion of node down to its children (L2L), and
+ * evaluate it at the particles of the leaves (L2P)
+ */
+static void fmmDownwardRecursive(int node) {
+
+    node_t *n = otNodes + node;
+    double *L = fmmL + fmmCell[node] * fmmTermsUsed;
+    double mono[FMM_MAX_TERMS];
+    int i, k, m;
+
+    if (fmmIsLeaf(n)) {
+
+        // L2P: the gradient of the potential is the expansion of L[k + e_i]
+        for (i = n->first; i < n->first + n->count; i++) {
+
+            int j = otIndex[i];
+            double d[3];
+            double grad[3];
+            float f;
+
+            if (workingSet.activeCount < workingSet.count && !workingSet.active[j])
+                continue;
+
+            d[0] = workingSet.x[j] - n->cm[0];
+            d[1] = workingSet.y[j] - n->cm[1];
+            d[2] = workingSet.z[j] - n->cm[2];
+
+            fmmMonomials(d, fmmOrder - 1, mono);
+
+            grad[0] = grad[1] = grad[2] = 0;
+            for (k = 0; k < fmmTerms[fmmOrder - 1]; k++) {
+                grad[0] += mono[k] * L[fmmIndex[fmmN[k][0] + 1][fmmN[k][1]][fmmN[k][2]]];
+                grad[1] += mono[k] * L[fmmIndex[fmmN[k][0]][fmmN[k][1] + 1][fmmN[k][2]]];
+                grad[2] += mono[k] * L[fmmIndex[fmmN[k][0]][fmmN[k][1]][fmmN[k][2] + 1]];
+            }
+
+            f = state.g * PHYSICS_MASS(fmmPhysics, workingSet.mass[j]);
+            workingSet.ax[j] = (workingSet.ax[j] + (float)grad[0]) * f;
+            workingSet.ay[j] = (workingSet.ay[j] + (float)grad[1]) * f;
+            workingSet.az[j] = (workingSet.az[j] + (float)grad[2]) * f;
+
+        }
+
+        return;
+
+    }
+
+    for (i = 0; i < n->children; i++) {
+
+        int c = n->child + i;
+        node_t *b = otNodes + c;
+        double *Lc = fmmL + fmmCell[c] * fmmTermsUsed;
+        double d[3];
+
+        d[0] = b->cm[0] - n->cm[0];
+        d[1] = b->cm[1] - n->cm[1];
+        d[2] = b->cm[2] - n->cm[2];
+
+        fmmMonomials(d, fmmOrder, mono);
+
+        // Lc[k] += sum over m of d^m / m! * L[k + m]
+        for (k = 0; k < fmmTermsUsed; k++)
+            for (m = fmmPairStart[k]; m < fmmPairStart[k + 1]; m++)
+                Lc[k] += mono[fmmPairB[m]] * L[fmmPairSum[m]];
+
+        fmmDownwardRecursive(c);
+
+    }
+
+}
+
+static void fmmProcessTarget(int t) {
+
+    node_t *root = otGetRoot();
+
+    fmmInteract(fmmTarget[t], root - otNodes);
+    fmmDownwardRecursive(fmmTarget[t]);
+
+    atomicFetchAdd(&view.recordParticlesDone, otNodes[fmmTarget[t]].count);
+
+}
+
+/*
+ * forces for the targets handed out by workNext(), after fmmUpwardTop().
+ * With OpenMP, this is called once and spawns the threads itself.
+ */
+void processFrameFMM(int thread) {
+
+    int t;
+#ifndef _OPENMP
+    int start, end;
+
+    while (workNext(thread, 1, &start, &end)) {
+
+        // only the main thread may draw
+        if (poolMainThread()) {
+            doVideoUpdate();
+        }
+
+        for (t = start; t < end; t++)
+            if (state.mode & SM_RECORD)
+                fmmProcessTarget(t);
+
+    }
+#else
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (t = 0; t < fmmTargets; t++) {
+
+	// only main thread may do this
+        if (omp_get_thread_num() == 0) {doVideoUpdate2();}
+
+        if (state.mode & SM_RECORD)
+            fmmProcessTarget(t);
+
+    }
+#endif
+
+}
@@ -27,114 +27,341 @@ Foundation, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
 #endif
 
 
-void otBranchNode(node_t *n);
+/*  Tree construction:
+    ===================
+    Particles are not searched box by box any more. Instead, the tree keeps
+    an array of particle indices (otIndex), and every node owns a contiguous
+    range [first, first+count) of it. Branching a node sorts its range into
+    the eight octants (one counting pass, one scatter pass), so each level
+    of the tree only touches the particles that actually live in it.
+    --> building the tree is O(N log N) instead of O(N * nodes)
+
+    Particles that can not be separated any more (same position, or
+    OT_MAX_DEPTH reached) stay together in one leaf "bucket".
+
+    Node pool:
+    ==========
+    Nodes are not malloc()ed one by one. They come from one big array
+    (otNodes) which is simply reset when the tree is freed. All children
+    of a node are allocated in one block, so a node only needs the index
+    of its first child and the number of children.
+    If the pool runs full, the tree is built again with a bigger pool.
+
+    Opening criterion:
+    ==================
+    A node is used as a whole if it is seen under an angle smaller than
+    theta (state.theta, (node size / distance)^2 < theta^2), otherwise its
+    children are visited. Optionally the nodes also carry their quadrupole
+    moment, which makes the far field a lot more accurate - so the same
+    accuracy is reached with a bigger theta, and fewer nodes are opened.
+
+    Group walk:
+    ===========
+    The tree is not walked once per particle. Particles that are close to
+    each other (the biggest nodes with at most OT_GROUP_SIZE particles) walk
+    it together: the criterion above is checked from the point of the
+    group's bounding box that is closest to the node, so the resulting
+    interaction list is good enough for every particle of the group.
+    The list is then added up for each particle with the vector kernels of
+    frame-pp_sse.c - no recursion and no branches in the inner loop.
+*/
+
+#define OT_MAX_DEPTH 32
+
+void otBranchNode(node_t *n, int depth);
 
 static node_t *r = NULL;
 
+// node pool, r == otNodes when there is a tree
+node_t *otNodes = NULL;
+static int otNodesSize = 0;
+int otNodesUsed = 0;
+static int otNodesFull = 0;
+
+// particle indices, ordered so that every node owns a contiguous range
+int *otIndex = NULL;
+static int *otIndexTmp = NULL;
+static int otIndexSize = 0;
+
+// groups of particles that share one interaction list
+#define OT_GROUP_SIZE 64
+static int *otGroup = NULL;
+static int otGroups = 0;
+static int otGroupSize = 0;
+
+// interaction lists are padded to a multiple of this (AVX-512: 16 floats)
+#define OT_LIST_PAD 16
+
+// interaction list of a group, one per thread
+typedef struct {
+
+    particle_vectors p;     // particles, and nodes used as a point mass
+    float *block;           // p.x, p.y, p.z and p.mass live in this allocation
+    int count;
+    int size;
+
+    quad_vectors n;         // nodes that also pull with their quadrupole moment
+    float *nodeBlock;
+    int nodeCount;
+    int nodeSize;
+
+} otList_t;
+
+static otList_t otLists[MAX_THREADS];
+static int otListFailed = 0;
+
+#ifdef HAVE_SSE
+#define otListKernel processListPP_SSE
+#define otListQuadKernel processListQuadPP_SSE
+#else
+#define otListKernel processListPP
+#define otListQuadKernel processListQuadPP
+#endif
+
+// settings the current tree was built with
+static float otTheta2 = 0.25f;
+static int otQuadrupoles = 0;
+static int otPhysics = PH_CLASSIC;
+static float otSoft2 = 0;
+static int otMixed = 0;
+
 #ifdef _OPENMP
 static int master_thread_id = 0;
 #endif
 
 void otGetBoundingBox(float *otMin, float *otMax) {
 
-    particle_t *p;
     int i;
-    int j;
 
-    p = state.particleHistory + state.particleCount * state.frame;
+    otMin[0] = otMax[0] = workingSet.x[0];
+    otMin[1] = otMax[1] = workingSet.y[0];
+    otMin[2] = otMax[2] = workingSet.z[0];
 
-    VectorCopy(p->pos, otMin);
-    VectorCopy(p->pos, otMax);
+    for (i = 1; i < workingSet.count; i++) {
 
-    for (i = 1; i < state.particleCount; i++) {
+        if (workingSet.x[i] < otMin[0]) otMin[0] = workingSet.x[i];
+        if (workingSet.x[i] > otMax[0]) otMax[0] = workingSet.x[i];
+        if (workingSet.y[i] < otMin[1]) otMin[1] = workingSet.y[i];
+        if (workingSet.y[i] > otMax[1]) otMax[1] = workingSet.y[i];
+        if (workingSet.z[i] < otMin[2]) otMin[2] = workingSet.z[i];
+        if (workingSet.z[i] > otMax[2]) otMax[2] = workingSet.z[i];
 
-        p = state.particleHistory + state.particleCount * state.frame + i;
+    }
 
-        for (j = 0; j < 3; j++) {
+}
 
-            if (p->pos[j] < otMin[j])
-                otMin[j] = p->pos[j];
-            if (p->pos[j] > otMax[j])
-                otMax[j] = p->pos[j];
+// octant of particle i relative to the center c: bit 0 -> x, bit 1 -> y, bit 2 -> z
+#define otOctant(c, i) ( (workingSet.x[i] >= (c)[0]) | ((workingSet.y[i] >= (c)[1]) << 1) | ((workingSet.z[i] >= (c)[2]) << 2) )
 
-        }
+/*
+ * get a block of count nodes from the pool. returns the index of the first
+ * one, or -1 if the pool is full
+ */
+static int otAllocNodes(int count) {
 
+    int i;
+
+    i = atomicFetchAdd(&otNodesUsed, count);
+
+    if (i + count > otNodesSize) {
+        otNodesFull = 1;
+        return -1;
     }
 
+    return i;
+
 }
 
-int otGetParticleInBox(float *min, float *max, particle_t **gp, float *m, float *cm) {
+static int otResizeNodes(int size) {
 
-    int c = 0;
-    particle_t *p;
-    particleDetail_t *pd;
-    int i;
+    free(otNodes);
+    otNodes = malloc(sizeof(node_t) * size);
 
-    VectorNew(vec);
+    if (!otNodes) {
+        conAdd(LERR, "Could not allocate %lu bytes of memory for octree", (unsigned long)(sizeof(node_t) * size));
+        otNodesSize = 0;
+        return 0;
+    }
 
-    memset(cm, 0, sizeof(float) * 3);
+    otNodesSize = size;
+    return 1;
 
-    *gp = NULL;
-    *m = 0;
+}
 
-    for (i = 0; i < state.particleCount; i++) {
+/*
+ * sort the particles of node n into its eight octants.
+ * afterwards octant k owns otIndex[first[k] .. first[k]+count[k]-1],
+ * mass[k] and cm[k] are the total mass and center of mass of octant k.
+ */
+static void otPartitionNode(node_t *n, int *first, int *count, float *mass, float cm[8][3]) {
+
+    int *idx;
+    int *tmp;
+    int offset[8];
+    int i, k;
+
+    idx = otIndex + n->first;
+    tmp = otIndexTmp + n->first;
+
+    for (k = 0; k < 8; k++) {
+        count[k] = 0;
+        mass[k] = 0;
+        VectorZero(cm[k]);
+    }
 
-        p = state.particleHistory + state.particleCount * state.frame + i;
-        pd = state.particleDetail + i;
+    // count particles per octant, sum up mass and center of mass
+    for (i = 0; i < n->count; i++) {
 
-        if (p->pos[0] < min[0])
-            continue;
-        if (p->pos[0] > max[0])
-            continue;
-        if (p->pos[1] < min[1])
-            continue;
-        if (p->pos[1] > max[1])
-            continue;
-        if (p->pos[2] < min[2])
-            continue;
-        if (p->pos[2] > max[2])
-            continue;
+        int j = idx[i];
+        float m = workingSet.mass[j];
 
-        *m += pd->mass;
-        *gp = p;
-        VectorCopy(p->pos, vec);
-        VectorMultiply(vec, pd->mass, vec);
-        VectorAdd(cm, vec, cm);
+        k = otOctant(n->c, j);
+        count[k]++;
+        mass[k] += m;
+        cm[k][0] += workingSet.x[j] * m;
+        cm[k][1] += workingSet.y[j] * m;
+        cm[k][2] += workingSet.z[j] * m;
 
-        c++;
+    }
+
+    offset[0] = 0;
+    for (k = 1; k < 8; k++)
+        offset[k] = offset[k-1] + count[k-1];
+
+    for (k = 0; k < 8; k++) {
+
+        first[k] = n->first + offset[k];
+
+        if (mass[k] != 0) {
+            VectorDivide(cm[k], mass[k], cm[k]);
+        }
 
     }
 
-    VectorDivide(cm, *m, cm);
+    // scatter indices into their octant ranges, then copy back
+    for (i = 0; i < n->count; i++) {
+
+        k = otOctant(n->c, idx[i]);
+        tmp[offset[k]++] = idx[i];
 
-    return c;
+    }
+
+    memcpy(idx, tmp, sizeof(int) * n->count);
 
 }
 
-void otBranchNodeCorner(node_t *n, int br, float *min, float *max) {
+/*
+ * quadrupole moment of the particles of node n around its center of mass
+ */
+static void otNodeQuadrupole(node_t *n) {
+
+    double q[6];
+    int i, k;
 
-    float mass;
-    particle_t *p;
+    for (k = 0; k < 6; k++)
+        q[k] = 0;
 
-    node_t *b;
-    int c;
+    for (i = n->first; i < n->first + n->count; i++) {
 
-    VectorNew(cm);
+        int j = otIndex[i];
+        double m = workingSet.mass[j];
+        double d[3];
 
-    c = otGetParticleInBox(min, max, &p, &mass, (float*)&cm);
+        d[0] = workingSet.x[j] - n->cm[0];
+        d[1] = workingSet.y[j] - n->cm[1];
+        d[2] = workingSet.z[j] - n->cm[2];
 
-    if (c == 0)
-        return;
+        q[0] += m * d[0] * d[0];
+        q[1] += m * d[1] * d[1];
+        q[2] += m * d[2] * d[2];
+        q[3] += m * d[0] * d[1];
+        q[4] += m * d[0] * d[2];
+        q[5] += m * d[1] * d[2];
+
+    }
+
+    for (k = 0; k < 6; k++)
+        n->quad[k] = (float)q[k];
+
+}
+
+/*
+ * add the pull of node b at pos to force (without g and the mass of the
+ * particle at pos). dv = pos - b->cm, d = |dv|^2
+ *
+ * a particle pulls with m * dv / d, the gradient of m * ln(r). Around
+ * the center of mass this is expanded to
+ *   mass * dv / d - (tr(Q) dv + 2 Q dv) / d^2 + 4 (dv Q dv) dv / d^3
+ * with PROPER physics, m * dv / d^1.5 is the gradient of -m / r, and
+ *   (mass - (1.5 tr(Q) - 7.5 (dv Q dv) / d) / d) dv / d^1.5 - 3 Q dv / d^2.5
+ * both hold for the softened potential as well, with d = |dv|^2 + softening^2
+ */
+static void otNodeForce(node_t *b, float *dv, float d, float *force) {
+
+    float f;
+    float s = 0;
+
+    d += otSoft2;
+
+    if (otPhysics == PH_PROPER) {
+        s = 1 / (d * sqrtf(d));
+        f = b->mass * s;
+    } else {
+        f = b->mass / d;
+    }
+
+    if (otQuadrupoles && b->count > 1) {
+
+        VectorNew(qdv);
+        float trace;
+        float dqd;
+        float d2;
+
+        qdv[0] = b->quad[0] * dv[0] + b->quad[3] * dv[1] + b->quad[4] * dv[2];
+        qdv[1] = b->quad[3] * dv[0] + b->quad[1] * dv[1] + b->quad[5] * dv[2];
+        qdv[2] = b->quad[4] * dv[0] + b->quad[5] * dv[1] + b->quad[2] * dv[2];
+
+        trace = b->quad[0] + b->quad[1] + b->quad[2];
+        dqd = dv[0] * qdv[0] + dv[1] * qdv[1] + dv[2] * qdv[2];
+
+        if (otPhysics == PH_PROPER) {
+
+            f += (7.5f * dqd / d - 1.5f * trace) / d * s;
+            VectorMultiplyAdd(qdv, -3 * s / d, force);
+
+        } else {
+
+            d2 = d * d;
 
-    view.recordNodes++;
-    n->b[br] = malloc(sizeof(node_t));
-    b = (node_t *)n->b[br];
+            f += (4 * dqd / d - trace) / d2;
+            VectorMultiplyAdd(qdv, -2 / d2, force);
+
+        }
+
+    }
+
+    VectorMultiplyAdd(dv, f, force);
+
+}
+
+void otBranchNodeCorner(node_t *n, node_t *b, int br, int first, int count, float mass, float *cm, int depth) {
+
+    int j;
 
     memset(b, 0, sizeof(node_t));
 
-    VectorCopy(min, b->min);
-    VectorCopy(max, b->max);
-    VectorCopy(cm, b->cm);
+    // box of octant br: lower or upper half in each dimension
+    for (j = 0; j < 3; j++) {
+
+        if (br & (1 << j)) {
+            b->min[j] = n->c[j];
+            b->max[j] = n->max[j];
+        } else {
+            b->min[j] = n->min[j];
+            b->max[j] = n->c[j];
+        }
+
+    }
 
     // Gets Center of min/max
     VectorSub(b->max, b->min, b->c);
@@ -144,27 +371,48 @@ void otBranchNodeCorner(node_t *n, int br, float *min, float *max) {
     // Get Length of node
     distance2(b->min, b->max, b->length2);
 
+    b->first = first;
+    b->count = count;
     b->mass = mass;
 
-    if (c == 1) {
+    if (mass != 0) {
+        VectorCopy(cm, b->cm);
+    } else {
+        VectorCopy(b->c, b->cm);
+    }
+
+    if (otQuadrupoles && count > 1)
+        otNodeQuadrupole(b);
+
+    if (count == 1) {
 
-        b->p = p;
-        VectorCopy(p->pos, b->cm);
+        b->cm[0] = workingSet.x[otIndex[first]];
+        b->cm[1] = workingSet.y[otIndex[first]];
+        b->cm[2] = workingSet.z[otIndex[first]];
         view.recordParticlesDone++;
 
+    } else if ((depth < OT_MAX_DEPTH) && (b->length2 > 0)) {
+
+        otBranchNode(b, depth + 1);
 
     } else {
 
-        otBranchNode(b);
+        // can't split any further - keep all particles in this leaf
+        view.recordParticlesDone += count;
 
     }
 
 }
 
-void otBranchNode(node_t *n) {
+void otBranchNode(node_t *n, int depth) {
 
-    VectorNew(min);
-    VectorNew(max);
+    int first[8];
+    int count[8];
+    float mass[8];
+    float cm[8][3];
+    int children;
+    node_t *b;
+    int i;
 
 #ifdef _OPENMP
     if(omp_get_thread_num() == master_thread_id) {doVideoUpdate2();}
@@ -174,179 +422,201 @@ void otBranchNode(node_t *n) {
     doVideoUpdate();
 #endif
 
-    // b[0]: top left front
-    min[0] = n->min[0];
-    max[0] = n->c[0];
-    min[1] = n->min[1];
-    max[1] = n->c[1];
-    min[2] = n->min[2];
-    max[2] = n->c[2];
-    otBranchNodeCorner(n, 0, (float*)&min, (float*)&max);
-
-    // b[1]: top right front
-    min[0] = n->c[0];
-    max[0] = n->max[0];
-    otBranchNodeCorner(n, 1, (float*)&min, (float*)&max);
-
-    // b[2]: bottom right front
-    min[1] = n->c[1];
-    max[1] = n->max[1];
-    otBranchNodeCorner(n, 2, (float*)&min, (float*)&max);
-
-    // b[3]: bottom left front
-    min[0] = n->min[0];
-    max[0] = n->c[0];
-    otBranchNodeCorner(n, 3, (float*)&min, (float*)&max);
-
-    // b[4]: top left back
-    min[1] = n->min[1];
-    max[1] = n->c[1];
-    min[2] = n->c[2];
-    max[2] = n->max[2];
-    otBranchNodeCorner(n, 4, (float*)&min, (float*)&max);
-
-    // b[5]: top right back
-    min[0] = n->c[0];
-    max[0] = n->max[0];
-    otBranchNodeCorner(n, 5, (float*)&min, (float*)&max);
-
-    // b[6]: bottom right back
-    min[1] = n->c[1];
-    max[1] = n->max[1];
-    otBranchNodeCorner(n, 6, (float*)&min, (float*)&max);
-
-    // b[7]: bottom left back
-    min[0] = n->min[0];
-    max[0] = n->c[0];
-    otBranchNodeCorner(n, 7, (float*)&min, (float*)&max);
+    otPartitionNode(n, first, count, mass, cm);
+
+    children = 0;
+    for (i = 0; i < 8; i++)
+        if (count[i])
+            children++;
+
+    n->child = otAllocNodes(children);
+
+    if (n->child < 0) {
+        // pool is full. the tree gets built again anyway, stop here
+        view.recordParticlesDone += n->count;
+        return;
+    }
+
+    n->children = children;
+    b = otNodes + n->child;
+
+    for (i = 0; i < 8; i++)
+        if (count[i])
+            otBranchNodeCorner(n, b++, i, first[i], count[i], mass[i], cm[i], depth);
 
 }
 
 // copy of otBranchNode(). spawns 8 threads, one for each sub-tree
 void otBranchNode_top(node_t *n) {
 
-    VectorNew(min[8]);
-    VectorNew(max[8]);
+    int first[8];
+    int count[8];
+    float mass[8];
+    float cm[8][3];
+    int octant[8];
+    int children;
     int i;
 
     doVideoUpdate();
 
-    // b[0]: top left front
-    min[0][0] = n->min[0];
-    max[0][0] = n->c[0];
-    min[0][1] = n->min[1];
-    max[0][1] = n->c[1];
-    min[0][2] = n->min[2];
-    max[0][2] = n->c[2];
-
-    // b[1]: top right front
-    VectorCopy(min[0], min[1]);
-    VectorCopy(max[0], max[1]);
-    min[1][0] = n->c[0];
-    max[1][0] = n->max[0];
-
-    // b[2]: bottom right front
-    VectorCopy(min[1], min[2]);
-    VectorCopy(max[1], max[2]);
-    min[2][1] = n->c[1];
-    max[2][1] = n->max[1];
-
-    // b[3]: bottom left front
-    VectorCopy(min[2], min[3]);
-    VectorCopy(max[2], max[3]);
-    min[3][0] = n->min[0];
-    max[3][0] = n->c[0];
-
-    // b[4]: top left back
-    VectorCopy(min[3], min[4]);
-    VectorCopy(max[3], max[4]);
-    min[4][1] = n->min[1];
-    max[4][1] = n->c[1];
-    min[4][2] = n->c[2];
-    max[4][2] = n->max[2];
-
-    // b[5]: top right back
-    VectorCopy(min[4], min[5]);
-    VectorCopy(max[4], max[5]);
-    min[5][0] = n->c[0];
-    max[5][0] = n->max[0];
-
-    // b[6]: bottom right back
-    VectorCopy(min[5], min[6]);
-    VectorCopy(max[5], max[6]);
-    min[6][1] = n->c[1];
-    max[6][1] = n->max[1];
-
-    // b[7]: bottom left back
-    VectorCopy(min[6], min[7]);
-    VectorCopy(max[6], max[7]);
-    min[7][0] = n->min[0];
-    max[7][0] = n->c[0];
+    otPartitionNode(n, first, count, mass, cm);
 
+    children = 0;
+    for (i = 0; i < 8; i++)
+        if (count[i])
+            octant[children++] = i;
+
+    n->child = otAllocNodes(children);
+
+    if (n->child < 0)
+        return;
+
+    n->children = children;
 
+    // sub-trees own disjoint ranges of otIndex, so they can be built in parallel
 #ifdef _OPENMP
     master_thread_id = omp_get_thread_num();
     #pragma omp parallel for schedule(dynamic, 1)
 #endif
-    for (i=0; i<8; i++)
-      otBranchNodeCorner(n, i, (float*)&min[i], (float*)&max[i]);
+    for (i=0; i<children; i++) {
+      int k = octant[i];
+      otBranchNodeCorner(n, otNodes + n->child + i, k, first[k], count[k], mass[k], cm[k], 1);
+    }
 
 }
 
 void otMakeTree() {
 
-    particle_t *p;
+    node_t root;
     node_t *n;
+    int i;
 
-    // make root node
-    r = malloc(sizeof(node_t));
-    memset(r, 0, sizeof(node_t));
-    view.recordNodes = 1;
+    if (workingSet.count < 1)
+        return;
+
+    // (re-)allocate index arrays
+    if (otIndexSize < workingSet.count) {
+
+        free(otIndex);
+        free(otIndexTmp);
+        otIndex = malloc(sizeof(int) * workingSet.count);
+        otIndexTmp = malloc(sizeof(int) * workingSet.count);
+
+        if (!otIndex || !otIndexTmp) {
+            conAdd(LERR, "Could not allocate %lu bytes of memory for octree", (unsigned long)(2 * sizeof(int) * workingSet.count));
+            free(otIndex);
+            free(otIndexTmp);
+            otIndex = otIndexTmp = NULL;
+            otIndexSize = 0;
+            return;
+        }
+
+        otIndexSize = workingSet.count;
+
+    }
+
+    // usually there are less than two nodes per particle
+    if (otNodesSize < workingSet.count * 2 + 8) {
+        if (!otResizeNodes(workingSet.count * 2 + 8))
+            return;
+    }
 
-    n = r;
+    // make root node
+    n = otNodes;
+    memset(n, 0, sizeof(node_t));
+    n->first = 0;
+    n->count = workingSet.count;
 
     otGetBoundingBox((float*)&n->min, (float*)&n->max);
-    otGetParticleInBox((float*)&n->min, (float*)&n->max, &p, &n->mass, (float*)&n->cm);
+
+    for (i = 0; i < workingSet.count; i++) {
+        otIndex[i] = i;
+        n->mass += workingSet.mass[i];
+        n->cm[0] += workingSet.x[i] * workingSet.mass[i];
+        n->cm[1] += workingSet.y[i] * workingSet.mass[i];
+        n->cm[2] += workingSet.z[i] * workingSet.mass[i];
+    }
 
     // Gets Center of min/max
     VectorSub(n->max, n->min, n->c);
     VectorDivide(n->c, 2, n->c);
     VectorAdd(n->c, n->min, n->c);
 
+    if (n->mass != 0) {
+        VectorDivide(n->cm, n->mass, n->cm);
+    } else {
+        VectorCopy(n->c, n->cm);
+    }
+
     // get length
     distance2(n->min, n->max, n->length2);
 
-    otBranchNode_top(n);
+    for (;;) {
 
-}
+        otNodesUsed = 1;
+        otNodesFull = 0;
+        view.recordParticlesDone = 0;
 
-void otFreeTreeRecursive(node_t *n) {
+        otBranchNode_top(otNodes);
 
-    int i;
+        if (!otNodesFull || !(state.mode & SM_RECORD))
+            break;
 
-    if (!n)
-        return;
+        // pool was too small, try again with twice the size
+        memcpy(&root, otNodes, sizeof(node_t));
+        if (!otResizeNodes(otNodesSize * 2))
+            return;
+        memcpy(otNodes, &root, sizeof(node_t));
 
-    for (i = 0; i < 8; i++) {
+    }
 
-        if (n->b[i]) {
-            otFreeTreeRecursive((node_t *)n->b[i]);
-            n->b[i] = 0;
-        }
+    r = otNodes;
+    view.recordNodes = otNodesUsed;
 
-    }
+}
 
-    free(n);
-    view.recordNodes--;
+// the root of the tree, NULL if there is none
+node_t *otGetRoot() {
+
+    return r;
 
 }
 
+// freeing the tree just resets the node pool
 void otFreeTree() {
 
-    view.recordStatus = 2;
-    otFreeTreeRecursive(r);
     r = NULL;
-    view.recordStatus = 0;
+    otNodesUsed = 0;
+    view.recordNodes = 0;
+
+}
+
+// release the memory used by the tree
+void otFreeMemory() {
+
+    int i;
+
+    otFreeTree();
+
+    free(otNodes);
+    otNodes = NULL;
+    otNodesSize = 0;
+
+    free(otIndex);
+    free(otIndexTmp);
+    otIndex = otIndexTmp = NULL;
+    otIndexSize = 0;
+
+    free(otGroup);
+    otGroup = NULL;
+    otGroupSize = 0;
+    otGroups = 0;
+
+    for (i = 0; i < MAX_THREADS; i++) {
+        FREE_ALIGNED(otLists[i].block);
+        FREE_ALIGNED(otLists[i].nodeBlock);
+    }
+    memset(otLists, 0, sizeof(otLists));
 
 }
 
@@ -364,7 +634,7 @@ void otDrawTreeRecursive(node_t *n) {
         // line mode
     case 1:
     default:
-        if (n->p)
+        if (n->count == 1)
             glColor4f(0, 0, 1.0f, 1);
         else
             glColor4f(0, 0, 0.25f, 1);
@@ -372,7 +642,7 @@ void otDrawTreeRecursive(node_t *n) {
 
         // fill mode
     case 2:
-        if (n->p)
+        if (n->count == 1)
             glColor4f(0, 0, 1.0f, 0.1f);
         else
             glColor4f(0, 0, 1.0f, 0.05f);
@@ -388,9 +658,8 @@ void otDrawTreeRecursive(node_t *n) {
     drawCube();
     glPopMatrix();
 
-    for (i = 0; i < 8; i++)
-        if (n->b[i])
-            otDrawTreeRecursive((node_t *)n->b[i]);
+    for (i = 0; i < n->children; i++)
+        otDrawTreeRecursive(otNodes + n->child + i);
 
 }
 
@@ -415,7 +684,11 @@ void otDrawTree() {
 
     }
 
+    // the tree is built from the working set, which may be relative to an origin
+    glPushMatrix();
+    glTranslated(workingSet.origin[0], workingSet.origin[1], workingSet.origin[2]);
     otDrawTreeRecursive(r);	// doit
+    glPopMatrix();
 
     glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);	// cleanup
 
@@ -423,140 +696,505 @@ void otDrawTree() {
 
 #endif
 
-void otComputeParticleToTreeRecursive(pttr_t *info) {
+/*
+ * can the group with the bounding box gmin/gmax use node b as a whole?
+ * b is seen from the closest point of the box, so the criterion holds for
+ * every particle of the group. Nodes that overlap the box are always opened.
+ */
+static int otGroupOpens(node_t *b, float *gmin, float *gmax) {
+
+    float d = 0;
+    float t;
+    int overlap = 1;
+    int j;
 
-    int i;
-    node_t *b;
-    particle_t *p2;
+    for (j = 0; j < 3; j++) {
 
-    float d;
-    float poo2;
+        if (b->cm[j] < gmin[j])
+            t = gmin[j] - b->cm[j];
+        else if (b->cm[j] > gmax[j])
+            t = b->cm[j] - gmax[j];
+        else
+            t = 0;
 
-    if (info->n->p == info->p)
-        return;
+        d += t * t;
+
+        if (b->min[j] > gmax[j] || b->max[j] < gmin[j])
+            overlap = 0;
 
-    if (info->n->p) {
+    }
 
-        p2 = info->n->p;
+    if (overlap || !d)
+        return 1;
 
-        distance2(info->p->pos, p2->pos, d);
+    return b->length2 > otTheta2 * d;
 
-// 		frDoGravity(p,n,d); was
+}
 
-        { // now
-            VectorNew(dv);
-            float force;
-            dv[0] = info->p->pos[0] - info->n->cm[0];
-            dv[1] = info->p->pos[1] - info->n->cm[1];
-            dv[2] = info->p->pos[2] - info->n->cm[2];
+/*
+ * grow a block of "arrays" float arrays, each with room for *size floats,
+ * so that need floats fit in. The first used floats of each array are kept.
+ * returns 0 if there was not enough memory
+ */
+static int otListGrow(float **block, int arrays, int used, int *size, int need) {
 
-            if (d) {
-                force = state.g * info->pd->mass * info->n->mass / d;
-                info->pd->accel[0] += dv[0] * force;
-                info->pd->accel[1] += dv[1] * force;
-                info->pd->accel[2] += dv[2] * force;
-            }
-        }
+    float *b;
+    int newSize;
+    int k;
 
+    if (need <= *size)
+        return 1;
+
+    newSize = *size * 2;
+    if (newSize < need)
+        newSize = need + 1024;
+
+    // keep every array aligned
+    newSize = (newSize + OT_LIST_PAD - 1) & ~(OT_LIST_PAD - 1);
+
+    MALLOC_ALIGNED(b, sizeof(float) * newSize * arrays, 64);
+    if (!b)
+        return 0;
+
+    for (k = 0; k < arrays && used; k++)
+        memcpy(b + newSize * k, *block + *size * k, sizeof(float) * used);
+
+    FREE_ALIGNED(*block);
+    *block = b;
+    *size = newSize;
+
+    return 1;
+
+}
+
+// make room for n more particles in list l
+static int otListReserve(otList_t *l, int n) {
+
+    if (!otListGrow(&l->block, 4, l->count, &l->size, l->count + n + OT_LIST_PAD))
+        return 0;
+
+    l->p.x = l->block;
+    l->p.y = l->block + l->size;
+    l->p.z = l->block + l->size * 2;
+    l->p.mass = l->block + l->size * 3;
+
+    return 1;
+
+}
+
+static void otListAdd(otList_t *l, float x, float y, float z, float mass) {
+
+    l->p.x[l->count] = x;
+    l->p.y[l->count] = y;
+    l->p.z[l->count] = z;
+    l->p.mass[l->count] = mass;
+    l->count++;
+
+}
+
+// node b pulls with its quadrupole moment (b == NULL: massless padding)
+static int otListAddNode(otList_t *l, node_t *b) {
+
+    int i = l->nodeCount;
+    int k;
+
+    if (!otListGrow(&l->nodeBlock, 10, i, &l->nodeSize, i + 1))
+        return 0;
+
+    l->n.x = l->nodeBlock;
+    l->n.y = l->nodeBlock + l->nodeSize;
+    l->n.z = l->nodeBlock + l->nodeSize * 2;
+    l->n.mass = l->nodeBlock + l->nodeSize * 3;
+    for (k = 0; k < 6; k++)
+        l->n.q[k] = l->nodeBlock + l->nodeSize * (4 + k);
+
+    if (b) {
+        l->n.x[i] = b->cm[0];
+        l->n.y[i] = b->cm[1];
+        l->n.z[i] = b->cm[2];
+        l->n.mass[i] = b->mass;
+        for (k = 0; k < 6; k++)
+            l->n.q[k][i] = b->quad[k];
     } else {
+        l->n.x[i] = l->n.y[i] = l->n.z[i] = l->n.mass[i] = 0;
+        for (k = 0; k < 6; k++)
+            l->n.q[k][i] = 0;
+    }
 
-        for (i = 0; i < 8; i++) {
+    l->nodeCount++;
+    return 1;
 
-            if (!info->n->b[i])
-                continue;
+}
 
-            b = (node_t *)info->n->b[i];
+/*
+ * collect the interaction list of group g: particles and nodes that pull
+ * on the particles of g. The group itself ends up in the list as well.
+ * returns 0 if there was not enough memory
+ */
+static int otGroupList(node_t *g, otList_t *l) {
+
+    VectorNew(gmin);
+    VectorNew(gmax);
+    int stack[OT_MAX_DEPTH * 8 + 8];
+    int sp;
+    node_t *b;
+    int i;
+
+    l->count = 0;
+    l->nodeCount = 0;
+
+    // bounding box of the particles, tighter than the box of the node
+    i = otIndex[g->first];
+    gmin[0] = gmax[0] = workingSet.x[i];
+    gmin[1] = gmax[1] = workingSet.y[i];
+    gmin[2] = gmax[2] = workingSet.z[i];
+
+    for (i = g->first + 1; i < g->first + g->count; i++) {
+
+        int j = otIndex[i];
+
+        if (workingSet.x[j] < gmin[0]) gmin[0] = workingSet.x[j];
+        if (workingSet.x[j] > gmax[0]) gmax[0] = workingSet.x[j];
+        if (workingSet.y[j] < gmin[1]) gmin[1] = workingSet.y[j];
+        if (workingSet.y[j] > gmax[1]) gmax[1] = workingSet.y[j];
+        if (workingSet.z[j] < gmin[2]) gmin[2] = workingSet.z[j];
+        if (workingSet.z[j] > gmax[2]) gmax[2] = workingSet.z[j];
+
+    }
 
-            distance2(info->p->pos, b->cm, d);
+    sp = 0;
+    stack[sp++] = r - otNodes;
 
-            if (!d)
-                continue;
+    while (sp) {
 
-	    poo2 = b->length2 / d ;
+        b = otNodes + stack[--sp];
 
-	    if ( poo2 > 0.25f ) {
-                pttr_t info2;
-                info2.n = b;
-                info2.p = info->p;
-                info2.pd = info->pd;
-                otComputeParticleToTreeRecursive(&info2);
+        if (!otGroupOpens(b, gmin, gmax)) {
 
+            // far enough away: the node pulls as a whole
+            if (otQuadrupoles && b->count > 1) {
+                if (!otListAddNode(l, b))
+                    return 0;
             } else {
+                if (!otListReserve(l, 1))
+                    return 0;
+                otListAdd(l, b->cm[0], b->cm[1], b->cm[2], b->mass);
+            }
+
+        } else if (b->children) {
 
-                // frDoGravity(p,b,d);
+            for (i = 0; i < b->children; i++)
+                stack[sp++] = b->child + i;
 
-                { // now
-                    VectorNew(dv);
-                    float force;
-                    dv[0] = info->p->pos[0] - b->cm[0];
-                    dv[1] = info->p->pos[1] - b->cm[1];
-                    dv[2] = info->p->pos[2] - b->cm[2];
+        } else {
 
-                    if (d) {
-                        force = state.g * info->pd->mass * b->mass / d;
-                        info->pd->accel[0] += dv[0] * force;
-                        info->pd->accel[1] += dv[1] * force;
-                        info->pd->accel[2] += dv[2] * force;
-                    }
-                }
+            // leaf or leaf bucket: add its particles one by one
+            if (!otListReserve(l, b->count))
+                return 0;
 
+            for (i = b->first; i < b->first + b->count; i++) {
+                int j = otIndex[i];
+                otListAdd(l, workingSet.x[j], workingSet.y[j], workingSet.z[j], workingSet.mass[j]);
             }
 
         }
 
     }
 
+    // pad with massless particles for the vector kernels
+    while (l->count % OT_LIST_PAD)
+        otListAdd(l, 0, 0, 0, 0);
+
+    while (l->nodeCount % OT_LIST_PAD)
+        if (!otListAddNode(l, NULL))
+            return 0;
+
+    return 1;
+
 }
 
-void processFrameOT(int start, int amount) {
+// mixed precision: list entries per float sum, the rest is added up in double
+#define OT_LIST_CHUNK 1024
+
+/*
+ * pull of list l on pos, into sum. With mixed precision, the list is
+ * handed to the kernels in chunks of OT_LIST_CHUNK entries (a multiple of
+ * OT_LIST_PAD, so every chunk stays aligned), and the chunks are added up
+ * in double.
+ */
+static void otListAccel(otList_t *l, float *pos, double *sum) {
+
+    VectorNew(accel);
+    particle_vectors p;
+    quad_vectors n;
+    int i, k;
+
+    VectorZero(accel);
+
+    if (!otMixed) {
+
+        otListKernel(l->p, l->count, pos, accel, otSoft2, otPhysics);
+
+        if (l->nodeCount)
+            otListQuadKernel(l->n, l->nodeCount, pos, accel, otSoft2, otPhysics);
+
+        VectorCopy(accel, sum);
+        return;
+
+    }
+
+    for (i = 0; i < l->count; i += OT_LIST_CHUNK) {
+
+        p.x = l->p.x + i;
+        p.y = l->p.y + i;
+        p.z = l->p.z + i;
+        p.mass = l->p.mass + i;
+
+        VectorZero(accel);
+        otListKernel(p, l->count - i < OT_LIST_CHUNK ? l->count - i : OT_LIST_CHUNK, pos, accel, otSoft2, otPhysics);
+        VectorAdd(sum, accel, sum);
+
+    }
+
+    for (i = 0; i < l->nodeCount; i += OT_LIST_CHUNK) {
+
+        n.x = l->n.x + i;
+        n.y = l->n.y + i;
+        n.z = l->n.z + i;
+        n.mass = l->n.mass + i;
+        for (k = 0; k < 6; k++)
+            n.q[k] = l->n.q[k] + i;
+
+        VectorZero(accel);
+        otListQuadKernel(n, l->nodeCount - i < OT_LIST_CHUNK ? l->nodeCount - i : OT_LIST_CHUNK, pos, accel, otSoft2, otPhysics);
+        VectorAdd(sum, accel, sum);
+
+    }
+
+}
+
+/*
+ * forces for all particles of group g, with one shared interaction list
+ */
+static void otProcessGroup(node_t *g, otList_t *l) {
+
+    int i;
+
+    if (!otGroupList(g, l)) {
+        otListFailed = 1;
+        return;
+    }
+
+    for (i = g->first; i < g->first + g->count; i++) {
+
+        VectorNew(pos);
+        double accel[3] = { 0, 0, 0 };
+        int j = otIndex[i];
+        float f;
+
+        // block time steps: the others keep their acceleration
+        if (workingSet.activeCount < workingSet.count && !workingSet.active[j])
+            continue;
+
+        pos[0] = workingSet.x[j];
+        pos[1] = workingSet.y[j];
+        pos[2] = workingSet.z[j];
+
+        otListAccel(l, pos, accel);
+
+        f = state.g * PHYSICS_MASS(otPhysics, workingSet.mass[j]);
+        workingSet.ax[j] = (float)(accel[0] * f);
+        workingSet.ay[j] = (float)(accel[1] * f);
+        workingSet.az[j] = (float)(accel[2] * f);
+
+    }
+
+    atomicFetchAdd(&view.recordParticlesDone, g->count);
+
+}
+
+// the groups are the biggest nodes with at most OT_GROUP_SIZE particles
+static void otAddGroups(node_t *n) {
 
     int i;
 
+    if (n->count <= OT_GROUP_SIZE || !n->children) {
+
+        // block time steps: only groups with active particles
+        if (workingSet.activeCount < workingSet.count) {
+
+            for (i = n->first; i < n->first + n->count; i++)
+                if (workingSet.active[otIndex[i]])
+                    break;
+
+            if (i == n->first + n->count)
+                return;
+
+        }
+
+        otGroup[otGroups++] = n - otNodes;
+        return;
+
+    }
+
+    for (i = 0; i < n->children; i++)
+        otAddGroups(otNodes + n->child + i);
+
+}
+
+/*
+ * build the tree for the current frame. Has to be called once per frame,
+ * before the particles are distributed to processFrameOT() threads
+ */
+void otBuildTree() {
+
+    otFreeTree();
+
+    // settings for this tree
+    otTheta2 = state.theta * state.theta;
+    otQuadrupoles = state.quadrupole;
+    otPhysics = state.physics;
+    otSoft2 = state.softening * state.softening;
+    otMixed = state.mixedPrecision;
+
     view.recordStatus = 1;
     view.recordParticlesDone = 0;
 
     otMakeTree();
 
-    view.recordStatus = 2;
-    view.recordParticlesDone = 0;
-    doVideoUpdate();
+    view.recordStatus = 0;
 
-#ifdef _OPENMP
-    master_thread_id = omp_get_thread_num();
-#endif
+}
+
+/*
+ * split the tree into groups. Has to be called once per frame, after
+ * otBuildTree().
+ * returns the number of groups, 0 if there is nothing to do
+ */
+int otPrepareGroups() {
 
-    #pragma omp parallel for schedule(dynamic, 256)
-    for (i = start; i < amount; i++) {
-        particle_t *p;
-        particleDetail_t *pd;
-        pttr_t info;
+    otGroups = 0;
 
-        view.recordParticlesDone = i;
+    if (otListFailed) {
+        conAdd(LERR, "Could not allocate memory for octree interaction lists");
+        otListFailed = 0;
+    }
 
-        p = state.particleHistory + state.particleCount * state.frame + i;
-        pd = state.particleDetail + i;
+    if (!r)
+        return 0;
 
-        if (!p)
-            continue;
+    if (otGroupSize < otNodesUsed) {
+
+        free(otGroup);
+        otGroupSize = otNodesUsed;
+        otGroup = malloc(sizeof(int) * otGroupSize);
+
+        if (!otGroup) {
+            conAdd(LERR, "Could not allocate %lu bytes of memory for octree groups", (unsigned long)(sizeof(int) * otGroupSize));
+            otGroupSize = 0;
+            return 0;
+        }
+
+    }
+
+    otAddGroups(r);
+
+    return otGroups;
 
-        info.p = p;
-        info.n = r;
-        info.pd = pd;
+}
+
+/*
+ * forces for the groups handed out by workNext(), after otPrepareGroups().
+ * With OpenMP, this is called once and spawns the threads itself.
+ */
+void processFrameOT(int thread) {
 
+    int t;
 #ifndef _OPENMP
-        doVideoUpdate();
+    int start, end;
+
+    while (workNext(thread, 1, &start, &end)) {
+
+        // only the main thread may draw
+        if (poolMainThread()) {
+            doVideoUpdate();
+        }
+
+        for (t = start; t < end; t++)
+            if (state.mode & SM_RECORD)
+                otProcessGroup(otNodes + otGroup[t], otLists + thread);
+
+    }
 #else
+    master_thread_id = omp_get_thread_num();
+
+    #pragma omp parallel for schedule(dynamic, 4)
+    for (t = 0; t < otGroups; t++) {
+
 	// only main thread may do this
-        //#pragma omp single nowait
 	if(omp_get_thread_num() == master_thread_id) {doVideoUpdate2();}
+
+        if (state.mode & SM_RECORD)
+            otProcessGroup(otNodes + otGroup[t], otLists + omp_get_thread_num());
+
+    }
 #endif
 
-	if (state.mode & SM_RECORD)
-	     otComputeParticleToTreeRecursive(&info);
+}
+
+/*
+ * potentials for all particles of group g, from the same interaction list
+ * as the forces (see processListPotentialPP()), into phi
+ */
+static void otPotentialGroup(node_t *g, otList_t *l, float *phi) {
+
+    int i;
 
+    if (!otGroupList(g, l)) {
+        otListFailed = 1;
+        return;
     }
 
-    view.recordStatus = 0;
+    for (i = g->first; i < g->first + g->count; i++) {
+
+        VectorNew(pos);
+        int j = otIndex[i];
+        double p;
+
+        pos[0] = workingSet.x[j];
+        pos[1] = workingSet.y[j];
+        pos[2] = workingSet.z[j];
+
+        p = processListPotentialPP(l->p, l->count, pos, otSoft2, otPhysics);
+
+        if (l->nodeCount)
+            p += processListQuadPotentialPP(l->n, l->nodeCount, pos, otSoft2, otPhysics);
+
+        phi[j] = (float)p;
+
+    }
+
+}
+
+/*
+ * potentials (without g) of all particles, for the groups handed out by
+ * workNext() after otPrepareGroups(). Used by the diagnostics, see frame.c.
+ * With OpenMP, this is called once and spawns the threads itself.
+ */
+void processPotentialOT(int thread, float *phi) {
+
+    int t;
+#ifndef _OPENMP
+    int start, end;
+
+    while (workNext(thread, 1, &start, &end))
+        for (t = start; t < end; t++)
+            otPotentialGroup(otNodes + otGroup[t], otLists + thread, phi);
+#else
+    #pragma omp parallel for schedule(dynamic, 4)
+    for (t = 0; t < otGroups; t++)
+        otPotentialGroup(otNodes + otGroup[t], otLists + omp_get_thread_num(), phi);
+#endif
 
 }
 
@@ -592,17 +1230,9 @@ void otDrawFieldRecursive(float *pos, node_t *node, float *force) {
     float d;
     float poo2;
 
-    float f;
-
-    VectorNew(newForce);
-    VectorZero(newForce);
+    for (i = 0; i < node->children; i++) {
 
-    for (i = 0; i < 8; i++) {
-
-        if (!node->b[i])
-            continue;
-
-        b = (node_t *)node->b[i];
+        b = otNodes + node->child + i;
 
         distance2(pos, b->cm, d);
 
@@ -611,26 +1241,22 @@ void otDrawFieldRecursive(float *pos, node_t *node, float *force) {
 
         poo2 = b->length2 / d;
 
-        if ( poo2 > 0.25f ) {
+        if ( poo2 > otTheta2 ) {
 
-            otDrawFieldRecursive(pos, b, newForce);
-
-            VectorAdd(force, newForce, force);
+            otDrawFieldRecursive(pos, b, force);
 
         } else {
 
             {
                 VectorNew(dv);
+                VectorNew(f);
                 dv[0] = pos[0] - b->cm[0];
                 dv[1] = pos[1] - b->cm[1];
                 dv[2] = pos[2] - b->cm[2];
 
-                if (d) {
-                    f = state.g * b->mass / d;
-                    force[0] += dv[0] * f;
-                    force[1] += dv[1] * f;
-                    force[2] += dv[2] * f;
-                }
+                VectorZero(f);
+                otNodeForce(b, dv, d, f);
+                VectorMultiplyAdd(f, state.g, force);
             }
 
         }
@@ -638,4 +1264,3 @@ void otDrawFieldRecursive(float *pos, node_t *node, float *force) {
     }
 
 }
-
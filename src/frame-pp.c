@@ -41,85 +41,1021 @@ Foundation, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
       4. moved declarations into scope of for loops (to help the compiler optimize stuff)
          .. if your compiler does not like this, just move all declarations back to the top of the function.
 
-	 5. experimental: add OMP directives (compile with gcc -fopenmp) to execute the outer loop with parallel threads.
-		To control the number of thread, we could add "omp_set_num_threads(state.processFrameThreads);" somewhere
-		before "#pragma omp parallel for" 
+      5. tiles: the (triangular) i/j loop is cut into tiles of ppTileSize x ppTileSize
+         particles, small enough to stay in the L1/L2 cache. Tiles are shared
+         out between the threads.
+
+      6. no data races: because of 1. a tile also writes to the j particles. So every
+         thread adds up its accelerations in its own buffer (ppAccel[thread]).
+         ppReduce() sums up all buffers at the end (and multiplies with G).
+
+      7. no copies: the kernels read the positions and masses straight from the
+         aligned arrays of the working set (workingSet, see frame.c), and ppReduce()
+         writes the accelerations back there.
+
+      8. jerk: the hermite integrator also needs the time derivative of the
+         acceleration. processTileJerkPP() computes both in the same loop, into
+         a second set of per thread buffers (ppJerk[thread]).
+
+      9. physics modes: every kernel is written once as an inline function
+         with the physics mode as a constant argument (see ppPairForce() in
+         gravit.h). The exported kernel only picks the instance for the mode,
+         so the inner loops have no branches for it.
+
+      10. softening: every kernel adds soft2 (state.softening^2) to the distance
+         squared, so all solvers give the same forces on close passes.
+
+      11. mixed precision (state.mixedPrecision): the kernels stay float, but
+         after each tile the thread moves the accelerations of the tile's
+         particles from its float buffer into a double one (ppSum[thread]).
+         A float sum never holds more than ppTileSize terms, the rest is
+         added up in double. Kahan summation in the kernels would not
+         survive -ffast-math, and all-double kernels would need twice the
+         memory and bandwidth. The flush is 2 x ppTileSize adds per
+         ppTileSize^2 interactions. The jerk stays float.
   */
 
-// optional - min. distance squared -- used as smoothing length, 
-//            to avoid the "stars shooting out of the galaxy" effect
-//#define MIN_STEP2 0.05
+// max. particles per tile side. must be a multiple of 16 (alignment of AVX-512 loads)
+#define PP_TILE_SIZE 512
+#define PP_TILE_SIZE_MIN 64
+
+// particle data, shared by all threads (points into the working set)
+static particle_vectors ppPos = { NULL, NULL, NULL, NULL };
+// velocities, for the jerk
+static acc_vectors ppVel = { NULL, NULL, NULL };
+// accelerations and jerks, one buffer per thread
+static acc_vectors ppAccel[MAX_THREADS];
+static acc_vectors ppJerk[MAX_THREADS];
+
+// mixed precision: accelerations added up in double, one buffer per thread
+typedef struct {
+    double *x;
+    double *y;
+    double *z;
+} ppSum_t;
+
+static ppSum_t ppSum[MAX_THREADS];
+static int ppSize = 0;          // size of the buffers (particles)
+static int ppBuffers = 0;       // number of allocated ppAccel buffers
+static int ppJerkBuffers = 0;   // number of allocated ppJerk buffers
+static int ppSumBuffers = 0;    // number of allocated ppSum buffers
+static int ppWithJerk = 0;      // 1: this frame also computes the jerk
+static int ppMixed = 0;         // 1: this frame adds up the tiles in ppSum
+static int ppPhysics = PH_CLASSIC;  // physics mode of this frame
+static float ppSoft2 = 0;       // softening length^2 of this frame
+static int ppThreads = 0;       // number of ppAccel buffers used in this frame
+
+static int ppTileSize = PP_TILE_SIZE;
+static int ppTiles = 0;
+
+
+static float *ppAllocArray() {
+
+    float *a;
+
+    MALLOC_ALIGNED(a, sizeof(float) * (ppSize + 64), 64);
+    return a;
+
+}
+
+void ppFreeMemory() {
+
+    int i;
+
+    for (i = 0; i < ppBuffers; i++) {
+        FREE_ALIGNED(ppAccel[i].x);
+        FREE_ALIGNED(ppAccel[i].y);
+        FREE_ALIGNED(ppAccel[i].z);
+    }
+
+    for (i = 0; i < ppJerkBuffers; i++) {
+        FREE_ALIGNED(ppJerk[i].x);
+        FREE_ALIGNED(ppJerk[i].y);
+        FREE_ALIGNED(ppJerk[i].z);
+    }
+
+    for (i = 0; i < ppSumBuffers; i++) {
+        free(ppSum[i].x);
+        free(ppSum[i].y);
+        free(ppSum[i].z);
+    }
+
+    memset(&ppPos, 0, sizeof(ppPos));
+    memset(&ppVel, 0, sizeof(ppVel));
+    ppSize = 0;
+    ppBuffers = 0;
+    ppJerkBuffers = 0;
+    ppSumBuffers = 0;
+    ppWithJerk = 0;
+    ppMixed = 0;
+    ppThreads = 0;
+    ppTiles = 0;
+
+}
+
+/*
+ * set up the acceleration buffers (and the jerk buffers, if jerk is set) and
+ * work out the tiles. Has to be called once per frame, before the
+ * processFramePP() or processFrameJerkPP() threads.
+ * returns the number of tiles, 0 if the memory could not be allocated
+ */
+int ppPrepare(int threads, int jerk) {
+
+    int blocks;
+
+    ppTiles = 0;
+    ppThreads = 0;
+    ppWithJerk = 0;
+    ppMixed = 0;
+
+    if (threads < 1)
+        threads = 1;
+    if (threads > MAX_THREADS)
+        threads = MAX_THREADS;
+
+    // (re-)allocate
+    if (ppSize < workingSet.count) {
+
+        ppFreeMemory();
+        ppSize = workingSet.count;
+
+    }
+
+    while (ppBuffers < threads) {
+
+        ppAccel[ppBuffers].x = ppAllocArray();
+        ppAccel[ppBuffers].y = ppAllocArray();
+        ppAccel[ppBuffers].z = ppAllocArray();
+
+        if (!ppAccel[ppBuffers].x || !ppAccel[ppBuffers].y || !ppAccel[ppBuffers].z) {
+            conAdd(LERR, "Could not allocate %lu bytes of memory for thread accelerations", (unsigned long)(3 * sizeof(float) * (ppSize + 64)));
+            ppBuffers++;
+            ppFreeMemory();
+            return 0;
+        }
+
+        ppBuffers++;
+
+    }
+
+    while (jerk && ppJerkBuffers < threads) {
+
+        ppJerk[ppJerkBuffers].x = ppAllocArray();
+        ppJerk[ppJerkBuffers].y = ppAllocArray();
+        ppJerk[ppJerkBuffers].z = ppAllocArray();
 
+        if (!ppJerk[ppJerkBuffers].x || !ppJerk[ppJerkBuffers].y || !ppJerk[ppJerkBuffers].z) {
+            conAdd(LERR, "Could not allocate %lu bytes of memory for thread jerks", (unsigned long)(3 * sizeof(float) * (ppSize + 64)));
+            ppJerkBuffers++;
+            ppFreeMemory();
+            return 0;
+        }
+
+        ppJerkBuffers++;
+
+    }
+
+    while (state.mixedPrecision && ppSumBuffers < threads) {
+
+        ppSum[ppSumBuffers].x = malloc(sizeof(double) * ppSize);
+        ppSum[ppSumBuffers].y = malloc(sizeof(double) * ppSize);
+        ppSum[ppSumBuffers].z = malloc(sizeof(double) * ppSize);
+
+        if (!ppSum[ppSumBuffers].x || !ppSum[ppSumBuffers].y || !ppSum[ppSumBuffers].z) {
+            conAdd(LERR, "Could not allocate %lu bytes of memory for thread accelerations", (unsigned long)(3 * sizeof(double) * ppSize));
+            ppSumBuffers++;
+            ppFreeMemory();
+            return 0;
+        }
+
+        ppSumBuffers++;
+
+    }
+
+    ppThreads = threads;
+    ppWithJerk = jerk;
+    ppMixed = state.mixedPrecision;
+    ppPhysics = state.physics;
+    ppSoft2 = state.softening * state.softening;
+
+    ppPos.x = workingSet.x;
+    ppPos.y = workingSet.y;
+    ppPos.z = workingSet.z;
+    ppPos.mass = workingSet.mass;
+
+    ppVel.x = workingSet.vx;
+    ppVel.y = workingSet.vy;
+    ppVel.z = workingSet.vz;
+
+    // smaller tiles if there would not be enough of them to keep all threads busy
+    ppTileSize = PP_TILE_SIZE;
+    for (;;) {
+
+        blocks = (workingSet.count + ppTileSize - 1) / ppTileSize;
+
+        if (ppTileSize <= PP_TILE_SIZE_MIN || blocks * (blocks + 1) / 2 >= threads * 4)
+            break;
+
+        ppTileSize /= 2;
+
+    }
+
+    ppTiles = blocks * (blocks + 1) / 2;
+
+    return ppTiles;
+
+}
+
+/*
+ * particle ranges of tile t: tiles are numbered row by row, (0,0) (1,0) (1,1) (2,0) ...
+ */
+static void ppTileRange(int t, int *i0, int *i1, int *j0, int *j1) {
+
+    int ib, jb;
+
+    ib = (int)((sqrt(8.0 * t + 1) - 1) / 2);
+    while (ib * (ib + 1) / 2 > t)
+        ib--;
+    while ((ib + 1) * (ib + 2) / 2 <= t)
+        ib++;
+    jb = t - ib * (ib + 1) / 2;
+
+    *i0 = ib * ppTileSize;
+    *i1 = *i0 + ppTileSize;
+    if (*i1 > workingSet.count)
+        *i1 = workingSet.count;
 
-void processFramePP(int start, int amount) {
+    *j0 = jb * ppTileSize;
+    *j1 = *j0 + ppTileSize;
+    if (*j1 > workingSet.count)
+        *j1 = workingSet.count;
 
+}
+
+/*
+ * mixed precision: move the accelerations of particles start .. end-1 from
+ * the float buffer of the thread to its double buffer
+ */
+static void ppFlushRange(int thread, int start, int end) {
+
+    acc_vectors a = ppAccel[thread];
+    ppSum_t s = ppSum[thread];
     int i;
-    int particles_max = state.particleCount;
 
-    // apply gravity to every specified velocity
+    for (i = start; i < end; i++) {
+        s.x[i] += a.x[i];
+        s.y[i] += a.y[i];
+        s.z[i] += a.z[i];
+        a.x[i] = 0;
+        a.y[i] = 0;
+        a.z[i] = 0;
+    }
+
+}
+
+static void ppFlushTile(int thread, int i0, int i1, int j0, int j1) {
+
+    ppFlushRange(thread, i0, i1);
+    if (j0 != i0)
+        ppFlushRange(thread, j0, j1);
+
+}
+
+static void ppRunTile(ppTile_t tile, int thread, int t) {
+
+    int i0, i1, j0, j1;
+
+    ppTileRange(t, &i0, &i1, &j0, &j1);
+    tile(ppPos, ppAccel[thread], i0, i1, j0, j1, ppSoft2, ppPhysics);
+
+    if (ppMixed)
+        ppFlushTile(thread, i0, i1, j0, j1);
+
+}
+
+static void ppRunTileJerk(int thread, int t) {
+
+    int i0, i1, j0, j1;
+
+    ppTileRange(t, &i0, &i1, &j0, &j1);
+    processTileJerkPP(ppPos, ppVel, ppAccel[thread], ppJerk[thread], i0, i1, j0, j1, ppSoft2, ppPhysics);
+
+    if (ppMixed)
+        ppFlushTile(thread, i0, i1, j0, j1);
+
+}
+
+static void ppClearAccel(int thread) {
+
+    memset(ppAccel[thread].x, 0, sizeof(float) * workingSet.count);
+    memset(ppAccel[thread].y, 0, sizeof(float) * workingSet.count);
+    memset(ppAccel[thread].z, 0, sizeof(float) * workingSet.count);
+
+    if (ppMixed) {
+        memset(ppSum[thread].x, 0, sizeof(double) * workingSet.count);
+        memset(ppSum[thread].y, 0, sizeof(double) * workingSet.count);
+        memset(ppSum[thread].z, 0, sizeof(double) * workingSet.count);
+    }
+
+    if (ppWithJerk) {
+        memset(ppJerk[thread].x, 0, sizeof(float) * workingSet.count);
+        memset(ppJerk[thread].y, 0, sizeof(float) * workingSet.count);
+        memset(ppJerk[thread].z, 0, sizeof(float) * workingSet.count);
+    }
+
+}
+
+/*
+ * process the tiles of one thread with the given kernel, tiles are handed
+ * out by workNext(). With OpenMP, this is called once and spawns the threads itself.
+ */
+void processFramePP(int thread, ppTile_t tile) {
+
+    int t;
+#ifndef _OPENMP
+    int start, end;
+#endif
+
+    if (!ppTiles)
+        return;
+
+#ifdef _OPENMP
+    #pragma omp parallel private(t)
+    {
+        int me = omp_get_thread_num();
+
+        // each thread only ever touches its own buffer, no barrier needed
+        ppClearAccel(me);
+
+        #pragma omp for schedule(dynamic, 1)
+        for (t = 0; t < ppTiles; t++)
+            ppRunTile(tile, me, t);
+
+        if (me == 0)
+            ppThreads = omp_get_num_threads();
+    }
+#else
+    ppClearAccel(thread);
+
+    while (workNext(thread, 1, &start, &end))
+        for (t = start; t < end; t++)
+            ppRunTile(tile, thread, t);
+#endif
+
+}
+
+/*
+ * same as processFramePP(), with accelerations and jerks (see
+ * processTileJerkPP()). ppPrepare() has to be called with jerk set.
+ */
+void processFrameJerkPP(int thread) {
+
+    int t;
+#ifndef _OPENMP
+    int start, end;
+#endif
+
+    if (!ppTiles || !ppWithJerk)
+        return;
 
 #ifdef _OPENMP
-    // experimental: multi-treading with OMP. Do NOT mix with pthread (frame.c processFrameThread)
-    #pragma omp parallel for schedule(dynamic, 256)
+    #pragma omp parallel private(t)
+    {
+        int me = omp_get_thread_num();
+
+        ppClearAccel(me);
+
+        #pragma omp for schedule(dynamic, 1)
+        for (t = 0; t < ppTiles; t++)
+            ppRunTileJerk(me, t);
+
+        if (me == 0)
+            ppThreads = omp_get_num_threads();
+    }
+#else
+    ppClearAccel(thread);
+
+    while (workNext(thread, 1, &start, &end))
+        for (t = start; t < end; t++)
+            ppRunTileJerk(thread, t);
+#endif
+
+}
+
+/*
+ * add up the accelerations (and jerks) of all threads for particles start .. end-1
+ */
+void ppReduce(int start, int end) {
+
+    int i;
+
+    if (!ppTiles)
+        return;
+
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static)
+#endif
+    for (i = start; i < end; i++) {
+
+        VectorNew(acc);
+        int t;
+
+        if (ppMixed) {
+
+            double sum[3] = { 0, 0, 0 };
+
+            for (t = 0; t < ppThreads; t++) {
+                sum[0] += ppSum[t].x[i];
+                sum[1] += ppSum[t].y[i];
+                sum[2] += ppSum[t].z[i];
+            }
+
+            workingSet.ax[i] = (float)(sum[0] * state.g);
+            workingSet.ay[i] = (float)(sum[1] * state.g);
+            workingSet.az[i] = (float)(sum[2] * state.g);
+
+        } else {
+
+            VectorZero(acc);
+
+            for (t = 0; t < ppThreads; t++) {
+                acc[0] += ppAccel[t].x[i];
+                acc[1] += ppAccel[t].y[i];
+                acc[2] += ppAccel[t].z[i];
+            }
+
+            workingSet.ax[i] = acc[0] * state.g;
+            workingSet.ay[i] = acc[1] * state.g;
+            workingSet.az[i] = acc[2] * state.g;
+
+        }
+
+        if (!ppWithJerk)
+            continue;
+
+        VectorZero(acc);
+
+        for (t = 0; t < ppThreads; t++) {
+            acc[0] += ppJerk[t].x[i];
+            acc[1] += ppJerk[t].y[i];
+            acc[2] += ppJerk[t].z[i];
+        }
+
+        workingSet.jx[i] = acc[0] * state.g;
+        workingSet.jy[i] = acc[1] * state.g;
+        workingSet.jz[i] = acc[2] * state.g;
+
+    }
+
+}
+
+// pull of particles j0 .. j1-1 at pos, added to acc. No branches, so the compiler can vectorize it
+KERNEL_INLINE void ppActiveRange(float *pos, int j0, int j1, float soft2, float *acc, const int physics) {
+
+    float ax = 0, ay = 0, az = 0;
+    int j;
+
+    for (j = j0; j < j1; j++) {
+
+        VectorNew(dv);
+        float inverseSquareDistance;
+        float force;
+
+        dv[0] = pos[0] - workingSet.x[j];
+        dv[1] = pos[1] - workingSet.y[j];
+        dv[2] = pos[2] - workingSet.z[j];
+
+        inverseSquareDistance  = dv[0] * dv[0];
+        inverseSquareDistance += dv[1] * dv[1];
+        inverseSquareDistance += dv[2] * dv[2];
+        inverseSquareDistance += soft2;
+
+        force = workingSet.mass[j] / ppLawDivisor(inverseSquareDistance, physics);
+        ax += dv[0] * force;
+        ay += dv[1] * force;
+        az += dv[2] * force;
+
+    }
+
+    acc[0] += ax;
+    acc[1] += ay;
+    acc[2] += az;
+
+}
+
+// mixed precision: same as ppActiveRange(), in blocks of PP_TILE_SIZE added up in double
+KERNEL_INLINE void ppActiveRangeMixed(float *pos, int j0, int j1, float soft2, double *sum, const int physics) {
+
+    int j;
+
+    for (j = j0; j < j1; j += PP_TILE_SIZE) {
+
+        VectorNew(acc);
+
+        VectorZero(acc);
+        ppActiveRange(pos, j, j + PP_TILE_SIZE < j1 ? j + PP_TILE_SIZE : j1, soft2, acc, physics);
+
+        sum[0] += acc[0];
+        sum[1] += acc[1];
+        sum[2] += acc[2];
+
+    }
+
+}
+
+// active particle i against all other particles
+KERNEL_INLINE void ppActiveParticle(int i, float soft2, const int physics, int mixed) {
+
+    VectorNew(pos);
+    VectorNew(acc);
+    float f;
+
+    pos[0] = workingSet.x[i];
+    pos[1] = workingSet.y[i];
+    pos[2] = workingSet.z[i];
+    VectorZero(acc);
+
+    if (mixed) {
+
+        double sum[3] = { 0, 0, 0 };
+
+        ppActiveRangeMixed(pos, 0, i, soft2, sum, physics);
+        ppActiveRangeMixed(pos, i + 1, workingSet.count, soft2, sum, physics);
+
+        f = state.g * PHYSICS_MASS(physics, workingSet.mass[i]);
+        workingSet.ax[i] = (float)(sum[0] * f);
+        workingSet.ay[i] = (float)(sum[1] * f);
+        workingSet.az[i] = (float)(sum[2] * f);
+        return;
+
+    }
+
+    ppActiveRange(pos, 0, i, soft2, acc, physics);
+    ppActiveRange(pos, i + 1, workingSet.count, soft2, acc, physics);
+
+    f = state.g * PHYSICS_MASS(physics, workingSet.mass[i]);
+    workingSet.ax[i] = acc[0] * f;
+    workingSet.ay[i] = acc[1] * f;
+    workingSet.az[i] = acc[2] * f;
+
+}
+
+HOT
+static void ppActiveParticleInstance(int i, float soft2, int physics, int mixed) {
+
+    switch (physics) {
+
+    case PH_PROPER:
+        ppActiveParticle(i, soft2, PH_PROPER, mixed);
+        break;
+
+    case PH_MODIFIED:
+        ppActiveParticle(i, soft2, PH_MODIFIED, mixed);
+        break;
+
+    default:
+        ppActiveParticle(i, soft2, PH_CLASSIC, mixed);
+        break;
+
+    }
+
+}
+
+/*
+ * block time steps: accelerations of the active particles only
+ * (workingSet.activeIndex, handed out by workNext()), each one against all
+ * particles. That is less work than the tiles while fewer than half of the
+ * particles are active. No per thread buffers needed, every thread only
+ * writes its own particles. Same softening as the tiles, so both give
+ * the same forces. mixed: added up in double, in blocks of PP_TILE_SIZE.
+ * With OpenMP, this is called once and spawns the threads itself.
+ */
+void processActivePP(int thread, float soft2, int physics, int mixed) {
+
+    int k;
+#ifndef _OPENMP
+    int start, end;
+
+    while (workNext(thread, 16, &start, &end))
+        for (k = start; k < end; k++)
+            ppActiveParticleInstance(workingSet.activeIndex[k], soft2, physics, mixed);
+#else
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (k = 0; k < workingSet.activeCount; k++)
+        ppActiveParticleInstance(workingSet.activeIndex[k], soft2, physics, mixed);
 #endif
-    for (i = start; i < amount; i++) {
+
+}
+
+/*
+ * scalar kernel: particles i0 .. i1-1 against j0 .. j1-1 (only j < i)
+ */
+KERNEL_INLINE void ppTile(particle_vectors pos, acc_vectors accel, int i0, int i1, int j0, int j1, float soft2, const int physics) {
+
+    int i;
+
+    for (i = i0; i < i1; i++) {
         VectorNew(p1_pos);
         VectorNew(p1_acc);
         float p1_mass;
-        
-        particle_t *p1;
-        particleDetail_t *pd1;
         int j;
-        
-        p1 = state.particleHistory + state.particleCount*state.frame + i;
-        pd1 = state.particleDetail + i;
-        
-        p1_mass = pd1->mass;
-        VectorCopy(p1->pos, p1_pos);
+        int jEnd;
+
+        p1_mass = pos.mass[i];
+        p1_pos[0] = pos.x[i];
+        p1_pos[1] = pos.y[i];
+        p1_pos[2] = pos.z[i];
         VectorZero(p1_acc);
-        
-        for (j = i + 1; j < particles_max; j++) {
-            
+
+        jEnd = (j1 < i) ? j1 : i;
+
+        for (j = j0; j < jEnd; j++) {
+
             VectorNew(dv);
             float inverseSquareDistance;
-            float force;
-            
-            particle_t *p2;
-            particleDetail_t *pd2;
-            
-            p2 = state.particleHistory + state.particleCount*state.frame + j;
-            pd2 = state.particleDetail + j;
-            
-            dv[0] = p1_pos[0] - p2->pos[0];
-            dv[1] = p1_pos[1] - p2->pos[1];
-            dv[2] = p1_pos[2] - p2->pos[2];
-            
+            float force, force2;
+
+            dv[0] = p1_pos[0] - pos.x[j];
+            dv[1] = p1_pos[1] - pos.y[j];
+            dv[2] = p1_pos[2] - pos.z[j];
+
             // get distance^2 between the two
             inverseSquareDistance  = dv[0] * dv[0];
             inverseSquareDistance += dv[1] * dv[1];
             inverseSquareDistance += dv[2] * dv[2];
-            //inverseSquareDistance +=  + MIN_STEP2;
-            
-            force = state.g * p1_mass * pd2->mass / inverseSquareDistance;
-            
+            inverseSquareDistance += soft2;
+
+            ppPairForce(p1_mass, pos.mass[j], inverseSquareDistance, physics, &force, &force2);
+
             // sum of accelerations for p1
             p1_acc[0] += dv[0] * force;
             p1_acc[1] += dv[1] * force;
             p1_acc[2] += dv[2] * force;
-            
+
             // add acceleration for p2 (with negative sign, as the direction is inverted)
-            pd2->accel[0] += -dv[0] * force;
-            pd2->accel[1] += -dv[1] * force;
-            pd2->accel[2] += -dv[2] * force;
-            
+            accel.x[j] -= dv[0] * force2;
+            accel.y[j] -= dv[1] * force2;
+            accel.z[j] -= dv[2] * force2;
+
         }
-        
+
         // write back buffered acceleration of p1
-        pd1->accel[0] += p1_acc[0];
-        pd1->accel[1] += p1_acc[1];
-        pd1->accel[2] += p1_acc[2];
-        
+        accel.x[i] += p1_acc[0];
+        accel.y[i] += p1_acc[1];
+        accel.z[i] += p1_acc[2];
+
     }
-    
+
+}
+
+HOT
+void processTilePP(particle_vectors pos, acc_vectors accel, int i0, int i1, int j0, int j1, float soft2, int physics) {
+
+    switch (physics) {
+
+    case PH_PROPER:
+        ppTile(pos, accel, i0, i1, j0, j1, soft2, PH_PROPER);
+        break;
+
+    case PH_MODIFIED:
+        ppTile(pos, accel, i0, i1, j0, j1, soft2, PH_MODIFIED);
+        break;
+
+    default:
+        ppTile(pos, accel, i0, i1, j0, j1, soft2, PH_CLASSIC);
+        break;
+
+    }
+
+}
+
+/*
+ * scalar kernel with jerk, for the hermite integrator: the same as
+ * processTilePP(), and also the time derivative of the acceleration. With
+ * dv, dw the differences of positions and velocities and d = |dv|^2 + soft2
+ * (CLASSIC):
+ *   acc  = m1 m2 dv / d
+ *   jerk = m1 m2 (dw / d - 2 (dv . dw) dv / d^2)
+ * PROPER: 1/d^1.5 and 3 (dv . dw) instead
+ */
+KERNEL_INLINE void ppTileJerk(particle_vectors pos, acc_vectors vel, acc_vectors accel, acc_vectors jerk, int i0, int i1, int j0, int j1, float soft2, const int physics) {
+
+    int i;
+
+    for (i = i0; i < i1; i++) {
+        VectorNew(p1_pos);
+        VectorNew(p1_vel);
+        VectorNew(p1_acc);
+        VectorNew(p1_jerk);
+        float p1_mass;
+        int j;
+        int jEnd;
+
+        p1_mass = pos.mass[i];
+        p1_pos[0] = pos.x[i];
+        p1_pos[1] = pos.y[i];
+        p1_pos[2] = pos.z[i];
+        p1_vel[0] = vel.x[i];
+        p1_vel[1] = vel.y[i];
+        p1_vel[2] = vel.z[i];
+        VectorZero(p1_acc);
+        VectorZero(p1_jerk);
+
+        jEnd = (j1 < i) ? j1 : i;
+
+        for (j = j0; j < jEnd; j++) {
+
+            VectorNew(dv);
+            VectorNew(dw);
+            VectorNew(jv);
+            VectorNew(jv2);
+            float inverseSquareDistance;
+            float force, force2;
+            float rv;
+
+            dv[0] = p1_pos[0] - pos.x[j];
+            dv[1] = p1_pos[1] - pos.y[j];
+            dv[2] = p1_pos[2] - pos.z[j];
+            dw[0] = p1_vel[0] - vel.x[j];
+            dw[1] = p1_vel[1] - vel.y[j];
+            dw[2] = p1_vel[2] - vel.z[j];
+
+            inverseSquareDistance  = dv[0] * dv[0];
+            inverseSquareDistance += dv[1] * dv[1];
+            inverseSquareDistance += dv[2] * dv[2];
+            inverseSquareDistance += soft2;
+
+            ppPairForce(p1_mass, pos.mass[j], inverseSquareDistance, physics, &force, &force2);
+
+            inverseSquareDistance = 1 / inverseSquareDistance;
+            rv = (physics == PH_PROPER ? -3 : -2) * (dv[0] * dw[0] + dv[1] * dw[1] + dv[2] * dw[2]) * inverseSquareDistance;
+
+            jv[0] = dw[0] + dv[0] * rv;
+            jv[1] = dw[1] + dv[1] * rv;
+            jv[2] = dw[2] + dv[2] * rv;
+            VectorMultiply(jv, force2, jv2);
+            VectorMultiply(jv, force, jv);
+
+            p1_acc[0] += dv[0] * force;
+            p1_acc[1] += dv[1] * force;
+            p1_acc[2] += dv[2] * force;
+            VectorAdd(p1_jerk, jv, p1_jerk);
+
+            // both change sign for p2
+            accel.x[j] -= dv[0] * force2;
+            accel.y[j] -= dv[1] * force2;
+            accel.z[j] -= dv[2] * force2;
+            jerk.x[j] -= jv2[0];
+            jerk.y[j] -= jv2[1];
+            jerk.z[j] -= jv2[2];
+
+        }
+
+        accel.x[i] += p1_acc[0];
+        accel.y[i] += p1_acc[1];
+        accel.z[i] += p1_acc[2];
+        jerk.x[i] += p1_jerk[0];
+        jerk.y[i] += p1_jerk[1];
+        jerk.z[i] += p1_jerk[2];
+
+    }
+
 }
 
+HOT
+void processTileJerkPP(particle_vectors pos, acc_vectors vel, acc_vectors accel, acc_vectors jerk, int i0, int i1, int j0, int j1, float soft2, int physics) {
+
+    switch (physics) {
+
+    case PH_PROPER:
+        ppTileJerk(pos, vel, accel, jerk, i0, i1, j0, j1, soft2, PH_PROPER);
+        break;
+
+    case PH_MODIFIED:
+        ppTileJerk(pos, vel, accel, jerk, i0, i1, j0, j1, soft2, PH_MODIFIED);
+        break;
+
+    default:
+        ppTileJerk(pos, vel, accel, jerk, i0, i1, j0, j1, soft2, PH_CLASSIC);
+        break;
+
+    }
+
+}
+
+/*
+ * scalar kernel for interaction lists: adds the pull of list particles
+ * 0 .. n-1 at pos to acc (without g and the mass of the particle at pos).
+ * Particles at the very same position (the particle itself) are skipped.
+ */
+KERNEL_INLINE void ppList(particle_vectors list, int n, float *pos, float *acc, float soft2, const int physics) {
+
+    int j;
+
+    for (j = 0; j < n; j++) {
+
+        VectorNew(dv);
+        float d;
+        float force;
+
+        dv[0] = pos[0] - list.x[j];
+        dv[1] = pos[1] - list.y[j];
+        dv[2] = pos[2] - list.z[j];
+
+        d = dv[0] * dv[0] + dv[1] * dv[1] + dv[2] * dv[2];
+
+        if (!d)
+            continue;
+        d += soft2;
+
+        force = list.mass[j] / ppLawDivisor(d, physics);
+        VectorMultiplyAdd(dv, force, acc);
+
+    }
+
+}
+
+// the mass of the particle at pos is not in there, so MODIFIED is the same as CLASSIC
+HOT
+void processListPP(particle_vectors list, int n, float *pos, float *acc, float soft2, int physics) {
+
+    if (physics == PH_PROPER)
+        ppList(list, n, pos, acc, soft2, PH_PROPER);
+    else
+        ppList(list, n, pos, acc, soft2, PH_CLASSIC);
+
+}
+
+/*
+ * same as processListPP(), for list entries with a quadrupole moment:
+ *   mass * dv / d - (tr(Q) dv + 2 Q dv) / d^2 + 4 (dv Q dv) dv / d^3
+ * PROPER, with s = 1 / d^1.5:
+ *   mass * dv * s - (1.5 tr(Q) dv + 3 Q dv) * s / d + 7.5 (dv Q dv) dv * s / d^2
+ * with d = |dv|^2 + soft2, the expansion of the softened potential
+ * (see otNodeForce() in frame-ot.c)
+ */
+KERNEL_INLINE void ppListQuad(quad_vectors list, int n, float *pos, float *acc, float soft2, const int physics) {
+
+    int j;
+
+    for (j = 0; j < n; j++) {
+
+        VectorNew(dv);
+        VectorNew(qdv);
+        float d, d2;
+        float trace, dqd;
+        float f;
+
+        dv[0] = pos[0] - list.x[j];
+        dv[1] = pos[1] - list.y[j];
+        dv[2] = pos[2] - list.z[j];
+
+        d = dv[0] * dv[0] + dv[1] * dv[1] + dv[2] * dv[2];
+
+        if (!d)
+            continue;
+        d += soft2;
+
+        qdv[0] = list.q[0][j] * dv[0] + list.q[3][j] * dv[1] + list.q[4][j] * dv[2];
+        qdv[1] = list.q[3][j] * dv[0] + list.q[1][j] * dv[1] + list.q[5][j] * dv[2];
+        qdv[2] = list.q[4][j] * dv[0] + list.q[5][j] * dv[1] + list.q[2][j] * dv[2];
+
+        trace = list.q[0][j] + list.q[1][j] + list.q[2][j];
+        dqd = dv[0] * qdv[0] + dv[1] * qdv[1] + dv[2] * qdv[2];
+
+        if (physics == PH_PROPER) {
+
+            float s = 1 / ppLawDivisor(d, physics);
+
+            d = 1 / d;
+            f = (list.mass[j] + (7.5f * dqd * d - 1.5f * trace) * d) * s;
+            VectorMultiplyAdd(qdv, -3 * s * d, acc);
+            VectorMultiplyAdd(dv, f, acc);
+
+        } else {
+
+            d2 = d * d;
+
+            f = list.mass[j] / d + (4 * dqd / d - trace) / d2;
+            VectorMultiplyAdd(qdv, -2 / d2, acc);
+            VectorMultiplyAdd(dv, f, acc);
+
+        }
+
+    }
+
+}
+
+HOT
+void processListQuadPP(quad_vectors list, int n, float *pos, float *acc, float soft2, int physics) {
+
+    if (physics == PH_PROPER)
+        ppListQuad(list, n, pos, acc, soft2, PH_PROPER);
+    else
+        ppListQuad(list, n, pos, acc, soft2, PH_CLASSIC);
+
+}
+
+/*
+ * potential of list particles 0 .. n-1 at pos (without g and the mass of
+ * the particle at pos): the sum of mass * F(d), with d = |dv|^2 + soft2 and
+ * F = ln(r) = 0.5 ln(d) for CLASSIC and MODIFIED, F = -1/sqrt(d) for
+ * PROPER. The pull of processListPP() is the gradient of it. Particles at
+ * the very same position are skipped. Only used for the diagnostics, so
+ * there are no SSE versions.
+ */
+KERNEL_INLINE double ppListPotential(particle_vectors list, int n, float *pos, float soft2, const int physics) {
+
+    double phi = 0;
+    int j;
+
+    for (j = 0; j < n; j++) {
+
+        VectorNew(dv);
+        float d;
+
+        dv[0] = pos[0] - list.x[j];
+        dv[1] = pos[1] - list.y[j];
+        dv[2] = pos[2] - list.z[j];
+
+        d = dv[0] * dv[0] + dv[1] * dv[1] + dv[2] * dv[2];
+
+        if (!d)
+            continue;
+        d += soft2;
+
+        if (physics == PH_PROPER)
+            phi -= list.mass[j] / sqrt(d);
+        else
+            phi += list.mass[j] * 0.5 * log(d);
+
+    }
+
+    return phi;
+
+}
+
+double processListPotentialPP(particle_vectors list, int n, float *pos, float soft2, int physics) {
+
+    if (physics == PH_PROPER)
+        return ppListPotential(list, n, pos, soft2, PH_PROPER);
+
+    return ppListPotential(list, n, pos, soft2, PH_CLASSIC);
+
+}
+
+/*
+ * same as processListPotentialPP(), for list entries with a quadrupole
+ * moment (see processListQuadPP()):
+ *   mass * 0.5 ln(d) + tr(Q) / 2d - (dv Q dv) / d^2
+ * PROPER, with s = 1 / d^1.5:
+ *   -mass / sqrt(d) + (0.5 tr(Q) - 1.5 (dv Q dv) / d) * s
+ */
+KERNEL_INLINE double ppListQuadPotential(quad_vectors list, int n, float *pos, float soft2, const int physics) {
+
+    double phi = 0;
+    int j;
+
+    for (j = 0; j < n; j++) {
+
+        VectorNew(dv);
+        VectorNew(qdv);
+        double d;
+        double trace, dqd;
+
+        dv[0] = pos[0] - list.x[j];
+        dv[1] = pos[1] - list.y[j];
+        dv[2] = pos[2] - list.z[j];
+
+        d = dv[0] * dv[0] + dv[1] * dv[1] + dv[2] * dv[2];
+
+        if (!d)
+            continue;
+        d += soft2;
+
+        qdv[0] = list.q[0][j] * dv[0] + list.q[3][j] * dv[1] + list.q[4][j] * dv[2];
+        qdv[1] = list.q[3][j] * dv[0] + list.q[1][j] * dv[1] + list.q[5][j] * dv[2];
+        qdv[2] = list.q[4][j] * dv[0] + list.q[5][j] * dv[1] + list.q[2][j] * dv[2];
+
+        trace = list.q[0][j] + list.q[1][j] + list.q[2][j];
+        dqd = dv[0] * qdv[0] + dv[1] * qdv[1] + dv[2] * qdv[2];
+
+        if (physics == PH_PROPER)
+            phi += (-list.mass[j] * d + 0.5 * trace - 1.5 * dqd / d) / (d * sqrt(d));
+        else
+            phi += list.mass[j] * 0.5 * log(d) + (0.5 * trace - dqd / d) / d;
+
+    }
+
+    return phi;
+
+}
+
+double processListQuadPotentialPP(quad_vectors list, int n, float *pos, float soft2, int physics) {
+
+    if (physics == PH_PROPER)
+        return ppListQuadPotential(list, n, pos, soft2, PH_PROPER);
+
+    return ppListQuadPotential(list, n, pos, soft2, PH_CLASSIC);
+
+}
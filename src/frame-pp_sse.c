@@ -30,54 +30,44 @@ Foundation, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
 #endif
 
 
-// __restrict__ tell the compiler that two pointer will not point to the same location
-// if your compiler complains, just remove __restrict__
-
-#ifdef _MSC_VER
-#define __restrict__ __restrict
-//#define __restrict__
-#endif
-
-
-typedef struct {
-    float * __restrict__ x;
-    float * __restrict__ y;
-    float * __restrict__ z;
-    float * __restrict__ mass;
-} particle_vectors;
-
-typedef struct {
-    float * __restrict__ x;
-    float * __restrict__ y;
-    float * __restrict__ z;
-} acc_vectors;
+#include "sse_functions.h"
 
 
-#include "sse_functions.h"
+/* AVX2 and AVX-512 kernels are compiled with function specific target
+   options, so the same binary still runs on cpus which only have SSE.
+   ppSimdLevel() finds out at runtime which one can be used. */
+#if defined(__GNUC__) && ((__GNUC__ >= 5) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+    #define HAVE_AVX_KERNELS
+    #define TARGET_AVX2   __attribute__((target("avx2,fma")))
+    #define TARGET_AVX512 __attribute__((target("avx512f")))
+    #include <immintrin.h>
+#elif defined(_MSC_VER) && (_MSC_VER >= 1910)
+    #define HAVE_AVX_KERNELS
+    #define TARGET_AVX2
+    #define TARGET_AVX512
+    #include <immintrin.h>
+    #include <intrin.h>
+#endif
 
 
 /*  Optimizations:
     ===============
-    * before processing, copy particle data to vector-friendly arrays
+    * particle data is kept in vector-friendly arrays (the working set, see frame.c)
     * use SSE to process four particles at once
+      (AVX2: eight, AVX-512: sixteen particles, if the cpu has it)
     * delay multiplication with G
-    * after processing, write back results
+    * one instance of each kernel per physics mode (see frame-pp.c). PROPER
+      uses the fast inverse square root, 1/r^3 = rsqrt(d)^3
 */
 
 
-#define MIN_STEP2 0.05f
-static const __v128 vmin_step2 = _mm_init1_ps(MIN_STEP2);
-
-HOT
-static void do_processFramePP_SSE(particle_vectors pos, acc_vectors accel,
-                                  int start, int amount) {
+KERNEL_INLINE void ppTileSSE(particle_vectors pos, acc_vectors accel,
+                             int i0, int i1, int j0, int j1, float soft2, const int physics) {
+    const __v128 vsoft2 = _mm_set1_ps(soft2);
     int i;
 
     // apply gravity to every specified velocity
-#ifdef _OPENMP
-#pragma omp parallel for schedule(dynamic, 256)
-#endif
-    for (i = start; i < amount; i++) {
+    for (i = i0; i < i1; i++) {
         __v128 p1_vpos_x ;
         __v128 p1_vpos_y ;
         __v128 p1_vpos_z ;
@@ -102,8 +92,10 @@ static void do_processFramePP_SSE(particle_vectors pos, acc_vectors accel,
 
 
         int j;
+        int jEnd;
         int vector_limit;
-        vector_limit = (i / VECT_SIZE) * VECT_SIZE;  // round down to value divisible by 4
+        jEnd = (j1 < i) ? j1 : i;
+        vector_limit = j0 + ((jEnd - j0) / VECT_SIZE) * VECT_SIZE;  // round down to value divisible by 4
 
         p1_vpos_x = _mm_set1_ps(pos.x[i]);
         p1_vpos_y = _mm_set1_ps(pos.y[i]);
@@ -115,12 +107,12 @@ static void do_processFramePP_SSE(particle_vectors pos, acc_vectors accel,
 #ifdef __INTEL_COMPILER
 #pragma vector aligned
 #endif
-        for (j = 0; j < vector_limit; j += VECT_SIZE) {
+        for (j = j0; j < vector_limit; j += VECT_SIZE) {
             __v128 dv_vx ;
             __v128 dv_vy ;
             __v128 dv_vz ;
             __v128 vInvSqDist;
-            __v128 vforce;
+            __v128 vforce, vforce2;
 
             dv_vx = V_SUB( p1_vpos_x, LOAD_V4(pos.x, j));
             dv_vy = V_SUB( p1_vpos_y, LOAD_V4(pos.y, j));
@@ -130,10 +122,23 @@ static void do_processFramePP_SSE(particle_vectors pos, acc_vectors accel,
             vInvSqDist  = V_MUL( dv_vx, dv_vx);
             V_INCR( vInvSqDist, V_MUL( dv_vy, dv_vy));
             V_INCR( vInvSqDist, V_MUL( dv_vz, dv_vz));
-            V_INCR( vInvSqDist, vmin_step2);
+            V_INCR( vInvSqDist, vsoft2);
 
             /* compute acceleration */
-            vforce = V_MUL( V_MUL( p1_vmass, LOAD_V4(pos.mass, j)), newtonrapson_rcp(vInvSqDist));
+            if (physics == PH_CLASSIC) {
+                vforce = V_MUL( V_MUL( p1_vmass, LOAD_V4(pos.mass, j)), newtonrapson_rcp(vInvSqDist));
+                vforce2 = vforce;
+            } else {
+                __v128 vlaw;
+                if (physics == PH_PROPER) {
+                    vlaw = newtonrapson_rsqrt4(vInvSqDist);
+                    vlaw = V_MUL( V_MUL( vlaw, vlaw), vlaw);
+                } else {
+                    vlaw = newtonrapson_rcp(vInvSqDist);
+                }
+                vforce = V_MUL( LOAD_V4(pos.mass, j), vlaw);
+                vforce2 = V_MUL( p1_vmass, vlaw);
+            }
 
             // sum of accelerations for p1
             V_INCR( p1_vaccel_x, V_MUL( dv_vx, vforce));
@@ -141,9 +146,9 @@ static void do_processFramePP_SSE(particle_vectors pos, acc_vectors accel,
             V_INCR( p1_vaccel_z, V_MUL( dv_vz, vforce));
 
             // add acceleration for p2 (with negative sign, as the direction is inverted)
-            SUB_V4(accel.x, j, V_MUL( dv_vx, vforce));
-            SUB_V4(accel.y, j, V_MUL( dv_vy, vforce));
-            SUB_V4(accel.z, j, V_MUL( dv_vz, vforce));
+            SUB_V4(accel.x, j, V_MUL( dv_vx, vforce2));
+            SUB_V4(accel.y, j, V_MUL( dv_vy, vforce2));
+            SUB_V4(accel.z, j, V_MUL( dv_vz, vforce2));
 
         }
 
@@ -161,10 +166,10 @@ static void do_processFramePP_SSE(particle_vectors pos, acc_vectors accel,
 
 
         // do the remaining particles without SSE
-        for (j = vector_limit; j < i; j++) {
+        for (j = vector_limit; j < jEnd; j++) {
             VectorNew(dv);
             float inverseSquareDistance;
-            float force;
+            float force, force2;
 
             dv[0] = p1_pos_x - pos.x[j];
             dv[1] = p1_pos_y - pos.y[j];
@@ -174,10 +179,10 @@ static void do_processFramePP_SSE(particle_vectors pos, acc_vectors accel,
             inverseSquareDistance  = dv[0] * dv[0];
             inverseSquareDistance += dv[1] * dv[1];
             inverseSquareDistance += dv[2] * dv[2];
-            inverseSquareDistance +=  + MIN_STEP2;
+            inverseSquareDistance += soft2;
 
             /* compute acceleration */
-            force = p1_mass * pos.mass[j] / inverseSquareDistance;
+            ppPairForce(p1_mass, pos.mass[j], inverseSquareDistance, physics, &force, &force2);
 
             // sum of accelerations for p1
             p1_accel_x += dv[0] * force;
@@ -185,9 +190,9 @@ static void do_processFramePP_SSE(particle_vectors pos, acc_vectors accel,
             p1_accel_z += dv[2] * force;
 
             // add acceleration for p2 (with negative sign, as the direction is inverted)
-            accel.x[j] -= dv[0] * force;
-            accel.y[j] -= dv[1] * force;
-            accel.z[j] -= dv[2] * force;
+            accel.x[j] -= dv[0] * force2;
+            accel.y[j] -= dv[1] * force2;
+            accel.z[j] -= dv[2] * force2;
         }
 
 
@@ -200,64 +205,784 @@ static void do_processFramePP_SSE(particle_vectors pos, acc_vectors accel,
 
 }
 
+HOT
+static void do_processFramePP_SSE(particle_vectors pos, acc_vectors accel,
+                                  int i0, int i1, int j0, int j1, float soft2, int physics) {
+
+    switch (physics) {
+
+    case PH_PROPER:
+        ppTileSSE(pos, accel, i0, i1, j0, j1, soft2, PH_PROPER);
+        break;
+
+    case PH_MODIFIED:
+        ppTileSSE(pos, accel, i0, i1, j0, j1, soft2, PH_MODIFIED);
+        break;
+
+    default:
+        ppTileSSE(pos, accel, i0, i1, j0, j1, soft2, PH_CLASSIC);
+        break;
+
+    }
+
+}
+
+
+
+/*
+ * interaction list kernel: pull of list particles 0 .. n-1 at pos, added
+ * to acc (without g and the mass of the particle at pos). n has to be a
+ * multiple of 16, the lists are padded with massless particles.
+ * Particles at the very same position (d == 0, the particle itself) are
+ * masked out before soft2 is added - like the octree does it.
+ */
+KERNEL_INLINE void ppListSSE(particle_vectors list, int n, float *pos, float *acc, float soft2, const int physics) {
+
+    __v128 p1_vpos_x = _mm_set1_ps(pos[0]);
+    __v128 p1_vpos_y = _mm_set1_ps(pos[1]);
+    __v128 p1_vpos_z = _mm_set1_ps(pos[2]);
+
+    __v128 p1_vaccel_x = _mm_init1_ps(0.0f);
+    __v128 p1_vaccel_y = _mm_init1_ps(0.0f);
+    __v128 p1_vaccel_z = _mm_init1_ps(0.0f);
+
+    const __v128 vzero = _mm_init1_ps(0.0f);
+    const __v128 vsoft2 = _mm_set1_ps(soft2);
+
+    int j;
+
+    for (j = 0; j < n; j += VECT_SIZE) {
+        __v128 dv_vx ;
+        __v128 dv_vy ;
+        __v128 dv_vz ;
+        __v128 vSqDist, vmask;
+        __v128 vforce;
+
+        dv_vx = V_SUB( p1_vpos_x, LOAD_V4(list.x, j));
+        dv_vy = V_SUB( p1_vpos_y, LOAD_V4(list.y, j));
+        dv_vz = V_SUB( p1_vpos_z, LOAD_V4(list.z, j));
+
+        // get distance^2 between the two
+        vSqDist  = V_MUL( dv_vx, dv_vx);
+        V_INCR( vSqDist, V_MUL( dv_vy, dv_vy));
+        V_INCR( vSqDist, V_MUL( dv_vz, dv_vz));
+        vmask = _mm_cmpgt_ps(vSqDist, vzero);
+        V_INCR( vSqDist, vsoft2);
+
+        // m / distance^2, zero where distance^2 is zero
+        if (physics == PH_PROPER) {
+            __v128 vrsqrt = newtonrapson_rsqrt4(vSqDist);
+            vforce = V_MUL( LOAD_V4(list.mass, j), V_MUL( V_MUL( vrsqrt, vrsqrt), vrsqrt));
+        } else {
+            vforce = V_MUL( LOAD_V4(list.mass, j), newtonrapson_rcp(vSqDist));
+        }
+        vforce = _mm_and_ps( vforce, vmask);
+
+        V_INCR( p1_vaccel_x, V_MUL( dv_vx, vforce));
+        V_INCR( p1_vaccel_y, V_MUL( dv_vy, vforce));
+        V_INCR( p1_vaccel_z, V_MUL( dv_vz, vforce));
+
+    }
+
+    acc[0] += _vector4_sum(p1_vaccel_x);
+    acc[1] += _vector4_sum(p1_vaccel_y);
+    acc[2] += _vector4_sum(p1_vaccel_z);
+
+}
+
+HOT
+static void do_processListPP_SSE(particle_vectors list, int n, float *pos, float *acc, float soft2, int physics) {
+
+    if (physics == PH_PROPER)
+        ppListSSE(list, n, pos, acc, soft2, PH_PROPER);
+    else
+        ppListSSE(list, n, pos, acc, soft2, PH_CLASSIC);
+
+}
+
+
+/*
+ * same as do_processListPP_SSE(), for list entries with a quadrupole
+ * moment (see processListQuadPP()). n has to be a multiple of 4
+ */
+KERNEL_INLINE void ppListQuadSSE(quad_vectors list, int n, float *pos, float *acc, float soft2, const int physics) {
+
+    __v128 p1_vpos_x = _mm_set1_ps(pos[0]);
+    __v128 p1_vpos_y = _mm_set1_ps(pos[1]);
+    __v128 p1_vpos_z = _mm_set1_ps(pos[2]);
+
+    __v128 p1_vaccel_x = _mm_init1_ps(0.0f);
+    __v128 p1_vaccel_y = _mm_init1_ps(0.0f);
+    __v128 p1_vaccel_z = _mm_init1_ps(0.0f);
+
+    const __v128 vzero = _mm_init1_ps(0.0f);
+    const __v128 vfour = _mm_init1_ps(physics == PH_PROPER ? 7.5f : 4.0f);
+    const __v128 vmtwo = _mm_init1_ps(physics == PH_PROPER ? -3.0f : -2.0f);
+    const __v128 vtracef = _mm_init1_ps(1.5f);
+    const __v128 vsoft2 = _mm_set1_ps(soft2);
+
+    int j;
+
+    for (j = 0; j < n; j += VECT_SIZE) {
+        __v128 dv_vx, dv_vy, dv_vz;
+        __v128 qxx, qyy, qzz, qxy, qxz, qyz;
+        __v128 qdv_vx, qdv_vy, qdv_vz;
+        __v128 vSqDist, vInv, vInv2, vmask;
+        __v128 vtrace, vdqd;
+        __v128 vforce, vqforce;
+
+        dv_vx = V_SUB( p1_vpos_x, LOAD_V4(list.x, j));
+        dv_vy = V_SUB( p1_vpos_y, LOAD_V4(list.y, j));
+        dv_vz = V_SUB( p1_vpos_z, LOAD_V4(list.z, j));
+
+        vSqDist  = V_MUL( dv_vx, dv_vx);
+        V_INCR( vSqDist, V_MUL( dv_vy, dv_vy));
+        V_INCR( vSqDist, V_MUL( dv_vz, dv_vz));
+
+        vmask = _mm_cmpgt_ps(vSqDist, vzero);
+        V_INCR( vSqDist, vsoft2);
+        vInv  = newtonrapson_rcp(vSqDist);
+        vInv2 = V_MUL( vInv, vInv);
+
+        qxx = LOAD_V4(list.q[0], j);
+        qyy = LOAD_V4(list.q[1], j);
+        qzz = LOAD_V4(list.q[2], j);
+        qxy = LOAD_V4(list.q[3], j);
+        qxz = LOAD_V4(list.q[4], j);
+        qyz = LOAD_V4(list.q[5], j);
+
+        // Q dv
+        qdv_vx = V_ADD( V_ADD( V_MUL(qxx, dv_vx), V_MUL(qxy, dv_vy)), V_MUL(qxz, dv_vz));
+        qdv_vy = V_ADD( V_ADD( V_MUL(qxy, dv_vx), V_MUL(qyy, dv_vy)), V_MUL(qyz, dv_vz));
+        qdv_vz = V_ADD( V_ADD( V_MUL(qxz, dv_vx), V_MUL(qyz, dv_vy)), V_MUL(qzz, dv_vz));
+
+        vtrace = V_ADD( V_ADD(qxx, qyy), qzz);
+        vdqd = V_ADD( V_ADD( V_MUL(dv_vx, qdv_vx), V_MUL(dv_vy, qdv_vy)), V_MUL(dv_vz, qdv_vz));
+
+        if (physics == PH_PROPER) {
+
+            // s = 1 / d^1.5: (mass + (7.5 dqd / d - 1.5 trace) / d) * s, and -3 s / d for Q dv
+            __v128 vs = newtonrapson_rsqrt4(vSqDist);
+            vs = V_MUL( V_MUL( vs, vs), vs);
+
+            vforce = V_MUL( V_SUB( V_MUL(vfour, vdqd), V_MUL( vtracef, V_MUL(vtrace, vSqDist))), vInv2);
+            vforce = V_MUL( V_ADD( LOAD_V4(list.mass, j), vforce), vs);
+            vforce = _mm_and_ps( vforce, vmask);
+            vqforce = _mm_and_ps( V_MUL( V_MUL(vmtwo, vs), vInv), vmask);
+
+        } else {
+
+            // mass / d + (4 dqd / d - trace) / d^2, and -2 / d^2 for Q dv
+            vforce = V_MUL( LOAD_V4(list.mass, j), vInv);
+            V_INCR( vforce, V_MUL( V_SUB( V_MUL( V_MUL(vfour, vdqd), vInv), vtrace), vInv2));
+            vforce = _mm_and_ps( vforce, vmask);
+            vqforce = _mm_and_ps( V_MUL(vmtwo, vInv2), vmask);
+
+        }
+
+        V_INCR( p1_vaccel_x, V_ADD( V_MUL( dv_vx, vforce), V_MUL( qdv_vx, vqforce)));
+        V_INCR( p1_vaccel_y, V_ADD( V_MUL( dv_vy, vforce), V_MUL( qdv_vy, vqforce)));
+        V_INCR( p1_vaccel_z, V_ADD( V_MUL( dv_vz, vforce), V_MUL( qdv_vz, vqforce)));
+
+    }
+
+    acc[0] += _vector4_sum(p1_vaccel_x);
+    acc[1] += _vector4_sum(p1_vaccel_y);
+    acc[2] += _vector4_sum(p1_vaccel_z);
+
+}
+
+HOT
+static void do_processListQuadPP_SSE(quad_vectors list, int n, float *pos, float *acc, float soft2, int physics) {
+
+    if (physics == PH_PROPER)
+        ppListQuadSSE(list, n, pos, acc, soft2, PH_PROPER);
+    else
+        ppListQuadSSE(list, n, pos, acc, soft2, PH_CLASSIC);
+
+}
+
+
+
+char *simdNames[SIMD_LAST] = { "SSE", "AVX2", "AVX-512" };
+
+/*
+ * widest vector unit this cpu (and operating system) supports.
+ * checked only once, the first call happens at startup
+ */
+int ppSimdLevel() {
+
+    static int level = -1;
+    int found = SIMD_SSE;
+
+    if (level >= 0)
+        return level;
+
+#if defined(HAVE_AVX_KERNELS) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        found = SIMD_AVX2;
+    if (__builtin_cpu_supports("avx512f"))
+        found = SIMD_AVX512;
+#elif defined(HAVE_AVX_KERNELS) && defined(_MSC_VER)
+    {
+        int info[4];
+        unsigned __int64 xcr0 = 0;
+        int avx, fma;
+
+        __cpuid(info, 1);
+        fma = (info[2] & (1 << 12)) != 0;
+        avx = (info[2] & (1 << 28)) != 0;
+
+        // does the OS save the ymm / zmm registers?
+        if (info[2] & (1 << 27))
+            xcr0 = _xgetbv(0);
+
+        __cpuid(info, 0);
+        if (info[0] >= 7 && avx && (xcr0 & 0x06) == 0x06) {
+
+            __cpuidex(info, 7, 0);
+
+            if (fma && (info[1] & (1 << 5)))
+                found = SIMD_AVX2;
+            if ((info[1] & (1 << 16)) && (xcr0 & 0xe6) == 0xe6)
+                found = SIMD_AVX512;
+
+        }
+    }
+#endif
+
+    level = found;
+
+    return level;
+
+}
+
+#ifdef HAVE_AVX_KERNELS
+
+// same as the scalar loop at the end of ppTileSSE()
+KERNEL_INLINE void ppTileRest(particle_vectors pos, acc_vectors accel,
+                              int i, int from, int to, float *p1_accel, float soft2, const int physics) {
+    int j;
+
+    for (j = from; j < to; j++) {
+        VectorNew(dv);
+        float inverseSquareDistance;
+        float force, force2;
 
+        dv[0] = pos.x[i] - pos.x[j];
+        dv[1] = pos.y[i] - pos.y[j];
+        dv[2] = pos.z[i] - pos.z[j];
 
-void processFramePP_SSE(int start, int amount) {
-    particle_vectors pos;
-    acc_vectors accel;
-    particle_t *framebase = state.particleHistory + state.particleCount*state.frame;
-    particleDetail_t * __restrict__ framedetail = state.particleDetail;
+        // get distance^2 between the two
+        inverseSquareDistance  = dv[0] * dv[0];
+        inverseSquareDistance += dv[1] * dv[1];
+        inverseSquareDistance += dv[2] * dv[2];
+        inverseSquareDistance += soft2;
+
+        ppPairForce(pos.mass[i], pos.mass[j], inverseSquareDistance, physics, &force, &force2);
+
+        VectorMultiplyAdd(dv, force, p1_accel);
+
+        accel.x[j] -= dv[0] * force2;
+        accel.y[j] -= dv[1] * force2;
+        accel.z[j] -= dv[2] * force2;
+    }
+
+}
 
+/*
+ * same as ppTileSSE(), eight particles at once.
+ * distance^2 is summed up with FMA
+ */
+TARGET_AVX2 KERNEL_INLINE void ppTileAVX2(particle_vectors pos, acc_vectors accel,
+                                          int i0, int i1, int j0, int j1, float soft2, const int physics) {
     int i;
-    int particles_max;
-    particles_max = state.particleCount;
 
+    for (i = i0; i < i1; i++) {
+        __m256 p1_vpos_x = _mm256_set1_ps(pos.x[i]);
+        __m256 p1_vpos_y = _mm256_set1_ps(pos.y[i]);
+        __m256 p1_vpos_z = _mm256_set1_ps(pos.z[i]);
+        __m256 p1_vmass  = _mm256_set1_ps(pos.mass[i]);
+
+        __m256 p1_vaccel_x = _mm256_setzero_ps();
+        __m256 p1_vaccel_y = _mm256_setzero_ps();
+        __m256 p1_vaccel_z = _mm256_setzero_ps();
 
-    // create arrays aligned to 64 bytes  (cache line lize)
-    pos.x    = (float*) _mm_malloc(sizeof(float)*(particles_max + 64), 64);
-    pos.y    = (float*) _mm_malloc(sizeof(float)*(particles_max + 64), 64);
-    pos.z    = (float*) _mm_malloc(sizeof(float)*(particles_max + 64), 64);
-    pos.mass = (float*) _mm_malloc(sizeof(float)*(particles_max + 64), 64);
+        const __m256 vsoft2_8 = _mm256_set1_ps(soft2);
+        const __m256 two8 = _mm256_set1_ps(2.0f);
+        const __m256 half8 = _mm256_set1_ps(0.5f);
+        const __m256 threehalf8 = _mm256_set1_ps(1.5f);
 
-    accel.x = (float*) _mm_malloc(sizeof(float)*(particles_max + 64), 64);
-    accel.y = (float*) _mm_malloc(sizeof(float)*(particles_max + 64), 64);
-    accel.z = (float*) _mm_malloc(sizeof(float)*(particles_max + 64), 64);
+        float sum[3][8];
+        VectorNew(p1_accel);
 
-    memset(accel.x, 0, sizeof(float) * (particles_max + 64));
-    memset(accel.y, 0, sizeof(float) * (particles_max + 64));
-    memset(accel.z, 0, sizeof(float) * (particles_max + 64));
+        int j;
+        int jEnd;
+        int vector_limit;
+        jEnd = (j1 < i) ? j1 : i;
+        vector_limit = j0 + ((jEnd - j0) / 8) * 8;
 
+        for (j = j0; j < vector_limit; j += 8) {
+            __m256 dv_vx, dv_vy, dv_vz;
+            __m256 vSqDist, vrcp, vforce, vforce2;
+            __m256 ax, ay, az;
+
+            dv_vx = _mm256_sub_ps(p1_vpos_x, _mm256_load_ps(pos.x + j));
+            dv_vy = _mm256_sub_ps(p1_vpos_y, _mm256_load_ps(pos.y + j));
+            dv_vz = _mm256_sub_ps(p1_vpos_z, _mm256_load_ps(pos.z + j));
+
+            // get distance^2 between the two
+            vSqDist = _mm256_fmadd_ps(dv_vx, dv_vx, vsoft2_8);
+            vSqDist = _mm256_fmadd_ps(dv_vy, dv_vy, vSqDist);
+            vSqDist = _mm256_fmadd_ps(dv_vz, dv_vz, vSqDist);
+
+            if (physics == PH_PROPER) {
+                // 1/distance^3, from 1/distance with one newton-raphson step
+                vrcp = _mm256_rsqrt_ps(vSqDist);
+                vrcp = _mm256_mul_ps(vrcp, _mm256_fnmadd_ps(_mm256_mul_ps(half8, vSqDist), _mm256_mul_ps(vrcp, vrcp), threehalf8));
+                vrcp = _mm256_mul_ps(_mm256_mul_ps(vrcp, vrcp), vrcp);
+            } else {
+                // 1/distance^2, with one newton-raphson step
+                vrcp = _mm256_rcp_ps(vSqDist);
+                vrcp = _mm256_mul_ps(vrcp, _mm256_fnmadd_ps(vrcp, vSqDist, two8));
+            }
+
+            if (physics == PH_CLASSIC) {
+                vforce = _mm256_mul_ps(_mm256_mul_ps(p1_vmass, _mm256_load_ps(pos.mass + j)), vrcp);
+                vforce2 = vforce;
+            } else {
+                vforce = _mm256_mul_ps(_mm256_load_ps(pos.mass + j), vrcp);
+                vforce2 = _mm256_mul_ps(p1_vmass, vrcp);
+            }
+
+            ax = _mm256_mul_ps(dv_vx, vforce);
+            ay = _mm256_mul_ps(dv_vy, vforce);
+            az = _mm256_mul_ps(dv_vz, vforce);
+
+            // sum of accelerations for p1
+            p1_vaccel_x = _mm256_add_ps(p1_vaccel_x, ax);
+            p1_vaccel_y = _mm256_add_ps(p1_vaccel_y, ay);
+            p1_vaccel_z = _mm256_add_ps(p1_vaccel_z, az);
+
+            if (physics != PH_CLASSIC) {
+                ax = _mm256_mul_ps(dv_vx, vforce2);
+                ay = _mm256_mul_ps(dv_vy, vforce2);
+                az = _mm256_mul_ps(dv_vz, vforce2);
+            }
+
+            // add acceleration for p2 (with negative sign, as the direction is inverted)
+            _mm256_store_ps(accel.x + j, _mm256_sub_ps(_mm256_load_ps(accel.x + j), ax));
+            _mm256_store_ps(accel.y + j, _mm256_sub_ps(_mm256_load_ps(accel.y + j), ay));
+            _mm256_store_ps(accel.z + j, _mm256_sub_ps(_mm256_load_ps(accel.z + j), az));
+
+        }
+
+        // copy vector results to single floats
+        _mm256_storeu_ps(sum[0], p1_vaccel_x);
+        _mm256_storeu_ps(sum[1], p1_vaccel_y);
+        _mm256_storeu_ps(sum[2], p1_vaccel_z);
+
+        VectorZero(p1_accel);
+        for (j = 0; j < 8; j++) {
+            p1_accel[0] += sum[0][j];
+            p1_accel[1] += sum[1][j];
+            p1_accel[2] += sum[2][j];
+        }
+
+        // do the remaining particles without AVX
+        ppTileRest(pos, accel, i, vector_limit, jEnd, p1_accel, soft2, physics);
+
+        // write back buffered acceleration of p1
+        accel.x[i] += p1_accel[0];
+        accel.y[i] += p1_accel[1];
+        accel.z[i] += p1_accel[2];
 
-    // copy frame data to vector-friendly arrays
-    for (i=0; i<particles_max; i++) {
-        pos.x[i] = framebase[i].pos[0];
-        pos.y[i] = framebase[i].pos[1];
-        pos.z[i] = framebase[i].pos[2];
-        pos.mass[i] = state.particleDetail[i].mass;
     }
 
+    _mm256_zeroupper();
+
+}
+
+TARGET_AVX2 HOT
+static void do_processFramePP_AVX2(particle_vectors pos, acc_vectors accel,
+                                   int i0, int i1, int j0, int j1, float soft2, int physics) {
+
+    switch (physics) {
+
+    case PH_PROPER:
+        ppTileAVX2(pos, accel, i0, i1, j0, j1, soft2, PH_PROPER);
+        break;
 
-    // calculate new accelerations
-    do_processFramePP_SSE(pos, accel, start, amount);
+    case PH_MODIFIED:
+        ppTileAVX2(pos, accel, i0, i1, j0, j1, soft2, PH_MODIFIED);
+        break;
 
+    default:
+        ppTileAVX2(pos, accel, i0, i1, j0, j1, soft2, PH_CLASSIC);
+        break;
 
-    // write back results
-    for (i=0; i<particles_max; i++) {
-        framedetail[i].accel[0] += accel.x[i] * state.g;
-        framedetail[i].accel[1] += accel.y[i] * state.g;
-        framedetail[i].accel[2] += accel.z[i] * state.g;
     }
 
+}
+
+/*
+ * same as ppTileSSE(), sixteen particles at once
+ */
+TARGET_AVX512 KERNEL_INLINE void ppTileAVX512(particle_vectors pos, acc_vectors accel,
+                                              int i0, int i1, int j0, int j1, float soft2, const int physics) {
+    int i;
+
+    for (i = i0; i < i1; i++) {
+        __m512 p1_vpos_x = _mm512_set1_ps(pos.x[i]);
+        __m512 p1_vpos_y = _mm512_set1_ps(pos.y[i]);
+        __m512 p1_vpos_z = _mm512_set1_ps(pos.z[i]);
+        __m512 p1_vmass  = _mm512_set1_ps(pos.mass[i]);
+
+        __m512 p1_vaccel_x = _mm512_setzero_ps();
+        __m512 p1_vaccel_y = _mm512_setzero_ps();
+        __m512 p1_vaccel_z = _mm512_setzero_ps();
+
+        const __m512 vsoft2_16 = _mm512_set1_ps(soft2);
+        const __m512 two16 = _mm512_set1_ps(2.0f);
+        const __m512 half16 = _mm512_set1_ps(0.5f);
+        const __m512 threehalf16 = _mm512_set1_ps(1.5f);
+
+        float sum[3][16];
+        VectorNew(p1_accel);
+
+        int j;
+        int jEnd;
+        int vector_limit;
+        jEnd = (j1 < i) ? j1 : i;
+        vector_limit = j0 + ((jEnd - j0) / 16) * 16;
+
+        for (j = j0; j < vector_limit; j += 16) {
+            __m512 dv_vx, dv_vy, dv_vz;
+            __m512 vSqDist, vrcp, vforce, vforce2;
+            __m512 ax, ay, az;
+
+            dv_vx = _mm512_sub_ps(p1_vpos_x, _mm512_load_ps(pos.x + j));
+            dv_vy = _mm512_sub_ps(p1_vpos_y, _mm512_load_ps(pos.y + j));
+            dv_vz = _mm512_sub_ps(p1_vpos_z, _mm512_load_ps(pos.z + j));
+
+            // get distance^2 between the two
+            vSqDist = _mm512_fmadd_ps(dv_vx, dv_vx, vsoft2_16);
+            vSqDist = _mm512_fmadd_ps(dv_vy, dv_vy, vSqDist);
+            vSqDist = _mm512_fmadd_ps(dv_vz, dv_vz, vSqDist);
+
+            if (physics == PH_PROPER) {
+                // 1/distance^3, from 1/distance (14bit) with one newton-raphson step
+                vrcp = _mm512_rsqrt14_ps(vSqDist);
+                vrcp = _mm512_mul_ps(vrcp, _mm512_fnmadd_ps(_mm512_mul_ps(half16, vSqDist), _mm512_mul_ps(vrcp, vrcp), threehalf16));
+                vrcp = _mm512_mul_ps(_mm512_mul_ps(vrcp, vrcp), vrcp);
+            } else {
+                // 1/distance^2 (14bit), with one newton-raphson step
+                vrcp = _mm512_rcp14_ps(vSqDist);
+                vrcp = _mm512_mul_ps(vrcp, _mm512_fnmadd_ps(vrcp, vSqDist, two16));
+            }
+
+            if (physics == PH_CLASSIC) {
+                vforce = _mm512_mul_ps(_mm512_mul_ps(p1_vmass, _mm512_load_ps(pos.mass + j)), vrcp);
+                vforce2 = vforce;
+            } else {
+                vforce = _mm512_mul_ps(_mm512_load_ps(pos.mass + j), vrcp);
+                vforce2 = _mm512_mul_ps(p1_vmass, vrcp);
+            }
+
+            ax = _mm512_mul_ps(dv_vx, vforce);
+            ay = _mm512_mul_ps(dv_vy, vforce);
+            az = _mm512_mul_ps(dv_vz, vforce);
+
+            // sum of accelerations for p1
+            p1_vaccel_x = _mm512_add_ps(p1_vaccel_x, ax);
+            p1_vaccel_y = _mm512_add_ps(p1_vaccel_y, ay);
+            p1_vaccel_z = _mm512_add_ps(p1_vaccel_z, az);
+
+            if (physics != PH_CLASSIC) {
+                ax = _mm512_mul_ps(dv_vx, vforce2);
+                ay = _mm512_mul_ps(dv_vy, vforce2);
+                az = _mm512_mul_ps(dv_vz, vforce2);
+            }
+
+            // add acceleration for p2 (with negative sign, as the direction is inverted)
+            _mm512_store_ps(accel.x + j, _mm512_sub_ps(_mm512_load_ps(accel.x + j), ax));
+            _mm512_store_ps(accel.y + j, _mm512_sub_ps(_mm512_load_ps(accel.y + j), ay));
+            _mm512_store_ps(accel.z + j, _mm512_sub_ps(_mm512_load_ps(accel.z + j), az));
+
+        }
+
+        // copy vector results to single floats
+        _mm512_storeu_ps(sum[0], p1_vaccel_x);
+        _mm512_storeu_ps(sum[1], p1_vaccel_y);
+        _mm512_storeu_ps(sum[2], p1_vaccel_z);
+
+        VectorZero(p1_accel);
+        for (j = 0; j < 16; j++) {
+            p1_accel[0] += sum[0][j];
+            p1_accel[1] += sum[1][j];
+            p1_accel[2] += sum[2][j];
+        }
+
+        // do the remaining particles without AVX
+        ppTileRest(pos, accel, i, vector_limit, jEnd, p1_accel, soft2, physics);
+
+        // write back buffered acceleration of p1
+        accel.x[i] += p1_accel[0];
+        accel.y[i] += p1_accel[1];
+        accel.z[i] += p1_accel[2];
+
+    }
+
+    _mm256_zeroupper();
+
+}
+
+TARGET_AVX512 HOT
+static void do_processFramePP_AVX512(particle_vectors pos, acc_vectors accel,
+                                     int i0, int i1, int j0, int j1, float soft2, int physics) {
+
+    switch (physics) {
+
+    case PH_PROPER:
+        ppTileAVX512(pos, accel, i0, i1, j0, j1, soft2, PH_PROPER);
+        break;
+
+    case PH_MODIFIED:
+        ppTileAVX512(pos, accel, i0, i1, j0, j1, soft2, PH_MODIFIED);
+        break;
+
+    default:
+        ppTileAVX512(pos, accel, i0, i1, j0, j1, soft2, PH_CLASSIC);
+        break;
+
+    }
+
+}
+
+/*
+ * same as ppListSSE(), eight list particles at once
+ */
+TARGET_AVX2 KERNEL_INLINE void ppListAVX2(particle_vectors list, int n, float *pos, float *acc, float soft2, const int physics) {
+
+    __m256 p1_vpos_x = _mm256_set1_ps(pos[0]);
+    __m256 p1_vpos_y = _mm256_set1_ps(pos[1]);
+    __m256 p1_vpos_z = _mm256_set1_ps(pos[2]);
+
+    __m256 p1_vaccel_x = _mm256_setzero_ps();
+    __m256 p1_vaccel_y = _mm256_setzero_ps();
+    __m256 p1_vaccel_z = _mm256_setzero_ps();
+
+    const __m256 zero8 = _mm256_setzero_ps();
+    const __m256 vsoft2_8 = _mm256_set1_ps(soft2);
+    const __m256 two8 = _mm256_set1_ps(2.0f);
+    const __m256 half8 = _mm256_set1_ps(0.5f);
+    const __m256 threehalf8 = _mm256_set1_ps(1.5f);
+
+    float sum[3][8];
+    int j;
+
+    for (j = 0; j < n; j += 8) {
+        __m256 dv_vx, dv_vy, dv_vz;
+        __m256 vSqDist, vrcp, vforce, vmask;
+
+        dv_vx = _mm256_sub_ps(p1_vpos_x, _mm256_load_ps(list.x + j));
+        dv_vy = _mm256_sub_ps(p1_vpos_y, _mm256_load_ps(list.y + j));
+        dv_vz = _mm256_sub_ps(p1_vpos_z, _mm256_load_ps(list.z + j));
+
+        // get distance^2 between the two
+        vSqDist = _mm256_mul_ps(dv_vx, dv_vx);
+        vSqDist = _mm256_fmadd_ps(dv_vy, dv_vy, vSqDist);
+        vSqDist = _mm256_fmadd_ps(dv_vz, dv_vz, vSqDist);
+        vmask = _mm256_cmp_ps(vSqDist, zero8, _CMP_GT_OQ);
+        vSqDist = _mm256_add_ps(vSqDist, vsoft2_8);
+
+        if (physics == PH_PROPER) {
+            // 1/distance^3, from 1/distance with one newton-raphson step
+            vrcp = _mm256_rsqrt_ps(vSqDist);
+            vrcp = _mm256_mul_ps(vrcp, _mm256_fnmadd_ps(_mm256_mul_ps(half8, vSqDist), _mm256_mul_ps(vrcp, vrcp), threehalf8));
+            vrcp = _mm256_mul_ps(_mm256_mul_ps(vrcp, vrcp), vrcp);
+        } else {
+            // 1/distance^2, with one newton-raphson step
+            vrcp = _mm256_rcp_ps(vSqDist);
+            vrcp = _mm256_mul_ps(vrcp, _mm256_fnmadd_ps(vrcp, vSqDist, two8));
+        }
+
+        // m / distance^2, zero where distance^2 is zero
+        vforce = _mm256_mul_ps(_mm256_load_ps(list.mass + j), vrcp);
+        vforce = _mm256_and_ps(vforce, vmask);
+
+        p1_vaccel_x = _mm256_fmadd_ps(dv_vx, vforce, p1_vaccel_x);
+        p1_vaccel_y = _mm256_fmadd_ps(dv_vy, vforce, p1_vaccel_y);
+        p1_vaccel_z = _mm256_fmadd_ps(dv_vz, vforce, p1_vaccel_z);
+
+    }
+
+    _mm256_storeu_ps(sum[0], p1_vaccel_x);
+    _mm256_storeu_ps(sum[1], p1_vaccel_y);
+    _mm256_storeu_ps(sum[2], p1_vaccel_z);
+
+    for (j = 0; j < 8; j++) {
+        acc[0] += sum[0][j];
+        acc[1] += sum[1][j];
+        acc[2] += sum[2][j];
+    }
+
+    _mm256_zeroupper();
+
+}
+
+TARGET_AVX2 HOT
+static void do_processListPP_AVX2(particle_vectors list, int n, float *pos, float *acc, float soft2, int physics) {
+
+    if (physics == PH_PROPER)
+        ppListAVX2(list, n, pos, acc, soft2, PH_PROPER);
+    else
+        ppListAVX2(list, n, pos, acc, soft2, PH_CLASSIC);
+
+}
+
+/*
+ * same as ppListSSE(), sixteen list particles at once
+ */
+TARGET_AVX512 KERNEL_INLINE void ppListAVX512(particle_vectors list, int n, float *pos, float *acc, float soft2, const int physics) {
+
+    __m512 p1_vpos_x = _mm512_set1_ps(pos[0]);
+    __m512 p1_vpos_y = _mm512_set1_ps(pos[1]);
+    __m512 p1_vpos_z = _mm512_set1_ps(pos[2]);
+
+    __m512 p1_vaccel_x = _mm512_setzero_ps();
+    __m512 p1_vaccel_y = _mm512_setzero_ps();
+    __m512 p1_vaccel_z = _mm512_setzero_ps();
+
+    const __m512 zero16 = _mm512_setzero_ps();
+    const __m512 vsoft2_16 = _mm512_set1_ps(soft2);
+    const __m512 two16 = _mm512_set1_ps(2.0f);
+    const __m512 half16 = _mm512_set1_ps(0.5f);
+    const __m512 threehalf16 = _mm512_set1_ps(1.5f);
+
+    float sum[3][16];
+    int j;
+
+    for (j = 0; j < n; j += 16) {
+        __m512 dv_vx, dv_vy, dv_vz;
+        __m512 vSqDist, vrcp, vforce;
+        __mmask16 nonzero;
+
+        dv_vx = _mm512_sub_ps(p1_vpos_x, _mm512_load_ps(list.x + j));
+        dv_vy = _mm512_sub_ps(p1_vpos_y, _mm512_load_ps(list.y + j));
+        dv_vz = _mm512_sub_ps(p1_vpos_z, _mm512_load_ps(list.z + j));
+
+        // get distance^2 between the two
+        vSqDist = _mm512_mul_ps(dv_vx, dv_vx);
+        vSqDist = _mm512_fmadd_ps(dv_vy, dv_vy, vSqDist);
+        vSqDist = _mm512_fmadd_ps(dv_vz, dv_vz, vSqDist);
+        nonzero = _mm512_cmp_ps_mask(vSqDist, zero16, _CMP_GT_OQ);
+        vSqDist = _mm512_add_ps(vSqDist, vsoft2_16);
+
+        if (physics == PH_PROPER) {
+            // 1/distance^3, from 1/distance (14bit) with one newton-raphson step
+            vrcp = _mm512_rsqrt14_ps(vSqDist);
+            vrcp = _mm512_mul_ps(vrcp, _mm512_fnmadd_ps(_mm512_mul_ps(half16, vSqDist), _mm512_mul_ps(vrcp, vrcp), threehalf16));
+            vrcp = _mm512_mul_ps(_mm512_mul_ps(vrcp, vrcp), vrcp);
+        } else {
+            // 1/distance^2 (14bit), with one newton-raphson step
+            vrcp = _mm512_rcp14_ps(vSqDist);
+            vrcp = _mm512_mul_ps(vrcp, _mm512_fnmadd_ps(vrcp, vSqDist, two16));
+        }
+
+        // m / distance^2, zero where distance^2 is zero
+        vforce = _mm512_maskz_mul_ps(nonzero, _mm512_load_ps(list.mass + j), vrcp);
+
+        p1_vaccel_x = _mm512_fmadd_ps(dv_vx, vforce, p1_vaccel_x);
+        p1_vaccel_y = _mm512_fmadd_ps(dv_vy, vforce, p1_vaccel_y);
+        p1_vaccel_z = _mm512_fmadd_ps(dv_vz, vforce, p1_vaccel_z);
+
+    }
+
+    _mm512_storeu_ps(sum[0], p1_vaccel_x);
+    _mm512_storeu_ps(sum[1], p1_vaccel_y);
+    _mm512_storeu_ps(sum[2], p1_vaccel_z);
+
+    for (j = 0; j < 16; j++) {
+        acc[0] += sum[0][j];
+        acc[1] += sum[1][j];
+        acc[2] += sum[2][j];
+    }
+
+    _mm256_zeroupper();
+
+}
+
+TARGET_AVX512 HOT
+static void do_processListPP_AVX512(particle_vectors list, int n, float *pos, float *acc, float soft2, int physics) {
+
+    if (physics == PH_PROPER)
+        ppListAVX512(list, n, pos, acc, soft2, PH_PROPER);
+    else
+        ppListAVX512(list, n, pos, acc, soft2, PH_CLASSIC);
+
+}
+
+#endif
+
+
+/*
+ * particles i0 .. i1-1 against j0 .. j1-1 (only j < i),
+ * with the widest vector unit we have
+ */
+void processTilePP_SSE(particle_vectors pos, acc_vectors accel, int i0, int i1, int j0, int j1, float soft2, int physics) {
+
+    switch (ppSimdLevel()) {
+
+#ifdef HAVE_AVX_KERNELS
+    case SIMD_AVX512:
+        do_processFramePP_AVX512(pos, accel, i0, i1, j0, j1, soft2, physics);
+        break;
+
+    case SIMD_AVX2:
+        do_processFramePP_AVX2(pos, accel, i0, i1, j0, j1, soft2, physics);
+        break;
+#endif
+
+    default:
+        do_processFramePP_SSE(pos, accel, i0, i1, j0, j1, soft2, physics);
+        break;
+
+    }
+
+}
+
+/*
+ * interaction list kernel, with the widest vector unit we have.
+ * n has to be a multiple of 16
+ */
+void processListPP_SSE(particle_vectors list, int n, float *pos, float *acc, float soft2, int physics) {
+
+    switch (ppSimdLevel()) {
+
+#ifdef HAVE_AVX_KERNELS
+    case SIMD_AVX512:
+        do_processListPP_AVX512(list, n, pos, acc, soft2, physics);
+        break;
+
+    case SIMD_AVX2:
+        do_processListPP_AVX2(list, n, pos, acc, soft2, physics);
+        break;
+#endif
+
+    default:
+        do_processListPP_SSE(list, n, pos, acc, soft2, physics);
+        break;
+
+    }
+
+}
 
-    // clean up
-    _mm_free(pos.x);
-    _mm_free(pos.y);
-    _mm_free(pos.z);
-    _mm_free(pos.mass);
+// quadrupole list kernel, SSE only: these lists are a lot shorter
+void processListQuadPP_SSE(quad_vectors list, int n, float *pos, float *acc, float soft2, int physics) {
 
-    _mm_free(accel.x);
-    _mm_free(accel.y);
-    _mm_free(accel.z);
+    do_processListQuadPP_SSE(list, n, pos, acc, soft2, physics);
 
 }
 
@@ -28,101 +28,22 @@ Foundation, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
 #include <omp.h> // VC has to include this header to build the correct manifest to find vcom.dll or vcompd.dll
 #endif
 
-/* ************************************************************************** */
-/* How to allocate memory with 16byte alignment?                              */
-/* ************************************************************************** */
-#ifdef WIN32
-
-    // Windows: use _aligned_malloc
-    #include <stdlib.h>
-    #include <malloc.h>
-
-    #if defined(__MINGW32__) || defined(mingw32) || defined(MINGW)
-        // MinGW
-        #define MALLOC_ALIGNED(target, size, alignment) {target =  (float*) __mingw_aligned_malloc(size, alignment);}
-        #define FREE_ALIGNED(target)                    {__mingw_aligned_free(target);}
-    #else
-        // Microsoft
-        #define MALLOC_ALIGNED(target, size, alignment) {target =  (float*) _aligned_malloc(size, alignment);}
-        #define FREE_ALIGNED(target)                    {_aligned_free(target);}
-    #endif
-
-#else
-
-    // linux, unix, MacOS:  use (posix_)memalign
-    #include <stdlib.h>
-    //#include <malloc.h>
-
-    //#if defined(HAVE_MEMALIGN) && !defined(HAVE_WORKING_POSIX_MEMALIGN)
-    #if defined(HAVE_MEMALIGN)
-        #include <malloc.h>
-
-        // use memalign -- seems this is the best choice for most unix/linux versions
-        #define MALLOC_ALIGNED(target, size, alignment) {target =  (float*) memalign(alignment, size);}
-        #define FREE_ALIGNED(target)                    {free(target);}
-
-    #else
-
-        // all others use posix_memalign
-        #define MALLOC_ALIGNED(target, size, alignment) {if (posix_memalign( (void **) &(target), alignment, size) != 0) target=NULL;}
-        #define FREE_ALIGNED(target)                    {free(target);}
-
-    #endif
-
-#endif
-/* ************************************************************************** */
-
-
-
-// __restrict__ tell the compiler that two pointer will not point to the same location
-// if your compiler complains, just remove __restrict__
-
-#ifdef _MSC_VER
-#define __restrict__ __restrict
-//#define __restrict__ __declspec(restrict)
-//#define __restrict__
-#endif
-
-
-
-
-typedef struct {
-    float * __restrict__ x;
-    float * __restrict__ y;
-    float * __restrict__ z;
-    float * __restrict__ mass;
-} particle_vectors;
-
-typedef struct {
-    float * __restrict__ x;
-    float * __restrict__ y;
-    float * __restrict__ z;
-} acc_vectors;
-
-
-
-
 /*  Optimizations:
     ===============
-    * before processing, copy particle data to vector-friendly arrays
+    * particle data is kept in vector-friendly arrays (the working set, see frame.c)
+    * simple loops, so the compiler can vectorize them
     * delay multiplication with G
-    * after processing, write back results
 */
 
-
-//#define MIN_STEP2 0.05
-
-HOT
-static void do_processFramePP(particle_vectors pos, acc_vectors accel,
-                              int start, int amount) {
+/*
+ * particles i0 .. i1-1 against j0 .. j1-1 (only j < i)
+ */
+KERNEL_INLINE void ppTileVector(particle_vectors pos, acc_vectors accel,
+                                int i0, int i1, int j0, int j1, float soft2, const int physics) {
     int i;
-    //int particles_max = state.particleCount;
 
     // apply gravity to every specified velocity
-#ifdef _OPENMP
-#pragma omp parallel for schedule(dynamic, 256)
-#endif
-    for (i = start; i < amount; i++) {
+    for (i = i0; i < i1; i++) {
         //VectorNew(p1_pos);
         float p1_pos_x;
         float p1_pos_y;
@@ -136,24 +57,26 @@ static void do_processFramePP(particle_vectors pos, acc_vectors accel,
         float p1_accel_z = 0.0f;
 
         int j;
+        int jEnd;
 
         p1_pos_x = pos.x[i];
         p1_pos_y = pos.y[i];
         p1_pos_z = pos.z[i];
         p1_mass   = pos.mass[i];
 
+        jEnd = (j1 < i) ? j1 : i;
 
 #ifdef __INTEL_COMPILER
 #pragma vector always
 #pragma vector aligned
 #endif
-        for (j = 0; j < i; j++) {
+        for (j = j0; j < jEnd; j++) {
             //VectorNew(dv);
             float dv_x;
             float dv_y;
             float dv_z;
             float inverseSquareDistance;
-            float force;
+            float force, force2;
 
             dv_x = p1_pos_x - pos.x[j];
             dv_y = p1_pos_y - pos.y[j];
@@ -163,9 +86,9 @@ static void do_processFramePP(particle_vectors pos, acc_vectors accel,
             inverseSquareDistance  = dv_x * dv_x;
             inverseSquareDistance += dv_y * dv_y;
             inverseSquareDistance += dv_z * dv_z;
-            //inverseSquareDistance +=  + MIN_STEP2;
+            inverseSquareDistance += soft2;
 
-            force = p1_mass * pos.mass[j] / inverseSquareDistance;
+            ppPairForce(p1_mass, pos.mass[j], inverseSquareDistance, physics, &force, &force2);
 
             // sum of accelerations for p1
             p1_accel_x += dv_x * force;
@@ -173,9 +96,9 @@ static void do_processFramePP(particle_vectors pos, acc_vectors accel,
             p1_accel_z += dv_z * force;
 
             // add acceleration for p2 (with negative sign, as the direction is inverted)
-            accel.x[j] -= dv_x * force;
-            accel.y[j] -= dv_y * force;
-            accel.z[j] -= dv_z * force;
+            accel.x[j] -= dv_x * force2;
+            accel.y[j] -= dv_y * force2;
+            accel.z[j] -= dv_z * force2;
 
         }
 
@@ -188,66 +111,24 @@ static void do_processFramePP(particle_vectors pos, acc_vectors accel,
 
 }
 
+HOT
+void processTilePP_Vector(particle_vectors pos, acc_vectors accel,
+                          int i0, int i1, int j0, int j1, float soft2, int physics) {
 
+    switch (physics) {
 
-void processFramePP(int start, int amount) {
-    particle_vectors pos;
-    acc_vectors accel;
-    particle_t * __restrict__ framebase = state.particleHistory + state.particleCount*state.frame;
-    particleDetail_t * __restrict__ framedetail = state.particleDetail;
-
-    int i;
-    int particles_max;
-    particles_max = state.particleCount;
-
-
-    // create arrays, aligned to 64 bytes (cache line size)
-
-    MALLOC_ALIGNED( pos.x, sizeof(float)*(particles_max + 64), 64);
-    MALLOC_ALIGNED( pos.y, sizeof(float)*(particles_max + 64), 64);
-    MALLOC_ALIGNED( pos.z, sizeof(float)*(particles_max + 64), 64);
-    MALLOC_ALIGNED( pos.mass, sizeof(float)*(particles_max + 64), 64);
-    //memset(pos.x, 0, sizeof(float) * (particles_max + 64));
-    //memset(pos.y, 0, sizeof(float) * (particles_max + 64));
-    //memset(pos.z, 0, sizeof(float) * (particles_max + 64));
-    //memset(pos.mass, 0, sizeof(float) * (particles_max + 64));
-    MALLOC_ALIGNED( accel.x, sizeof(float)*(particles_max + 64), 64);
-    MALLOC_ALIGNED( accel.y, sizeof(float)*(particles_max + 64), 64);
-    MALLOC_ALIGNED( accel.z, sizeof(float)*(particles_max + 64), 64);
-    memset(accel.x, 0, sizeof(float) * (particles_max + 64));
-    memset(accel.y, 0, sizeof(float) * (particles_max + 64));
-    memset(accel.z, 0, sizeof(float) * (particles_max + 64));
-
-
-    // copy frame data to vector-friendly arrays
-    for (i=0; i<particles_max; i++) {
-        pos.x[i] = framebase[i].pos[0];
-        pos.y[i] = framebase[i].pos[1];
-        pos.z[i] = framebase[i].pos[2];
-        pos.mass[i] = state.particleDetail[i].mass;
-    }
+    case PH_PROPER:
+        ppTileVector(pos, accel, i0, i1, j0, j1, soft2, PH_PROPER);
+        break;
 
+    case PH_MODIFIED:
+        ppTileVector(pos, accel, i0, i1, j0, j1, soft2, PH_MODIFIED);
+        break;
 
-    // calculate new accelerations
-    do_processFramePP(pos, accel, start, amount);
+    default:
+        ppTileVector(pos, accel, i0, i1, j0, j1, soft2, PH_CLASSIC);
+        break;
 
-
-    // write back results
-    for (i=0; i<particles_max; i++) {
-        framedetail[i].accel[0] += accel.x[i] * state.g;
-        framedetail[i].accel[1] += accel.y[i] * state.g;
-        framedetail[i].accel[2] += accel.z[i] * state.g;
     }
 
-
-    // clean up
-    FREE_ALIGNED(pos.x);
-    FREE_ALIGNED(pos.y);
-    FREE_ALIGNED(pos.z);
-    FREE_ALIGNED(pos.mass);
-
-    FREE_ALIGNED(accel.x);
-    FREE_ALIGNED(accel.y);
-    FREE_ALIGNED(accel.z);
-
 }
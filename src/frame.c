@@ -36,276 +36,1898 @@ Foundation, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
 #endif
 
 
+char *solverNames[SOLVER_LAST] = { "auto", "pp", "sse", "vector", "ot", "fmm" };
+char *integratorNames[INTEGRATOR_LAST] = { "leapfrog", "yoshida", "hermite" };
+char *physicsNames[PH_LAST] = { "classic", "modified", "proper" };
+
+workingSet_t workingSet;
+diagnostics_t diagnostics;
+
+// solver used for the frame that is being processed
+static int solverActive = SOLVER_PP;
+static ppTile_t ppTileActive = processTilePP;
+// integrator used for the frame that is being processed
+static int integratorActive = INTEGRATOR_LEAPFROG;
+static int physicsActive = PH_CLASSIC;
+static float soft2Active = 0;
+static int mixedActive = 0;
+
+
+/*  Work sharing:
+    =============
+    The work of a frame (particles, or tiles for PP) is split into one slice
+    per thread. A thread takes small chunks from its own slice first, and
+    when that is empty, it steals chunks from the slices of the other
+    threads. So no thread waits for the others if its part was cheaper
+    (the triangular PP loop, dense regions of the tree, ...).
+*/
+
+typedef struct {
+    int next;           // next item to hand out, grows past end when empty
+    int end;
+    char pad[56];       // one cache line per thread
+} workSlice_t;
+
+static workSlice_t workSlices[MAX_THREADS];
+static int workThreads = 1;
+
+void workInit(int items, int threads) {
+
+    int i;
+
+    workThreads = threads;
+
+    for (i = 0; i < threads; i++) {
+        workSlices[i].next = (int)((long long)items * i / threads);
+        workSlices[i].end = (int)((long long)items * (i + 1) / threads);
+    }
+
+}
+
+/*
+ * get the next chunk of work for this thread: items start .. end-1.
+ * returns 0 when there is nothing left
+ */
+int workNext(int thread, int chunk, int *start, int *end) {
+
+    int k;
+
+    for (k = 0; k < workThreads; k++) {
+
+        workSlice_t *w = workSlices + (thread + k) % workThreads;
+        int i;
+
+        i = atomicFetchAdd(&w->next, chunk);
+
+        if (i < w->end) {
+            *start = i;
+            *end = (i + chunk < w->end) ? i + chunk : w->end;
+            return 1;
+        }
+
+    }
+
+    return 0;
+
+}
+
+
+#if (!defined(WIN32) || defined(USE_PTHREAD)) && !defined(_OPENMP)
+
+/*  Thread pool:
+    ============
+    The worker threads are started once and sleep between the jobs.
+    poolRun() wakes all of them up, the calling thread works as thread 0,
+    and returns when every thread has finished the job.
+*/
+
+static pthread_t poolThreads[MAX_THREADS];
+static pthread_t poolOwner;
+static pthread_mutex_t poolMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poolWake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t poolDone = PTHREAD_COND_INITIALIZER;
+static int poolSize = 0;            // threads, including the calling thread
+static int poolGeneration = 0;      // counts the jobs
+static int poolStartGeneration = 0; // poolGeneration when the workers were started
+static int poolBusy = 0;            // workers still working on the current job
+static int poolQuit = 0;
+static void (*poolJob)(int thread) = NULL;
+
+static void *poolWorker(void *arg) {
+
+    int thread = (int)(size_t)arg;
+    int generation;
+
+    // not poolGeneration, poolRun() might already have been called
+    generation = poolStartGeneration;
+
+    pthread_mutex_lock(&poolMutex);
+
+    for (;;) {
+
+        while (generation == poolGeneration && !poolQuit)
+            pthread_cond_wait(&poolWake, &poolMutex);
+
+        if (poolQuit)
+            break;
+
+        generation = poolGeneration;
+        pthread_mutex_unlock(&poolMutex);
+
+        poolJob(thread);
+
+        pthread_mutex_lock(&poolMutex);
+        if (--poolBusy == 0)
+            pthread_cond_signal(&poolDone);
+
+    }
+
+    pthread_mutex_unlock(&poolMutex);
+    return NULL;
+
+}
+
+void poolStop() {
+
+    int i;
+
+    if (poolSize <= 1) {
+        poolSize = 0;
+        return;
+    }
+
+    pthread_mutex_lock(&poolMutex);
+    poolQuit = 1;
+    pthread_cond_broadcast(&poolWake);
+    pthread_mutex_unlock(&poolMutex);
+
+    for (i = 1; i < poolSize; i++)
+        pthread_join(poolThreads[i], NULL);
+
+    poolQuit = 0;
+    poolSize = 0;
+
+}
+
+/*
+ * (re-)start the pool with this many threads. returns the number of threads
+ */
+int poolStart(int threads) {
+
+    int i;
+
+    if (threads < 1)
+        threads = 1;
+    if (threads > MAX_THREADS)
+        threads = MAX_THREADS;
+
+    if (threads == poolSize)
+        return poolSize;
+
+    poolStop();
+
+    poolOwner = pthread_self();
+    poolStartGeneration = poolGeneration;
+    poolSize = 1;
+
+    for (i = 1; i < threads; i++) {
+
+        if (pthread_create(&poolThreads[i], NULL, poolWorker, (void *)(size_t)i)) {
+            conAdd(LERR, "Could not start thread %i", i);
+            break;
+        }
+
+        poolSize++;
+
+    }
+
+    return poolSize;
+
+}
+
+void poolRun(void (*job)(int thread)) {
+
+    if (poolSize <= 1) {
+        job(0);
+        return;
+    }
+
+    pthread_mutex_lock(&poolMutex);
+    poolJob = job;
+    poolBusy = poolSize - 1;
+    poolGeneration++;
+    pthread_cond_broadcast(&poolWake);
+    pthread_mutex_unlock(&poolMutex);
+
+    job(0);
+
+    pthread_mutex_lock(&poolMutex);
+    while (poolBusy)
+        pthread_cond_wait(&poolDone, &poolMutex);
+    pthread_mutex_unlock(&poolMutex);
+
+}
+
+// only the thread that runs the pool may draw
+int poolMainThread() {
+
+    return !poolSize || pthread_equal(pthread_self(), poolOwner);
+
+}
+
+#else
+
+// OpenMP manages its own threads, and without threads there is nothing to do
+
+void poolStop() {
+}
+
+int poolStart(int threads) {
+
+#ifdef _OPENMP
+    omp_set_num_threads(threads);
+    return threads;
+#else
+    return 1;
+#endif
+
+}
+
+void poolRun(void (*job)(int thread)) {
+
+    job(0);
+
+}
+
+int poolMainThread() {
+
+    return 1;
+
+}
+
+#endif
+
 int initFrame() {
 
-    state.frame = 0;
-    state.frameCompression = 1;
-    state.totalFrames = 0;
-    state.historyNFrame = 1;
-    state.currentFrame = 0;
-    state.targetFrame = -1;
-    view.quit = 0;
+    state.frame = 0;
+    state.frameCompression = 1;
+    state.totalFrames = 0;
+    state.lastSave = 0;
+    state.historyNFrame = 1;
+    state.currentFrame = 0;
+    state.targetFrame = -1;
+    view.quit = 0;
+
+    cleanMemory();
+
+//	conAdd(LERR, "Allocating %u bytes", FRAMESIZE * state.historyFrames);
+    while (!historyAlloc()) {
+
+        conAdd(LLOW, "Could not allocate %lu bytes of memory for %ld frames of particleHistory", (unsigned long)(FRAMESIZE * state.historyFrames), state.historyFrames);
+        if (state.historyFrames < 10) {
+            conAdd(LERR, "Could not allocate for particleHistory - giving up.");
+            //return 0;
+            cmdQuit(NULL);
+        }
+        // reduce requested size by 10%, and try again
+        state.historyFrames = (state.historyFrames / 10) * 9;
+    }
+
+//	conAdd(LERR, "Allocating %u bytes", FRAMEDETAILSIZE);
+    state.particleDetail = calloc(sizeof(particleDetail_t),state.particleCount);
+    if (!state.particleDetail) {
+
+        conAdd(LERR, "Could not allocate %lu bytes of memory for particleDetail", (unsigned long)(FRAMEDETAILSIZE));
+        historyFree();
+        state.memoryAllocated = 0;
+        //return 0;
+        cmdQuit(NULL);
+
+    }
+
+    // particleMerged, particleMergedFrame and particleMass
+    state.particleMerged = malloc((sizeof(int) * 2 + sizeof(float)) * state.particleCount);
+    if (!state.particleMerged) {
+
+        conAdd(LERR, "Could not allocate %lu bytes of memory for particleMerged", (unsigned long)((sizeof(int) * 2 + sizeof(float)) * state.particleCount));
+        free(state.particleDetail);
+        state.particleDetail = 0;
+        historyFree();
+        state.memoryAllocated = 0;
+        cmdQuit(NULL);
+        return 0;
+
+    }
+
+    state.particleMergedFrame = state.particleMerged + state.particleCount;
+    state.particleMass = (float *)(state.particleMergedFrame + state.particleCount);
+
+    // nobody was merged yet
+    memset(state.particleMerged, -1, sizeof(int) * state.particleCount);
+    memset(state.particleMergedFrame, 0, sizeof(int) * state.particleCount);
+    state.particlesMerged = 0;
+
+    if (!historyOnDisk())
+        state.memoryAllocated += historySize();
+    state.memoryAllocated += FRAMEDETAILSIZE + (sizeof(int) * 2 + sizeof(float)) * state.particleCount;
+
+    memset(state.particleHistory, 0, FRAMESIZE);
+
+    view.timed_frames=0;
+    view.totalRenderTime=0;
+    view.lastRenderTime = 0;
+
+    fpsInit();
+
+    VectorZero(view.lastCenter);
+
+    state.have_old_accel = 0;
+    diagnosticsReset();
+
+    return 1;
+
+}
+
+/*  Working set:
+    ============
+    The frame that is being simulated is not kept in particleHistory
+    (particle_t, array of structs), but in workingSet: one aligned array
+    per component, which the solvers read directly and the integrator
+    updates in place. No per frame allocations and no copying between the
+    two layouts - a frame is only copied to particleHistory when it is kept
+    (with frame compression, only every historyNFrame-th step is kept).
+    The working set is loaded from particleHistory[state.frame] when a
+    simulation starts (initFrame(), load), or after an aborted frame.
+    With "mixedprecision", its positions are relative to workingSet.origin
+    (see wsOrigin()), and wsStore() adds the origin back in double.
+*/
+
+// one array, rounded up to full 64 byte cache lines
+#define WS_STRIDE(n) ((((n) + 64) + 15) & ~15)
+
+void wsFreeMemory() {
+
+    FREE_ALIGNED(workingSet.block);
+    FREE_ALIGNED(workingSet.hermiteBlock);
+    memset(&workingSet, 0, sizeof(workingSet));
+
+}
+
+/*
+ * mixed precision: the centre of the bounding box of the last recorded
+ * frame (the centre of the root node of the octree), worked out in double.
+ * The working set keeps its positions relative to it, so float is only
+ * needed for the size of the galaxy, not for its distance from 0,0,0.
+ * Otherwise 0,0,0, and the positions are copied as they are.
+ */
+static void wsOrigin(double *origin) {
+
+    particle_t *p;
+    double lo[3], hi[3];
+    int i, k;
+
+    origin[0] = origin[1] = origin[2] = 0;
+
+    if (!state.mixedPrecision || !state.particleCount)
+        return;
+
+    p = historyParticle(state.frame, 0);
+    for (k = 0; k < 3; k++)
+        lo[k] = hi[k] = p->pos[k];
+
+    for (i = 1; i < state.particleCount; i++) {
+        p = historyParticle(state.frame, i);
+        for (k = 0; k < 3; k++) {
+            if (p->pos[k] < lo[k]) lo[k] = p->pos[k];
+            if (p->pos[k] > hi[k]) hi[k] = p->pos[k];
+        }
+    }
+
+    for (k = 0; k < 3; k++)
+        origin[k] = (lo[k] + hi[k]) * 0.5;
+
+}
+
+/*
+ * load the working set from the last recorded frame.
+ * returns 0 if the memory could not be allocated
+ */
+int wsLoad() {
+
+    particle_t *p;
+    float *mass;
+    int stride;
+    int i, n;
+
+    stride = WS_STRIDE(state.particleCount);
+
+    if (workingSet.size < state.particleCount || !workingSet.block) {
+
+        wsFreeMemory();
+
+        // ten float arrays, activeIndex, index, level and active
+        MALLOC_ALIGNED(workingSet.block, (sizeof(float) * 10 + sizeof(int) * 2 + 2) * stride, 64);
+
+        if (!workingSet.block) {
+            conAdd(LERR, "Could not allocate %lu bytes of memory for the working set", (unsigned long)((sizeof(float) * 10 + sizeof(int) * 2 + 2) * stride));
+            return 0;
+        }
+
+        workingSet.size = state.particleCount;
+        workingSet.x    = workingSet.block;
+        workingSet.y    = workingSet.block + stride;
+        workingSet.z    = workingSet.block + stride * 2;
+        workingSet.vx   = workingSet.block + stride * 3;
+        workingSet.vy   = workingSet.block + stride * 4;
+        workingSet.vz   = workingSet.block + stride * 5;
+        workingSet.ax   = workingSet.block + stride * 6;
+        workingSet.ay   = workingSet.block + stride * 7;
+        workingSet.az   = workingSet.block + stride * 8;
+        workingSet.mass = workingSet.block + stride * 9;
+        workingSet.activeIndex = (int *)(workingSet.block + stride * 10);
+        workingSet.index = workingSet.activeIndex + stride;
+        workingSet.level = (unsigned char *)(workingSet.index + stride);
+        workingSet.active = workingSet.level + stride;
+
+        // the SIMD kernels may read a bit past the last particle
+        memset(workingSet.block, 0, sizeof(float) * stride * 10);
+
+    }
+
+    wsOrigin(workingSet.origin);
+
+    // merges that did not make it into a kept frame are undone, the
+    // particles are simulated again from state.frame
+    for (i = 0; i < state.particleCount; i++) {
+        if (state.particleMerged[i] >= 0 && state.particleMergedFrame[i] > state.frame) {
+            state.particleMerged[i] = -1;
+            state.particleMergedFrame[i] = 0;
+            state.particlesMerged--;
+        }
+    }
+
+    mass = particleMasses(state.frame);
+
+    // merged particles are left out
+    n = 0;
+    for (i = 0; i < state.particleCount; i++) {
+        if (state.particleMerged[i] >= 0)
+            continue;
+        p = historyParticle(state.frame, i);
+        workingSet.x[n]    = (float)(p->pos[0] - workingSet.origin[0]);
+        workingSet.y[n]    = (float)(p->pos[1] - workingSet.origin[1]);
+        workingSet.z[n]    = (float)(p->pos[2] - workingSet.origin[2]);
+        workingSet.vx[n]   = p->vel[0];
+        workingSet.vy[n]   = p->vel[1];
+        workingSet.vz[n]   = p->vel[2];
+        workingSet.mass[n] = mass[i];
+        workingSet.index[n] = i;
+        n++;
+    }
+
+    workingSet.count = n;
+    workingSet.valid = 1;
+    workingSet.activeCount = n;
+
+    // accelerations have to be computed again
+    state.have_old_accel = 0;
+    workingSet.jerk = 0;
+
+    return 1;
+
+}
+
+/*
+ * allocate the arrays of the hermite integrator, if not done yet.
+ * returns 0 if the memory could not be allocated
+ */
+static int wsAllocHermite() {
+
+    int stride;
+    int k;
+
+    if (workingSet.hermiteBlock)
+        return 1;
+
+    stride = WS_STRIDE(workingSet.size);
+
+    // jerk, and the start of the step
+    MALLOC_ALIGNED(workingSet.hermiteBlock, sizeof(float) * 15 * stride, 64);
+
+    if (!workingSet.hermiteBlock) {
+        conAdd(LERR, "Could not allocate %lu bytes of memory for the hermite integrator", (unsigned long)(sizeof(float) * 15 * stride));
+        return 0;
+    }
+
+    memset(workingSet.hermiteBlock, 0, sizeof(float) * 15 * stride);
+
+    workingSet.jx = workingSet.hermiteBlock;
+    workingSet.jy = workingSet.hermiteBlock + stride;
+    workingSet.jz = workingSet.hermiteBlock + stride * 2;
+    for (k = 0; k < 12; k++)
+        workingSet.start[k] = workingSet.hermiteBlock + stride * (3 + k);
+
+    workingSet.jerk = 0;
+
+    return 1;
+
+}
+
+/*
+ * copy the working set to particleHistory[frame]. Merged particles ride
+ * along with the particle they were merged into.
+ */
+void wsStore(int frame) {
+
+    particle_t *p;
+    int i, j;
+
+    p = historyWriteFrame(frame);
+
+    for (i = 0; i < workingSet.count; i++) {
+        j = workingSet.index[i];
+        p[j].pos[0] = (float)(workingSet.origin[0] + workingSet.x[i]);
+        p[j].pos[1] = (float)(workingSet.origin[1] + workingSet.y[i]);
+        p[j].pos[2] = (float)(workingSet.origin[2] + workingSet.z[i]);
+        p[j].vel[0] = workingSet.vx[i];
+        p[j].vel[1] = workingSet.vy[i];
+        p[j].vel[2] = workingSet.vz[i];
+    }
+
+    if (state.particlesMerged) {
+        for (i = 0; i < state.particleCount; i++) {
+            // follow the chain, the particle it was merged into may have been merged too
+            for (j = i; state.particleMerged[j] >= 0; j = state.particleMerged[j])
+                ;
+            if (j != i)
+                p[i] = p[j];
+        }
+    }
+
+    historyCommitFrame(frame);
+
+}
+
+/*
+ * the masses of all particles in frame, in state.particleMass: the mass
+ * of particleDetail, plus the masses that were merged into it up to
+ * this frame, and 0 once it was merged into another one
+ */
+float *particleMasses(int frame) {
+
+    float *mass = state.particleMass;
+    int i, j;
+
+    for (i = 0; i < state.particleCount; i++)
+        mass[i] = state.particleDetail[i].mass;
+
+    if (!state.particlesMerged)
+        return mass;
+
+    for (i = 0; i < state.particleCount; i++) {
+
+        // up the chain as far as it was merged in this frame. particles
+        // are only merged into ones that were not merged yet, so the
+        // frames of a chain never get smaller
+        for (j = i; state.particleMerged[j] >= 0 && state.particleMergedFrame[j] <= frame; j = state.particleMerged[j])
+            ;
+
+        if (j != i) {
+            mass[j] += state.particleDetail[i].mass;
+            mass[i] -= state.particleDetail[i].mass;
+        }
+
+    }
+
+    return mass;
+
+}
+
+/*
+ * the solver that will be used for the next frame. resolves "auto",
+ * and falls back to scalar code if SSE was not compiled in
+ */
+int getSolver() {
+
+    switch (state.solver) {
+
+    case SOLVER_PP:
+    case SOLVER_PP_VECTOR:
+    case SOLVER_OT:
+    case SOLVER_FMM:
+        return state.solver;
+
+    case SOLVER_PP_SSE:
+#ifdef HAVE_SSE
+        return SOLVER_PP_SSE;
+#else
+        return SOLVER_PP_VECTOR;
+#endif
+
+    case SOLVER_AUTO:
+    default:
+        if (state.particleCount >= SOLVER_AUTO_OT_PARTICLES)
+            return SOLVER_OT;
+#ifdef HAVE_SSE
+        return SOLVER_PP_SSE;
+#else
+        return SOLVER_PP_VECTOR;
+#endif
+
+    }
+
+}
+
+/*
+ * the integrator that will be used for the next frame. hermite needs the
+ * jerk, which only the brute force kernels compute, so it falls back to
+ * leapfrog with the tree solvers
+ */
+int getIntegrator() {
+
+    int solver;
+
+    if (state.integrator < 0 || state.integrator >= INTEGRATOR_LAST)
+        return INTEGRATOR_LEAPFROG;
+
+    if (state.integrator == INTEGRATOR_HERMITE) {
+        solver = getSolver();
+        if (solver == SOLVER_OT || solver == SOLVER_FMM)
+            return INTEGRATOR_LEAPFROG;
+    }
+
+    return state.integrator;
+
+}
+
+void processFrameThread(int thread) {
+
+    if (solverActive == SOLVER_FMM) {
+        processFrameFMM(thread);
+        return;
+    }
+
+    if (solverActive != SOLVER_OT) {
+        if (integratorActive == INTEGRATOR_HERMITE)
+            processFrameJerkPP(thread);
+        else
+            processFramePP(thread, ppTileActive);
+        return;
+    }
+
+    processFrameOT(thread);
+
+}
+
+// brute force for the active particles only, see moveParticlesBlock()
+static void processActiveThread(int thread) {
+
+    // the same forces as the tiles of the solver
+    processActivePP(thread, soft2Active, physicsActive, mixedActive);
+
+}
+
+// add up the accelerations of the PP threads
+static void reduceFrameThread(int thread) {
+
+#ifdef _OPENMP
+    ppReduce(0, workingSet.count);
+#else
+    int start, end;
+
+    while (workNext(thread, 4096, &start, &end))
+        ppReduce(start, end);
+#endif
+
+}
+
+/*  Diagnostics:
+    ============
+    With "diagnostics" set to n, the energy and momentum of the system are
+    worked out every n frames, to see how far the integration drifts:
+        momentum    sum of w v
+        kinetic     sum of w v^2 / 2
+        potential   -g / 2 * sum of m phi, phi = sum of m_j F(r_ij)
+        virial      sum of w r . a, the virial ratio is 2 kinetic / |virial|
+    w is the mass that resists a force, 1 for CLASSIC (a = g m1 m2 / r)
+    and m otherwise. F is the same potential the solvers use (ln(r) or
+    -1/r, softened). These are the conserved quantities of all modes.
+    The potentials come from the octree: the groups and interaction lists
+    of the ot solver (with the current theta and quadrupoles), but with
+    potential kernels. The tree of the last force pass is used if there is
+    one. The sums are split up between the threads like the forces.
+    The virial uses the accelerations of the last force pass, for hermite
+    those of the predicted positions.
+*/
+
+typedef struct diagSum_s {
+
+    double momentum[3];
+    double kinetic;
+    double potential;
+    double virial;
+
+} diagSum_t;
+
+static float *diagPhi = NULL;
+static int diagPhiSize = 0;
+static diagSum_t diagSums[MAX_THREADS];
+static FILE *diagLog = NULL;
+
+// forget the energy of the first diagnostics, for a new simulation
+void diagnosticsReset() {
+
+    memset(&diagnostics, 0, sizeof(diagnostics));
+
+}
+
+/*
+ * write the diagnostics to a csv file from now on, fileName NULL: stop.
+ * returns 0 if the file could not be opened
+ */
+int diagnosticsLog(char *fileName) {
+
+    if (diagLog)
+        fclose(diagLog);
+    diagLog = NULL;
+
+    if (!fileName)
+        return 1;
+
+    diagLog = fopen(fileName, "w");
+    if (!diagLog)
+        return 0;
+
+    fprintf(diagLog, "frame,kinetic,potential,energy,drift,momentum_x,momentum_y,momentum_z,virial_ratio\n");
+    fflush(diagLog);
+
+    return 1;
+
+}
+
+static void diagnosticsPotentialThread(int thread) {
+
+    processPotentialOT(thread, diagPhi);
+
+}
+
+static void diagnosticsAdd(int i, diagSum_t *sum) {
+
+    float w = state.physics == PH_CLASSIC ? 1 : workingSet.mass[i];
+    float v2;
+
+    v2 = workingSet.vx[i] * workingSet.vx[i] + workingSet.vy[i] * workingSet.vy[i] + workingSet.vz[i] * workingSet.vz[i];
+
+    sum->momentum[0] += w * workingSet.vx[i];
+    sum->momentum[1] += w * workingSet.vy[i];
+    sum->momentum[2] += w * workingSet.vz[i];
+    sum->kinetic += 0.5 * w * v2;
+    sum->potential += workingSet.mass[i] * (double)diagPhi[i];
+    sum->virial += w * (workingSet.x[i] * workingSet.ax[i] + workingSet.y[i] * workingSet.ay[i] + workingSet.z[i] * workingSet.az[i]);
+
+}
+
+// with OpenMP, this is called once and spawns the threads itself
+static void diagnosticsSumThread(int thread) {
+
+    int i;
+#ifdef _OPENMP
+    #pragma omp parallel private(i)
+    {
+        int me = omp_get_thread_num();
+
+        #pragma omp for schedule(static)
+        for (i = 0; i < workingSet.count; i++)
+            diagnosticsAdd(i, diagSums + me);
+    }
+#else
+    int start, end;
+
+    while (workNext(thread, 4096, &start, &end))
+        for (i = start; i < end; i++)
+            diagnosticsAdd(i, diagSums + thread);
+#endif
+
+}
+
+/*
+ * energy, momentum and virial ratio of the working set, see above
+ */
+static void processDiagnostics() {
+
+    diagSum_t sum;
+    double energy;
+    int threads;
+    int built = 0;
+    int groups;
+    int t, k;
+
+    if (diagPhiSize < workingSet.count) {
+
+        free(diagPhi);
+        diagPhiSize = workingSet.count;
+        diagPhi = malloc(sizeof(float) * diagPhiSize);
+
+        if (!diagPhi) {
+            conAdd(LERR, "Could not allocate %lu bytes of memory for the diagnostics", (unsigned long)(sizeof(float) * diagPhiSize));
+            diagPhiSize = 0;
+            state.diagnostics = 0;
+            return;
+        }
+
+    }
+
+    threads = poolStart(state.processFrameThreads);
+
+    // the brute force solvers do not keep a tree
+    if (!otGetRoot()) {
+        otBuildTree();
+        built = 1;
+    }
+
+    groups = otPrepareGroups();
+    if (!groups) {
+        if (built)
+            otFreeTree();
+        return;
+    }
+
+    memset(diagPhi, 0, sizeof(float) * workingSet.count);
+    workInit(groups, threads);
+    poolRun(diagnosticsPotentialThread);
+
+    if (built)
+        otFreeTree();
+
+    memset(diagSums, 0, sizeof(diagSums));
+    workInit(workingSet.count, threads);
+    poolRun(diagnosticsSumThread);
+
+    memset(&sum, 0, sizeof(sum));
+    for (t = 0; t < MAX_THREADS; t++) {
+        for (k = 0; k < 3; k++)
+            sum.momentum[k] += diagSums[t].momentum[k];
+        sum.kinetic += diagSums[t].kinetic;
+        sum.potential += diagSums[t].potential;
+        sum.virial += diagSums[t].virial;
+    }
+
+    diagnostics.frame = state.totalFrames;
+    for (k = 0; k < 3; k++)
+        diagnostics.momentum[k] = sum.momentum[k];
+    diagnostics.kinetic = sum.kinetic;
+    diagnostics.potential = -0.5 * state.g * sum.potential;
+    diagnostics.virialRatio = sum.virial ? 2 * sum.kinetic / fabs(sum.virial) : 0;
+
+    energy = diagnostics.kinetic + diagnostics.potential;
+    if (!diagnostics.haveEnergy0) {
+        diagnostics.energy0 = energy;
+        diagnostics.haveEnergy0 = 1;
+    }
+    diagnostics.drift = diagnostics.energy0 ? (energy - diagnostics.energy0) / fabs(diagnostics.energy0) : 0;
+
+    if (diagLog) {
+        fprintf(diagLog, "%i,%.10g,%.10g,%.10g,%.6g,%.10g,%.10g,%.10g,%.6g\n", diagnostics.frame,
+                diagnostics.kinetic, diagnostics.potential, energy, diagnostics.drift,
+                diagnostics.momentum[0], diagnostics.momentum[1], diagnostics.momentum[2], diagnostics.virialRatio);
+        fflush(diagLog);
+    }
+
+}
+
+
+/*  Collisions:
+    ===========
+    With "collisionradius" set, particles that come closer than that merge
+    at the end of each simulated frame. The new particle has both masses,
+    and the position and velocity of their centre of mass (weighted with w,
+    see Diagnostics), so momentum is kept.
+    Close pairs are found with a spatial hash: the space is cut into cubes
+    of collisionradius, the cubes are hashed into colBuckets buckets, and
+    the particles are counting-sorted by bucket. A particle only has to look
+    at the buckets of its own cube and the 26 around it. Hashing and the
+    search are split up between the threads, the search collects pairs per
+    thread. The pairs are merged in order (so the result does not depend on
+    the threads), a group of touching particles ends up as one particle.
+    Merged particles are taken out of the working set, so the solvers no
+    longer see them and the following frames get cheaper. In particleHistory
+    they ride along with the particle they were merged into, and
+    state.particleMerged remembers where they went. particleMergedFrame
+    keeps the first frame that shows the merge (the next kept frame), so it
+    is halved with the frames by historyCompress().
+    particleDetail keeps the masses the particles started with, for every
+    frame. particleMasses() adds them up for one frame, so played back
+    frames from before a merge show the masses as they were then, and a
+    save keeps the initial conditions.
+*/
+
+typedef struct colPair_s {
+
+    int i, j;   // working set entries, i < j
+
+} colPair_t;
+
+static int colSize = 0;             // entries allocated in the arrays below
+static unsigned int *colCell = NULL; // bucket of each working set entry
+static int *colOrder = NULL;        // working set entries, sorted by bucket
+static int *colParent = NULL;       // merging: the entry this one went to
+static int *colStart = NULL;        // first colOrder entry of each bucket, colBuckets + 1
+static unsigned int colBuckets = 0; // power of 2
+static float colInverse = 1;        // 1 / collisionradius
+static float colRadius2 = 0;
+
+static colPair_t *colPairs[MAX_THREADS];
+static int colPairCount[MAX_THREADS];
+static int colPairSize[MAX_THREADS];
+
+void colFreeMemory() {
+
+    int t;
+
+    free(colCell);
+    free(colOrder);
+    free(colParent);
+    free(colStart);
+    colCell = NULL;
+    colOrder = NULL;
+    colParent = NULL;
+    colStart = NULL;
+    colSize = 0;
+    colBuckets = 0;
+
+    for (t = 0; t < MAX_THREADS; t++) {
+        free(colPairs[t]);
+        colPairs[t] = NULL;
+        colPairCount[t] = 0;
+        colPairSize[t] = 0;
+    }
+
+}
+
+// cube of a coordinate. Clamped, so particles far out can not overflow
+static int colCube(float x) {
+
+    x = (float)floor(x * colInverse);
+
+    if (x > 1e9f)
+        return 1000000000;
+    if (x < -1e9f)
+        return -1000000000;
+
+    return (int)x;
+
+}
+
+static unsigned int colHash(int cx, int cy, int cz) {
+
+    return ((unsigned int)cx * 73856093u ^ (unsigned int)cy * 19349663u ^ (unsigned int)cz * 83492791u) & (colBuckets - 1);
+
+}
+
+static void colHashThread(int thread) {
+
+    int i;
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static)
+    for (i = 0; i < workingSet.count; i++)
+        colCell[i] = colHash(colCube(workingSet.x[i]), colCube(workingSet.y[i]), colCube(workingSet.z[i]));
+#else
+    int start, end;
+
+    while (workNext(thread, 4096, &start, &end))
+        for (i = start; i < end; i++)
+            colCell[i] = colHash(colCube(workingSet.x[i]), colCube(workingSet.y[i]), colCube(workingSet.z[i]));
+#endif
+
+}
+
+static void colAddPair(int thread, int i, int j) {
+
+    colPair_t *p;
+
+    if (colPairCount[thread] >= colPairSize[thread]) {
+
+        p = realloc(colPairs[thread], sizeof(colPair_t) * (colPairSize[thread] * 2 + 256));
+        if (!p)
+            return;     // this pair merges next frame
+
+        colPairs[thread] = p;
+        colPairSize[thread] = colPairSize[thread] * 2 + 256;
+
+    }
+
+    colPairs[thread][colPairCount[thread]].i = i;
+    colPairs[thread][colPairCount[thread]].j = j;
+    colPairCount[thread]++;
+
+}
+
+// pairs of entry i with the entries after it, in the 27 cubes around it
+static void colFindPairs(int thread, int i) {
+
+    unsigned int seen[27];
+    int seenCount = 0;
+    int cx, cy, cz;
+    int dx, dy, dz;
+    int k, s;
+
+    cx = colCube(workingSet.x[i]);
+    cy = colCube(workingSet.y[i]);
+    cz = colCube(workingSet.z[i]);
+
+    for (dx = -1; dx <= 1; dx++)
+    for (dy = -1; dy <= 1; dy++)
+    for (dz = -1; dz <= 1; dz++) {
+
+        unsigned int b = colHash(cx + dx, cy + dy, cz + dz);
+
+        // two cubes may share a bucket
+        for (s = 0; s < seenCount; s++)
+            if (seen[s] == b)
+                break;
+        if (s < seenCount)
+            continue;
+        seen[seenCount++] = b;
+
+        for (k = colStart[b]; k < colStart[b + 1]; k++) {
+
+            int j = colOrder[k];
+            VectorNew(d);
+
+            if (j <= i)
+                continue;
+
+            d[0] = workingSet.x[i] - workingSet.x[j];
+            d[1] = workingSet.y[i] - workingSet.y[j];
+            d[2] = workingSet.z[i] - workingSet.z[j];
+
+            if (d[0] * d[0] + d[1] * d[1] + d[2] * d[2] < colRadius2)
+                colAddPair(thread, i, j);
+
+        }
+
+    }
+
+}
+
+// with OpenMP, this is called once and spawns the threads itself
+static void colFindThread(int thread) {
+
+    int i;
+#ifdef _OPENMP
+    #pragma omp parallel private(i)
+    {
+        int me = omp_get_thread_num();
+
+        #pragma omp for schedule(dynamic, 256)
+        for (i = 0; i < workingSet.count; i++)
+            colFindPairs(me, i);
+    }
+#else
+    int start, end;
+
+    while (workNext(thread, 256, &start, &end))
+        for (i = start; i < end; i++)
+            colFindPairs(thread, i);
+#endif
+
+}
+
+static int colComparePairs(const void *a, const void *b) {
+
+    const colPair_t *p = a;
+    const colPair_t *q = b;
+
+    if (p->i != q->i)
+        return p->i < q->i ? -1 : 1;
+    if (p->j != q->j)
+        return p->j < q->j ? -1 : 1;
+    return 0;
+
+}
+
+static int colFind(int i) {
+
+    while (colParent[i] != i)
+        i = colParent[i] = colParent[colParent[i]];
+
+    return i;
+
+}
+
+// entry b goes into entry a
+static void colMerge(int a, int b) {
+
+    float wa, wb, w;
+
+    wa = state.physics == PH_CLASSIC ? 1 : (float)fabs(workingSet.mass[a]);
+    wb = state.physics == PH_CLASSIC ? 1 : (float)fabs(workingSet.mass[b]);
+    if (wa + wb <= 0)
+        wa = wb = 1;
+    w = 1 / (wa + wb);
+
+    workingSet.x[a]  = (workingSet.x[a] * wa + workingSet.x[b] * wb) * w;
+    workingSet.y[a]  = (workingSet.y[a] * wa + workingSet.y[b] * wb) * w;
+    workingSet.z[a]  = (workingSet.z[a] * wa + workingSet.z[b] * wb) * w;
+    workingSet.vx[a] = (workingSet.vx[a] * wa + workingSet.vx[b] * wb) * w;
+    workingSet.vy[a] = (workingSet.vy[a] * wa + workingSet.vy[b] * wb) * w;
+    workingSet.vz[a] = (workingSet.vz[a] * wa + workingSet.vz[b] * wb) * w;
+    workingSet.mass[a] += workingSet.mass[b];
+
+    state.particleMerged[workingSet.index[b]] = workingSet.index[a];
+    state.particleMergedFrame[workingSet.index[b]] = state.frame + 1;
+
+    colParent[b] = a;
+
+}
+
+/*
+ * take the merged entries out of the working set, the others keep their order
+ */
+static void colCompact() {
+
+    float *a[10];
+    int i, n, k;
+
+    a[0] = workingSet.x;  a[1] = workingSet.y;  a[2] = workingSet.z;
+    a[3] = workingSet.vx; a[4] = workingSet.vy; a[5] = workingSet.vz;
+    a[6] = workingSet.ax; a[7] = workingSet.ay; a[8] = workingSet.az;
+    a[9] = workingSet.mass;
+
+    n = 0;
+    for (i = 0; i < workingSet.count; i++) {
+
+        if (colParent[i] != i)
+            continue;
+
+        if (n != i) {
+            for (k = 0; k < 10; k++)
+                a[k][n] = a[k][i];
+            workingSet.index[n] = workingSet.index[i];
+            workingSet.level[n] = workingSet.level[i];
+        }
+
+        n++;
+
+    }
+
+    // the SIMD kernels may read a bit past the last particle
+    for (k = 0; k < 10; k++)
+        memset(a[k] + n, 0, sizeof(float) * (workingSet.count - n));
+
+    workingSet.count = n;
+    workingSet.activeCount = n;
+
+}
+
+/*
+ * merge the particles of the working set that are closer than state.collisionRadius
+ */
+static void processCollisions() {
+
+    int threads;
+    int merged;
+    int i, t, k;
+    unsigned int b;
+
+    if (workingSet.count < 2)
+        return;
+
+    if (colSize < workingSet.count) {
+
+        colFreeMemory();
+        colSize = workingSet.count;
+        colCell = malloc(sizeof(unsigned int) * colSize);
+        colOrder = malloc(sizeof(int) * colSize);
+        colParent = malloc(sizeof(int) * colSize);
+
+        if (!colCell || !colOrder || !colParent) {
+            conAdd(LERR, "Could not allocate %lu bytes of memory for collisions", (unsigned long)(3 * sizeof(int) * colSize));
+            colFreeMemory();
+            state.collisionRadius = 0;
+            return;
+        }
+
+    }
+
+    // about two buckets per particle
+    for (b = 1024; b < (unsigned int)workingSet.count * 2 && b < (1u << 30); b *= 2)
+        ;
+
+    if (b != colBuckets) {
+
+        free(colStart);
+        colStart = malloc(sizeof(int) * (b + 1));
+        colBuckets = b;
+
+        if (!colStart) {
+            conAdd(LERR, "Could not allocate %lu bytes of memory for collisions", (unsigned long)(sizeof(int) * (b + 1)));
+            colFreeMemory();
+            state.collisionRadius = 0;
+            return;
+        }
+
+    }
+
+    colInverse = 1 / state.collisionRadius;
+    colRadius2 = state.collisionRadius * state.collisionRadius;
+
+    threads = poolStart(state.processFrameThreads);
+
+    workInit(workingSet.count, threads);
+    poolRun(colHashThread);
+
+    // counting sort by bucket
+    memset(colStart, 0, sizeof(int) * (colBuckets + 1));
+    for (i = 0; i < workingSet.count; i++)
+        colStart[colCell[i] + 1]++;
+    for (b = 0; b < colBuckets; b++)
+        colStart[b + 1] += colStart[b];
+    for (i = 0; i < workingSet.count; i++)
+        colOrder[colStart[colCell[i]]++] = i;
+    // colStart[b] is now the end of bucket b, shift back
+    for (b = colBuckets; b > 0; b--)
+        colStart[b] = colStart[b - 1];
+    colStart[0] = 0;
+
+    memset(colPairCount, 0, sizeof(colPairCount));
+    workInit(workingSet.count, threads);
+    poolRun(colFindThread);
+
+    // all pairs in thread 0, in order
+    for (t = 1; t < MAX_THREADS; t++)
+        for (k = 0; k < colPairCount[t]; k++)
+            colAddPair(0, colPairs[t][k].i, colPairs[t][k].j);
+
+    if (!colPairCount[0])
+        return;
+
+    qsort(colPairs[0], colPairCount[0], sizeof(colPair_t), colComparePairs);
+
+    for (i = 0; i < workingSet.count; i++)
+        colParent[i] = i;
+
+    merged = 0;
+    for (k = 0; k < colPairCount[0]; k++) {
+
+        int a = colFind(colPairs[0][k].i);
+        int c = colFind(colPairs[0][k].j);
+
+        if (a == c)
+            continue;
+
+        // the first one survives
+        if (a < c)
+            colMerge(a, c);
+        else
+            colMerge(c, a);
+
+        merged++;
+
+    }
+
+    colCompact();
+
+    state.particlesMerged += merged;
+    conAdd(LLOW, "%i particles merged, %i left", merged, workingSet.count);
+
+    // masses and positions changed
+    state.have_old_accel = 0;
+    workingSet.jerk = 0;
 
-    cleanMemory();
+}
 
-//	conAdd(LERR, "Allocating %u bytes", FRAMESIZE * state.historyFrames);
-    state.particleHistory = (particle_t *)calloc(FRAMESIZE, state.historyFrames);
+/*
+ * compute new particle accelerations, based on current positions
+ */
+static void accelerateParticles() {
+    int threads;
+    int targets;
+    int tiles;
+    int jerk;
+
+    if (state.processFrameThreads < 1)
+        state.processFrameThreads = 1;
+    if (state.processFrameThreads > MAX_THREADS)
+        state.processFrameThreads = MAX_THREADS;
+
+    // no-op, unless "processors" was changed
+    threads = poolStart(state.processFrameThreads);
+
+    // zero accelerations, in case the solver gives up
+    memset(workingSet.ax, 0, sizeof(float) * workingSet.count);
+    memset(workingSet.ay, 0, sizeof(float) * workingSet.count);
+    memset(workingSet.az, 0, sizeof(float) * workingSet.count);
+
+    solverActive = getSolver();
+    physicsActive = state.physics;
+    soft2Active = state.softening * state.softening;
+    mixedActive = state.mixedPrecision;
+
+    // the hermite integrator also needs the jerk (only brute force, see getIntegrator())
+    jerk = integratorActive == INTEGRATOR_HERMITE && solverActive != SOLVER_OT && solverActive != SOLVER_FMM;
+    workingSet.jerk = 0;
+
+    if (jerk) {
+        memset(workingSet.jx, 0, sizeof(float) * workingSet.count);
+        memset(workingSet.jy, 0, sizeof(float) * workingSet.count);
+        memset(workingSet.jz, 0, sizeof(float) * workingSet.count);
+    }
 
-    while (!state.particleHistory) {
+    // block time steps: with only a few active particles, brute force adds
+    // up all particles for each of them instead of doing all tiles
+    if (solverActive != SOLVER_OT && solverActive != SOLVER_FMM && workingSet.activeCount * 2 < workingSet.count) {
+
+        otFreeTree();
+
+        workInit(workingSet.activeCount, threads);
+        poolRun(processActiveThread);
+        return;
 
-        conAdd(LLOW, "Could not allocate %lu bytes of memory for %ld frames of particleHistory", (unsigned long)(FRAMESIZE * state.historyFrames), state.historyFrames);
-        if (state.historyFrames < 10) {
-            conAdd(LERR, "Could not allocate for particleHistory - giving up.");
-            //return 0;
-            cmdQuit(NULL);
-        }
-        // reduce requested size by 10%, and try again
-        state.historyFrames = (state.historyFrames / 10) * 9;
-        state.particleHistory = (particle_t *)calloc(FRAMESIZE, state.historyFrames);
     }
 
-//	conAdd(LERR, "Allocating %u bytes", FRAMEDETAILSIZE);
-    state.particleDetail = calloc(sizeof(particleDetail_t),state.particleCount);
-    if (!state.particleDetail) {
+    switch (solverActive) {
 
-        conAdd(LERR, "Could not allocate %lu bytes of memory for particleDetail", (unsigned long)(FRAMEDETAILSIZE));
-        free(state.particleHistory);
-        state.memoryAllocated = 0;
-        //return 0;
-        cmdQuit(NULL);
+    case SOLVER_OT:
+    case SOLVER_FMM:
+        // build the tree once, all threads share it
+        otBuildTree();
+        break;
+
+#ifdef HAVE_SSE
+    case SOLVER_PP_SSE:
+        ppTileActive = processTilePP_SSE;
+        break;
+#endif
+
+    case SOLVER_PP_VECTOR:
+        ppTileActive = processTilePP_Vector;
+        break;
+
+    default:
+        ppTileActive = processTilePP;
+        break;
 
     }
 
-    state.memoryAllocated += FRAMESIZE * state.historyFrames;
-    state.memoryAllocated += FRAMEDETAILSIZE;
+    switch (solverActive) {
 
-    memset(state.particleHistory, 0, FRAMESIZE);
+    case SOLVER_OT:
+        workInit(otPrepareGroups(), threads);
+        break;
 
-    view.timed_frames=0;
-    view.totalRenderTime=0;
-    view.lastRenderTime = 0;
+    case SOLVER_FMM:
+        // multipole expansions of the tree, bottom up
+        targets = fmmPrepare(threads);
+        workInit(targets, threads);
+        poolRun(fmmUpward);
+        fmmUpwardTop();
 
-    fpsInit();
+        // block time steps: only the targets with active particles
+        workInit(fmmActiveTargets(), threads);
+        break;
 
-    VectorZero(view.lastCenter);
+    default:
+        // don't keep drawing an old tree
+        otFreeTree();
 
-    state.have_old_accel = 0;
+        // one acceleration buffer per thread
+        tiles = ppPrepare(threads, jerk);
+        workingSet.jerk = jerk && tiles;
+        workInit(tiles, threads);
+        break;
 
-    return 1;
+    }
 
-}
+    if (solverActive == SOLVER_OT || solverActive == SOLVER_FMM) {
+        view.recordStatus = 2;
+        view.recordParticlesDone = 0;
+    }
 
-void processFrameThread(int thread) {
+    poolRun(processFrameThread);
 
-    int sliceStart, sliceEnd, sliceSize;
+    view.recordStatus = 0;
 
-#if (defined(WIN32) && !defined(USE_PTHREAD)) || defined(_OPENMP)
-    sliceSize = state.particleCount;
-    sliceStart = 0;
-    sliceEnd = sliceStart + sliceSize;
+    // add up the accelerations of all threads
+    if (solverActive != SOLVER_OT && solverActive != SOLVER_FMM) {
+        workInit(workingSet.count, threads);
+        poolRun(reduceFrameThread);
+    }
 
-#else
-    sliceSize = state.particleCount / state.processFrameThreads;
+}
 
-    sliceStart = sliceSize * thread;
-    sliceEnd = sliceSize * thread + sliceSize;
 
-    // make sure the last thread does not miss remaining particle
-    if (thread == (state.processFrameThreads - 1))
-        sliceEnd = state.particleCount;
-#endif
+/*  Block time steps:
+    =================
+    With "timesteps" set, every particle moves with its own time step: the
+    frame halved up to timesteps times, step = 1 / 2^level. The level comes
+    from the acceleration, so that a particle moves about timestepaccuracy
+    (or less) because of it during one step:
+        |a| step^2 <= timestepaccuracy
+    The frame is split into 2^timesteps sub steps. All particles drift in
+    every sub step, but only the particles whose own step ends there are
+    "active": they get new accelerations and their kicks (the same
+    kick-drift-kick leapfrog as with one step per frame). Sub steps without
+    active particles do not call a solver at all.
+    A particle can move to a smaller step whenever its step ends, and to a
+    bigger one (one level at a time) when that step would start there as
+    well - so at the end of the frame all particles are in sync again, and
+    all of them are active.
+    The solvers only compute what is needed: the octree walks only the
+    groups with active particles, brute force adds up all particles for
+    each active particle (when fewer than half are active). FMM still
+    builds the expansions of all cells, but only handles the targets with
+    active particles, and only adds up (P2P) and evaluates (L2P) the
+    forces of active particles.
+    The drift and the search for active particles are split up between
+    the threads in chunks, like the forces. Every chunk counts its active
+    particles first, so activeIndex is in the same order for any number
+    of threads.
+*/
 
+// chunks of the drift and the active search, at least BLOCK_CHUNK particles each
+#define BLOCK_CHUNK 4096
+#define BLOCK_CHUNKS (MAX_THREADS * 16)
+
+static int blockChunk;
+static int blockChunks;
+static int blockActive[BLOCK_CHUNKS];  // active particles of a chunk, then where they start in activeIndex
+static int blockStep;
+static int blockSteps;
+static float blockH;
+
+// level of particle i, from its acceleration
+static int timeStepLevel(int i, int levels) {
+
+    float a2;
+    float max2;
+    float step2;
+    int level;
+
+    a2 = workingSet.ax[i] * workingSet.ax[i] + workingSet.ay[i] * workingSet.ay[i] + workingSet.az[i] * workingSet.az[i];
+    max2 = state.timeStepAccuracy * state.timeStepAccuracy;
+
+    // |a| step^2 <= timestepaccuracy, without a sqrt
+    level = 0;
+    step2 = 1;
+    while (level < levels && a2 * step2 * step2 > max2) {
+        level++;
+        step2 *= 0.25f;
+    }
+
+    return level;
 
-#if NBODY_METHOD == METHOD_OT
-    processFrameOT(sliceStart, sliceEnd);
-#else
-#ifdef HAVE_SSE
-    processFramePP_SSE(sliceStart, sliceEnd);
-#else
-    processFramePP(sliceStart, sliceEnd);
-#endif
-#endif
-    
 }
 
-void processMomentum() {
+// drift the particles of chunk c, and count the ones whose step ends here
+static int blockDriftChunk(int c) {
 
-    double sP[3];
-    double tmp[3];
-    int i;
-    particle_t *p;
-    particleDetail_t *pd;
+    int i, end, n;
 
-    // work out simulation momentum
-    VectorZero(tmp);
-    VectorZero(sP);
-    for (i = 0; i < state.particleCount; i++) {
+    end = (c + 1) * blockChunk;
+    if (end > workingSet.count)
+        end = workingSet.count;
 
-        p = state.particleHistory + state.particleCount * state.frame + i;
-        pd = state.particleDetail + i;
+    n = 0;
+    for (i = c * blockChunk; i < end; i++) {
+
+        workingSet.x[i] += workingSet.vx[i] * blockH;
+        workingSet.y[i] += workingSet.vy[i] * blockH;
+        workingSet.z[i] += workingSet.vz[i] * blockH;
 
-        VectorMultiply(p->vel, pd->mass, tmp);
-        VectorAdd(sP, tmp, sP);
+        workingSet.active[i] = !(blockStep % (blockSteps >> workingSet.level[i]));
+        n += workingSet.active[i];
 
     }
 
-    conAdd(LLOW, "Momentum: %.10f, %.10f, %.10f", sP[0], sP[1], sP[2]);
+    return n;
 
 }
 
+// list the active particles of chunk c, from blockActive[c] on
+static void blockIndexChunk(int c) {
 
-/*
- * compute new particle accelerations, based on current positions
- */
-static void accelerateParticles() {
-#if (!defined(WIN32) || defined(USE_PTHREAD)) && !defined(_OPENMP)
-    pthread_t ptt[MAX_THREADS+1];
+    int i, end, k;
+
+    end = (c + 1) * blockChunk;
+    if (end > workingSet.count)
+        end = workingSet.count;
+
+    k = blockActive[c];
+    for (i = c * blockChunk; i < end; i++)
+        if (workingSet.active[i])
+            workingSet.activeIndex[k++] = i;
+
+}
+
+// with OpenMP, these are called once and spawn the threads themselves
+static void blockDriftThread(int thread) {
+
+    int c;
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static)
+    for (c = 0; c < blockChunks; c++)
+        blockActive[c] = blockDriftChunk(c);
+#else
+    int start, end;
+
+    while (workNext(thread, 1, &start, &end))
+        for (c = start; c < end; c++)
+            blockActive[c] = blockDriftChunk(c);
 #endif
-        int i;
 
+}
+
+static void blockIndexThread(int thread) {
+
+    int c;
 #ifdef _OPENMP
-    omp_set_num_threads(state.processFrameThreads);
+    #pragma omp parallel for schedule(static)
+    for (c = 0; c < blockChunks; c++)
+        blockIndexChunk(c);
+#else
+    int start, end;
+
+    while (workNext(thread, 1, &start, &end))
+        for (c = start; c < end; c++)
+            blockIndexChunk(c);
 #endif
 
-    // zero accelerations
-    for (i = 0; i < state.particleCount; i++) {
-        particleDetail_t *pd;
-        pd = getParticleDetail(i);
-	VectorZero(pd->accel);
+}
+
+/*
+ * leapfrog with block time steps, see above. The accelerations of the
+ * current frame have to be known. returns 0 if the frame was cancelled
+ */
+static int moveParticlesBlock() {
+
+    int levels;
+    int steps;
+    int threads;
+    int s, i, k, c;
+    int level, want;
+
+    levels = state.timeSteps;
+    if (levels > TIMESTEP_MAX_LEVELS)
+        levels = TIMESTEP_MAX_LEVELS;
+
+    steps = 1 << levels;
+
+    threads = poolStart(state.processFrameThreads);
+
+    blockSteps = steps;
+    blockH = 1.0f / steps;
+    blockChunk = (workingSet.count + BLOCK_CHUNKS - 1) / BLOCK_CHUNKS;
+    if (blockChunk < BLOCK_CHUNK)
+        blockChunk = BLOCK_CHUNK;
+    blockChunks = (workingSet.count + blockChunk - 1) / blockChunk;
+
+    // everybody starts in sync: first half kick
+    workingSet.levelMax = 0;
+    for (i = 0; i < workingSet.count; i++) {
+
+        float half;
+
+        level = timeStepLevel(i, levels);
+        workingSet.level[i] = (unsigned char)level;
+        if (level > workingSet.levelMax)
+            workingSet.levelMax = level;
+
+        half = 0.5f / (1 << level);
+        workingSet.vx[i] += workingSet.ax[i] * half;
+        workingSet.vy[i] += workingSet.ay[i] * half;
+        workingSet.vz[i] += workingSet.az[i] * half;
+
     }
 
-#if NBODY_METHOD == METHOD_OT
-    otFreeTree();
-#endif
+    for (s = 1; s <= steps; s++) {
 
-#if (defined(WIN32) && !defined(USE_PTHREAD)) || defined(_OPENMP)
-    processFrameThread(0);
-#else
+        // drift everybody, and find the particles whose step ends here
+        blockStep = s;
+        workInit(blockChunks, threads);
+        poolRun(blockDriftThread);
 
-    if (state.processFrameThreads > 1) {
-        for (i = 0; i < state.processFrameThreads; i++) {
-            pthread_create(&ptt[i], NULL, (void*)processFrameThread, (void*)i);
+        workingSet.activeCount = 0;
+        for (c = 0; c < blockChunks; c++) {
+            k = blockActive[c];
+            blockActive[c] = workingSet.activeCount;
+            workingSet.activeCount += k;
         }
-        for (i = 0; i < state.processFrameThreads; i++) {
-            pthread_join(ptt[i], NULL);
+
+        if (!workingSet.activeCount)
+            continue;
+
+        workInit(blockChunks, threads);
+        poolRun(blockIndexThread);
+
+        accelerateParticles();
+
+        if (!(state.mode & SM_RECORD))
+            break;
+
+        for (k = 0; k < workingSet.activeCount; k++) {
+
+            float half;
+
+            i = workingSet.activeIndex[k];
+            level = workingSet.level[i];
+
+            // second half kick of the step that ends here
+            half = 0.5f / (1 << level);
+            workingSet.vx[i] += workingSet.ax[i] * half;
+            workingSet.vy[i] += workingSet.ay[i] * half;
+            workingSet.vz[i] += workingSet.az[i] * half;
+
+            // the first one of the next frame is done there
+            if (s == steps)
+                continue;
+
+            // next step: smaller at any time, bigger only where it starts
+            want = timeStepLevel(i, levels);
+            if (want < level && !(s % (steps >> (level - 1))))
+                level--;
+            else if (want > level)
+                level = want;
+
+            workingSet.level[i] = (unsigned char)level;
+            if (level > workingSet.levelMax)
+                workingSet.levelMax = level;
+
+            // first half kick of the next step
+            half = 0.5f / (1 << level);
+            workingSet.vx[i] += workingSet.ax[i] * half;
+            workingSet.vy[i] += workingSet.ay[i] * half;
+            workingSet.vz[i] += workingSet.az[i] * half;
+
         }
 
-    } else {
-        processFrameThread(0);
     }
 
-#endif
+    workingSet.activeCount = workingSet.count;
+
+    return (state.mode & SM_RECORD) != 0;
+
+}
+
+/*  Integrators:
+    ============
+    An integrator moves the working set on by one frame, starting with the
+    accelerations of the current frame, and leaves the accelerations of the
+    new frame behind. In gravit, the "time step" is always 1 (a frame),
+    unless block time steps are used, see moveParticlesBlock().
+    - leapfrog: kick-drift-kick, 2nd order, one force evaluation per frame.
+      The default, and the only one that does block time steps.
+    - yoshida: three leapfrog steps of w1, w0 and w1 frames (w0 is negative,
+      the middle step goes back in time), 4th order. Three force evaluations
+      per frame, but the error shrinks with step^4 instead of step^2, so the
+      frames can be much longer for the same energy error.
+    - hermite: 4th order predictor-corrector, one force evaluation per frame.
+      It also needs the jerk (the time derivative of the acceleration), which
+      the brute force kernels compute along with the accelerations. The tree
+      solvers don't, with them leapfrog is used instead.
+*/
+
+// returns 0 if the frame was cancelled
+typedef int (*integrator_t)();
+
+// use leapfrog integration sheme, as it has a much better acuracy,
+// with very low additional computation costs
+// http://einstein.drexel.edu/courses/Comp_Phys/Integrators/leapfrog/
+// http://www.artcompsci.org/vol_1/v1_web/node34.html
+static int integrateLeapfrog() {
+    int i;
+
+    if (state.timeSteps > 0)
+        return moveParticlesBlock();
+
+    // advance velocities by 0.5 step, then advance positions by 1 step
+    for (i = 0; i < workingSet.count; i++) {
+        workingSet.vx[i] += workingSet.ax[i] * 0.5f;
+        workingSet.vy[i] += workingSet.ay[i] * 0.5f;
+        workingSet.vz[i] += workingSet.az[i] * 0.5f;
+        workingSet.x[i] += workingSet.vx[i];
+        workingSet.y[i] += workingSet.vy[i];
+        workingSet.z[i] += workingSet.vz[i];
+    }
+
+    // compute new accelerations
+    accelerateParticles();
+
+    if (!(state.mode & SM_RECORD))
+        return 0;
+
+    // advance velocities by 0.5 step
+    for (i = 0; i < workingSet.count; i++) {
+        workingSet.vx[i] += workingSet.ax[i] * 0.5f;
+        workingSet.vy[i] += workingSet.ay[i] * 0.5f;
+        workingSet.vz[i] += workingSet.az[i] * 0.5f;
+    }
+
+    //	forceToCenter();
+
+    // simple "Euler" integration - low accuracy
+    // advance velocities, then advance particles to final positions
+    //for (i = 0; i < workingSet.count; i++) {
+    //    workingSet.vx[i] += workingSet.ax[i];
+    //    workingSet.x[i] += workingSet.vx[i];
+    //    ...
+    //}
+
+    return 1;
 }
 
+// w1 = 1 / (2 - 2^(1/3)), w0 = 1 - 2 w1
+#define YOSHIDA_W1 1.3512071919596578f
+#define YOSHIDA_W0 -1.7024143839193153f
+
+static int integrateYoshida() {
+
+    static const float w[3] = { YOSHIDA_W1, YOSHIDA_W0, YOSHIDA_W1 };
+    int i, k;
+
+    for (k = 0; k < 3; k++) {
+
+        float half = w[k] * 0.5f;
+
+        for (i = 0; i < workingSet.count; i++) {
+            workingSet.vx[i] += workingSet.ax[i] * half;
+            workingSet.vy[i] += workingSet.ay[i] * half;
+            workingSet.vz[i] += workingSet.az[i] * half;
+            workingSet.x[i] += workingSet.vx[i] * w[k];
+            workingSet.y[i] += workingSet.vy[i] * w[k];
+            workingSet.z[i] += workingSet.vz[i] * w[k];
+        }
+
+        accelerateParticles();
+
+        if (!(state.mode & SM_RECORD))
+            return 0;
+
+        for (i = 0; i < workingSet.count; i++) {
+            workingSet.vx[i] += workingSet.ax[i] * half;
+            workingSet.vy[i] += workingSet.ay[i] * half;
+            workingSet.vz[i] += workingSet.az[i] * half;
+        }
+
+    }
+
+    return 1;
+
+}
 
 /*
- * compute and "integrate" new particle velocities, and advances particle postions to next time frame
- *
- * assumption:   one new frame is availeable at (state.particleHistory + state.particleCount * (state.frame+1))
- * side effects: updates state.frame
+ * predict positions and velocities with acceleration a0 and jerk j0:
+ *   x = x0 + v0 + a0 / 2 + j0 / 6
+ *   v = v0 + a0 + j0 / 2
+ * compute a1 and j1 there, and correct:
+ *   v1 = v0 + (a0 + a1) / 2 + (j0 - j1) / 12
+ *   x1 = x0 + (v0 + v1) / 2 + (a0 - a1) / 12
+ * a1 and j1 are used as they are for the next frame.
  */
-static void moveParticles() {
-    int i;
-    particle_t *p;
-    particleDetail_t *pd;
+static int integrateHermite() {
 
-    // use leapfrog integration sheme, as it has a much better acuracy,
-    // with very low additional computation costs
-    // http://einstein.drexel.edu/courses/Comp_Phys/Integrators/leapfrog/
-    // http://www.artcompsci.org/vol_1/v1_web/node34.html
-    // note: in gravit, the "time step" t is always 1
+    float *now[12];
+    float **start;
+    int i, c, k;
 
+    // the jerk is missing when another integrator (or solver) did the last frame
+    if (!workingSet.jerk) {
 
-    // make sure we know the accelerations of the current frame
-    if ((state.totalFrames == 0) || (state.have_old_accel == 0)) {
         accelerateParticles();
-	state.have_old_accel = 1;
+
+        if (!(state.mode & SM_RECORD))
+            return 0;
+
     }
 
-    // copy particles to next frame
-    memcpy(
-        state.particleHistory + state.particleCount * (state.frame+1),
-        state.particleHistory + state.particleCount * state.frame,
-        FRAMESIZE
-    );
-    // use next frame
-    state.frame++;
+    now[0] = workingSet.x;  now[1] = workingSet.y;  now[2] = workingSet.z;
+    now[3] = workingSet.vx; now[4] = workingSet.vy; now[5] = workingSet.vz;
+    now[6] = workingSet.ax; now[7] = workingSet.ay; now[8] = workingSet.az;
+    now[9] = workingSet.jx; now[10] = workingSet.jy; now[11] = workingSet.jz;
+    start = workingSet.start;
 
+    for (k = 0; k < 12; k++)
+        memcpy(start[k], now[k], sizeof(float) * workingSet.count);
 
-    // advance velocities by 0.5 step, then advance positions by 1 step
-    for (i = 0; i < state.particleCount; i++) {
-        p = state.particleHistory + state.particleCount * (state.frame) + i;
-        pd = getParticleDetail(i);
+    // predict
+    for (c = 0; c < 3; c++) {
+
+        float *x = now[c], *v = now[3 + c];
+        float *a = start[6 + c], *j = start[9 + c];
+
+        for (i = 0; i < workingSet.count; i++) {
+            x[i] += v[i] + a[i] * 0.5f + j[i] * (1.0f / 6);
+            v[i] += a[i] + j[i] * 0.5f;
+        }
 
-        VectorMultiplyAdd(pd->accel, 0.5, p->vel);
-        VectorAdd(p->pos, p->vel, p->pos);
     }
 
-    // compute new accelerations
     accelerateParticles();
 
-    // Check if the recording frame was cancelled, if so - forget new frame and return;
     if (!(state.mode & SM_RECORD))
-    {
-        state.frame--;
-	state.have_old_accel = 0;  // also, invalidate saved acceleration values
-        return;
+        return 0;
+
+    // correct
+    for (c = 0; c < 3; c++) {
+
+        float *x = now[c], *v = now[3 + c], *a = now[6 + c], *j = now[9 + c];
+        float *x0 = start[c], *v0 = start[3 + c], *a0 = start[6 + c], *j0 = start[9 + c];
+
+        for (i = 0; i < workingSet.count; i++) {
+            v[i] = v0[i] + (a0[i] + a[i]) * 0.5f + (j0[i] - j[i]) * (1.0f / 12);
+            x[i] = x0[i] + (v0[i] + v[i]) * 0.5f + (a0[i] - a[i]) * (1.0f / 12);
+        }
+
     }
 
-    // advance velocities by 0.5 step
-    for (i = 0; i < state.particleCount; i++) {
-        p = state.particleHistory + state.particleCount * (state.frame) + i;
-        pd = getParticleDetail(i);
-	VectorMultiplyAdd(pd->accel, 0.5, p->vel);
+    return 1;
+
+}
+
+static integrator_t integrators[INTEGRATOR_LAST] = { integrateLeapfrog, integrateYoshida, integrateHermite };
+
+/*
+ * compute and "integrate" new particle velocities, and advances particle postions to next time frame
+ *
+ * works on the working set only, particleHistory is not touched
+ */
+static void moveParticles() {
+
+    integratorActive = getIntegrator();
+
+    if ((!workingSet.valid && !wsLoad()) || (integratorActive == INTEGRATOR_HERMITE && !wsAllocHermite())) {
+        state.targetFrame = -1;
+        if (state.mode & SM_RECORD) cmdRecord(NULL);
+        return;
     }
 
+    // make sure we know the accelerations of the current frame
+    if ((state.totalFrames == 0) || (state.have_old_accel == 0)) {
+        accelerateParticles();
+	state.have_old_accel = 1;
+    }
 
-    //	processCollisions();
-    //	forceToCenter();
+    // Check if the recording frame was cancelled, if so - forget new frame and return;
+    if (!integrators[integratorActive]()) {
+        // start again from the last recorded frame
+        workingSet.valid = 0;
+    }
 
-    // simple "Euler" integration - low accuracy
-    // advance velocities, then advance particles to final positions
-    //for (i = 0; i < state.particleCount; i++) {
-    //    p = state.particleHistory + state.particleCount * (state.frame) + i;
-    //    pd = getParticleDetail(i);
-    //    VectorAdd(p->vel, pd->accel, p->vel);
-    //    VectorAdd(p->pos, p->vel, p->pos);
-    //}
 }
 
 
 
 void processFrame() {
 
-    int i;
     Uint32 frameStart = 0;
     Uint32 frameEnd = 0;
+    int i;
 
-//	processMomentum();
+    // a loaded recording can only go on from its last frame
+    if (saveProgress(NULL) == SAVE_LOADING)
+        saveFinish();
 
     if (state.frame >= state.historyFrames - 1) {
 
         if (state.frameCompression) {
 
+            // the frames are renumbered, a save needs them all first
+            saveFinish();
+
+            // keep every second frame, including the last one if it is even
             state.frame /= 2;
             if (state.targetFrame >0) state.targetFrame /= 2;
-            state.currentFrame = state.frame;
             state.historyNFrame *= 2;
             conAdd(LLOW, "historyNFrame: %i", state.historyNFrame);
 
-            for (i = 0; i < state.frame; i++) {
-
-                memcpy(
-
-                    state.particleHistory + state.particleCount * i,
-                    state.particleHistory + state.particleCount * i * 2,
-                    FRAMESIZE
-
-                );
+            historyCompress(state.frame);
 
-            }
+            // merged from frame m on: from the first kept frame 2i >= m on
+            for (i = 0; i < state.particleCount; i++)
+                if (state.particleMerged[i] >= 0)
+                    state.particleMergedFrame[i] = (state.particleMergedFrame[i] + 1) / 2;
 
-            state.frame--;
+            state.currentFrame = state.frame;
 
         } else {
 
@@ -333,20 +1955,18 @@ void processFrame() {
     view.totalRenderTime += frameEnd - frameStart;
     view.timed_frames ++;
 
+    if (state.diagnostics > 0 && !(state.totalFrames % state.diagnostics))
+        processDiagnostics();
 
-    if (state.frameCompression && (state.totalFrames % state.historyNFrame)) {
-
-        memcpy(
-
-            state.particleHistory + state.particleCount * state.frame,
-            state.particleHistory + state.particleCount * (state.frame+1),
-            FRAMESIZE
-
-        );
+    if (state.collisionRadius > 0)
+        processCollisions();
 
+    // with frame compression, only every historyNFrame-th frame is kept
+    if (state.frameCompression && (state.totalFrames % state.historyNFrame))
         return;
 
-    }
+    state.frame++;
+    wsStore(state.frame);
 
     state.currentFrame = state.frame;
 
@@ -358,58 +1978,6 @@ void processFrame() {
     }
 }
 
-#if 0
-// slow
-void processCollisions() {
-
-    int i,j;
-    particle_t *p1;
-    particle_t *p2;
-    VectorNew(dv);
-    VectorNew(dv2);
-    float d;
-
-    for (i = 0; i < state.particleCount; i++) {
-
-        p1 = state.particleHistory + state.particleCount*state.frame + i;
-
-        for (j = 0; j < state.particleCount; j++) {
-
-            if (i == j)
-                continue;
-
-            p2 = state.particleHistory + state.particleCount*state.frame + j;
-
-            dv[0] = p1->pos[0] - p2->pos[0];
-            dv[1] = p1->pos[1] - p2->pos[1];
-            dv[2] = p1->pos[2] - p2->pos[2];
-
-            dv2[0] = pow(dv[0], 2);
-            dv2[1] = pow(dv[1], 2);
-            dv2[2] = pow(dv[2], 2);
-
-            // get distance between the two
-            d = sqrt(dv2[0] + dv2[1] + dv2[2]);
-
-            if (d <= 2.f) {
-
-                // p1->size += p2->size;
-                p1->mass += p2->mass;
-                p1->vel[0] = (p1->vel[0] + p2->vel[0])/2;
-                p1->vel[1] = (p1->vel[1] + p2->vel[1])/2;
-                p1->vel[2] = (p1->vel[2] + p2->vel[2])/2;
-
-                conAdd(LLOW, "Particle %i and %i collided: newmass=%f", i, j, p1->mass);
-
-            }
-
-        }
-
-    }
-
-}
-#endif
-
 #if 0
 
 // slow/unrealistic
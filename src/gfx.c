@@ -353,14 +353,14 @@ void particleInterpolate(int i, float t, float *v) {
     particle_t *p2;
     VectorNew(moo);
 
-    p1 = state.particleHistory + state.particleCount * state.currentFrame + i;
+    p1 = historyParticle(state.currentFrame, i);
 
     if (state.currentFrame == state.historyFrames || state.historyFrames == 0 || state.mode & SM_RECORD) {
         VectorCopy(p1->pos, v);
         return;
     }
 
-    p2 = state.particleHistory + state.particleCount * (state.currentFrame+1) + i;
+    p2 = historyParticle(state.currentFrame+1, i);
 
     VectorSub(p1->pos, p2->pos, moo);
     VectorMultiply(moo, t, moo);
@@ -564,7 +564,7 @@ void drawFrame() {
                 particleInterpolate(i, ((float)view.frameSkipCounter / view.frameSkip), pos);
                 glVertex3fv(pos);
             } else {
-                p = state.particleHistory + state.particleCount * state.currentFrame + i;
+                p = historyParticle(state.currentFrame, i);
                 glVertex3fv(p->pos);
             }
             view.vertices++;
@@ -646,7 +646,7 @@ void drawFrame() {
             if (view.frameSkip < 0) {
                 particleInterpolate(i, ((float)view.frameSkipCounter / view.frameSkip), moo);
             } else {
-                p = state.particleHistory + state.particleCount * state.currentFrame + i;
+                p = historyParticle(state.currentFrame, i);
                 pos = p->pos;
             }
 
@@ -778,7 +778,7 @@ void drawFrame() {
                     glColor4fv(sc);
                 }
 
-                p = state.particleHistory + state.particleCount * j + i;
+                p = historyParticle(j, i);
                 glVertex3fv(p->pos);
 
                 view.vertices++;
@@ -790,7 +790,7 @@ void drawFrame() {
                 particleInterpolate(i, ((float)view.frameSkipCounter / view.frameSkip), pos);
                 glVertex3fv(pos);
             } else {
-                p = state.particleHistory + state.particleCount * state.currentFrame + i;
+                p = historyParticle(state.currentFrame, i);
                 glVertex3fv(p->pos);
             }
 
@@ -47,6 +47,22 @@ Foundation, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
   #define PURE_F
 #endif
 
+// force kernels are written once, with the physics mode as a constant
+// argument, and inlined into one instance per mode (see frame-pp.c)
+#if defined(__GNUC__)
+  #define KERNEL_INLINE static __inline__ __attribute__((always_inline))
+#elif defined(_MSC_VER)
+  #define KERNEL_INLINE static __forceinline
+#else
+  #define KERNEL_INLINE static
+#endif
+
+// __restrict__ tell the compiler that two pointer will not point to the same location
+// if your compiler complains, just remove __restrict__
+#ifdef _MSC_VER
+#define __restrict__ __restrict
+#endif
+
 
 // normally /etc
 #ifndef SYSCONFDIR
@@ -200,6 +216,55 @@ Foundation, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
     #define MAX_PATH 260
 #endif
 
+// atomically add v to the int at ptr, returns the old value
+#ifdef _MSC_VER
+#define atomicFetchAdd(ptr, v) InterlockedExchangeAdd((volatile LONG *)(ptr), (v))
+#else
+#define atomicFetchAdd(ptr, v) __sync_fetch_and_add((ptr), (v))
+#endif
+
+/* ************************************************************************** */
+/* How to allocate memory with 16byte alignment?                              */
+/* ************************************************************************** */
+#ifdef WIN32
+
+    // Windows: use _aligned_malloc
+    #include <stdlib.h>
+    #include <malloc.h>
+
+    #if defined(__MINGW32__) || defined(mingw32) || defined(MINGW)
+        // MinGW
+        #define MALLOC_ALIGNED(target, size, alignment) {target =  (float*) __mingw_aligned_malloc(size, alignment);}
+        #define FREE_ALIGNED(target)                    {__mingw_aligned_free(target);}
+    #else
+        // Microsoft
+        #define MALLOC_ALIGNED(target, size, alignment) {target =  (float*) _aligned_malloc(size, alignment);}
+        #define FREE_ALIGNED(target)                    {_aligned_free(target);}
+    #endif
+
+#else
+
+    // linux, unix, MacOS:  use (posix_)memalign
+    #include <stdlib.h>
+
+    #if defined(HAVE_MEMALIGN)
+        #include <malloc.h>
+
+        // use memalign -- seems this is the best choice for most unix/linux versions
+        #define MALLOC_ALIGNED(target, size, alignment) {target =  (float*) memalign(alignment, size);}
+        #define FREE_ALIGNED(target)                    {free(target);}
+
+    #else
+
+        // all others use posix_memalign
+        #define MALLOC_ALIGNED(target, size, alignment) {if (posix_memalign( (void **) &(target), alignment, size) != 0) target=NULL;}
+        #define FREE_ALIGNED(target)                    {free(target);}
+
+    #endif
+
+#endif
+/* ************************************************************************** */
+
 #define FILE_CHUNK_SIZE (1024*1024)
 #define FILE_CHUNK_SIZE_SMALL 1024
 
@@ -208,7 +273,7 @@ Foundation, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
 #define FRAMEDETAILSIZE (sizeof(particleDetail_t) * state.particleCount)
 #define SAVEDETAILSIZE (sizeof(saveDetail_t) * state.particleCount)
 
-#define getParticleCurrentFrame(i) state.particleHistory + state.particleCount * state.currentFrame + (i)
+#define getParticleCurrentFrame(i) historyParticle(state.currentFrame, (i))
 #define getParticleFirstFrame(i) state.particleHistory + (i)
 #define getParticleDetail(i) state.particleDetail + (i)
 
@@ -234,10 +299,40 @@ Foundation, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
 #define CM_MOM 4
 #define CM_LAST 5
 
-#define METHOD_PP 0
-#define METHOD_OT 1
-
-#define NBODY_METHOD METHOD_PP
+// force solvers, see "solver" command
+#define SOLVER_AUTO 0
+#define SOLVER_PP 1
+#define SOLVER_PP_SSE 2
+#define SOLVER_PP_VECTOR 3
+#define SOLVER_OT 4
+#define SOLVER_FMM 5
+#define SOLVER_LAST 6
+
+// integrators, see "integrator" command
+#define INTEGRATOR_LEAPFROG 0
+#define INTEGRATOR_YOSHIDA 1
+#define INTEGRATOR_HERMITE 2
+#define INTEGRATOR_LAST 3
+
+// "solver auto" switches from brute force to the octree at this particle count
+#define SOLVER_AUTO_OT_PARTICLES 100000
+
+// opening angle of the octree, see "theta" command. with quadrupole moments,
+// 0.7 is more accurate than the old monopole-only walk at 0.5, and faster
+#define OT_DEFAULT_THETA 0.7f
+
+// expansion order of the FMM solver, see "fmmorder" command
+#define FMM_DEFAULT_ORDER 4
+#define FMM_MAX_ORDER 8
+
+// block time steps, see "timesteps" and "timestepaccuracy" commands and frame.c
+#define TIMESTEP_MAX_LEVELS 10
+#define TIMESTEP_DEFAULT_ACCURACY 0.1f
+
+// plummer softening length of all solvers, see "softening" command. every
+// kernel pulls with distance^2 + softening^2 instead of distance^2. the
+// default is what the SSE kernels always used (MIN_STEP2 = 0.05)
+#define SOFTENING_DEFAULT 0.2236068f
 
 #define VectorNew(a) float a[3]
 
@@ -404,7 +499,6 @@ typedef struct particle_s {
 typedef struct particleDetail_s {
 
     float mass;
-    VectorNew(accel);       // new acceleration
     float col[4];
     unsigned int particleSprite;
 
@@ -418,17 +512,29 @@ typedef struct saveDetail_s {
 
 } saveDetail_t;
 
-// physics mode: CLASSIC, MODIFIED or PROPER
-typedef enum {PH_CLASSIC=0, PH_MODIFIED=1, PH_PROPER=2} physics_t;
+// physics mode: CLASSIC, MODIFIED or PROPER, see "physics" command
+//   CLASSIC:  a1 = g * m1 * m2 * dv / r^2
+//   MODIFIED: a1 = g * m2 * dv / r^2
+//   PROPER:   a1 = g * m2 * dv / r^3   (newton)
+typedef enum {PH_CLASSIC=0, PH_MODIFIED=1, PH_PROPER=2, PH_LAST=3} physics_t;
+
+// CLASSIC also multiplies the pull with the mass of the particle that is pulled
+#define PHYSICS_MASS(physics, m) ((physics) == PH_CLASSIC ? (m) : 1.0f)
 
 // global simulation state
 typedef struct state_s {
 
     particle_t *particleHistory;
     particleDetail_t *particleDetail;
+    int *particleMerged;    // particle that particle i was merged into, -1: none (see "collisionradius")
+    int *particleMergedFrame; // first frame in which particle i is merged, in the particleMerged allocation
+    float *particleMass;    // see particleMasses(), in the particleMerged allocation
+    int particlesMerged;    // number of particles merged away since the simulation started
 
     int memoryAvailable;    // MB
     int memoryPercentage;   // Detect memory available and use a percentage of it
+    int historyDisk;        // MB. > 0: keep the history in a memory mapped file of this size
+    int historyCompact;     // 1: store most frames as quantized positions only, see history.c
 
     int particleCount;
     int frame;
@@ -448,6 +554,17 @@ typedef struct state_s {
     float massRange[2];
 
     int processFrameThreads;
+    int solver;             // SOLVER_*
+    int integrator;         // INTEGRATOR_*
+    int fmmOrder;           // expansion order of the FMM solver
+    float theta;            // opening angle of the octree
+    int quadrupole;         // 1: octree nodes also use their quadrupole moment
+    int timeSteps;          // > 0: block time steps, a frame is split into up to 2^timeSteps steps
+    float timeStepAccuracy; // a particle may move about this far because of its acceleration in one step
+    float softening;        // plummer softening length, see SOFTENING_DEFAULT
+    int diagnostics;        // > 0: energy and momentum every n frames, see frame.c
+    int mixedPrecision;     // 1: positions relative to workingSet.origin, forces added up in double
+    float collisionRadius;  // > 0: particles closer than this merge, see frame.c
 
     int particlesToSpawn;
 
@@ -455,6 +572,7 @@ typedef struct state_s {
 
     int lastSave;    // last frame saved
     int autoSave;    // auto save every n frames. 0 for off.
+    int saveCompression;    // 1: saved frames are compressed, see save.c
     char *fileName; // if null dont autosave or incsave.
 
     int currentlySpawning;
@@ -654,34 +772,6 @@ typedef struct con_s {
 
 } con_t;
 
-// for processframeot
-typedef struct otinfo_s {
-
-    particle_t *p;
-    particleDetail_t *pd;
-    struct node_s *n;
-
-} otinfo_t;
-
-// for otComputeParticleToTreeRecursive
-typedef struct pttr_s {
-
-    particle_t *p;
-    particleDetail_t *pd;
-    struct node_s *n;
-
-} pttr_t;
-
-typedef struct pib_s {
-
-    float *min;
-    float *max;
-    particle_t *gp;
-    float m;
-    float *cm;
-
-} pib_t;
-
 // main.c
 #ifdef WIN32
 
@@ -727,6 +817,7 @@ char *findFile(char *file); // finds a file in gravit's search path
 int fileExists(char *file); // sees if a file is openable
 int checkHomePath();
 size_t getMemoryAvailable();
+int getProcessors();
 
 // png_save.c
 extern int png_save_surface(char *filename, SDL_Surface *surf);
@@ -801,17 +892,224 @@ int processKeys();
 
 #endif
 
+// history.c
+int historyFramesFor(size_t bytes);
+int historyAlloc();
+void historyFree();
+int historyOnDisk();
+size_t historySize();
+int historyIsCompact();
+void historyPrefetch(int frame);
+particle_t *historyParticle(int frame, int i);
+particle_t *historyWriteFrame(int frame);
+void historyCommitFrame(int frame);
+void historyCompress(int frames);
+particle_t *historyFrame(int frame, particle_t *buffer);
+int historyLoad(char *fileName, int frames);
+int historyMapFrames(char *fileName, long long offset, size_t stride, int frames);
+
+// save.c
+
+#define SAVE_EXTENSION "gravit"
+
+// a save file that is being read, see saveOpen()
+typedef struct saveFile_s {
+
+    FILE *fp;
+    char fileName[1024];
+    saveInfo_t info;
+    int frames;             // frames in the file
+    long long *frame;       // offset of each frame
+    long long index;        // offset of the newest index
+    long long detail;       // offsets of the particle details and merged particles (0: none)
+    long long merged;
+    particle_t *previous;   // the last two frames that were read, for the next ones
+    particle_t *previous2;
+    int previousFrame;
+    int previous2Frame;
+    unsigned char *packed;  // a packed frame as it is in the file
+    size_t packedSize;
+    struct saveWorkers_s *workers;  // for unpacking, NULL: only the calling thread
+    int background;         // 1: errors only go to error, not the console
+    char error[1200];
+
+} saveFile_t;
+
+#define SAVE_IDLE 0
+#define SAVE_SAVING 1
+#define SAVE_LOADING 2
+
+int saveOpen(saveFile_t *f, char *fileName);
+void saveClose(saveFile_t *f);
+int saveReadDetail(saveFile_t *f, saveDetail_t *sd);
+int saveReadMerged(saveFile_t *f, int *merged);
+int saveReadFrame(saveFile_t *f, int frame, particle_t *p);
+int saveRead(saveFile_t *f, int frames);
+int saveWrite(char *fileName, saveInfo_t *si, saveDetail_t *sd, int frames);
+int saveUpdate(int wait);
+void saveFinish();
+void saveCancel();
+int saveProgress(float *done);
+
 // frame.c
+
+// the particles of the frame that is being simulated, one aligned array per
+// component. The integrator updates these in place, particleHistory is only
+// written when a frame is kept.
+typedef struct {
+
+    float *x, *y, *z;
+    float *vx, *vy, *vz;
+    float *ax, *ay, *az;    // acceleration (already multiplied with G)
+    float *mass;
+    int *index;             // particle (in particleHistory) of each entry
+    int count;              // entries: the particles that were not merged
+
+    // block time steps (state.timeSteps)
+    unsigned char *level;   // time step of each particle: 1 / 2^level frames
+    unsigned char *active;  // 1: needs a new acceleration in this step
+    int *activeIndex;       // the active particles
+    int activeCount;        // == count when all particles are active
+    int levelMax;           // biggest level in the last frame
+
+    // hermite integrator
+    float *jx, *jy, *jz;    // jerk, d/dt of the acceleration (already multiplied with G)
+    float *start[12];       // x y z vx vy vz ax ay az jx jy jz at the start of the step
+    int jerk;               // 1: jx/jy/jz belong to ax/ay/az
+    float *hermiteBlock;    // jx .. start[11] live in this allocation
+
+    float *block;           // all arrays live in this allocation
+    int size;               // particles allocated per array
+    double origin[3];       // x y z are relative to this point (state.mixedPrecision, else 0)
+    int valid;              // 0: has to be loaded from particleHistory first
+
+} workingSet_t;
+
+extern workingSet_t workingSet;
+
+// results of the last diagnostics, see "diagnostics" command and frame.c
+typedef struct diagnostics_s {
+
+    int frame;              // total frame they belong to, 0: none yet
+    double momentum[3];
+    double kinetic;
+    double potential;
+    double virialRatio;     // 2 kinetic / |sum of r . F|, about 1 in equilibrium
+    double energy0;         // energy of the first diagnostics of this simulation
+    int haveEnergy0;
+    double drift;           // (energy - energy0) / |energy0|
+
+} diagnostics_t;
+
+extern diagnostics_t diagnostics;
+
+extern char *solverNames[SOLVER_LAST];
+extern char *integratorNames[INTEGRATOR_LAST];
+extern char *physicsNames[PH_LAST];
 int initFrame();
+int wsLoad();
+void wsStore(int frame);
+float *particleMasses(int frame);
+void wsFreeMemory();
+void colFreeMemory();
+int getSolver();
+int getIntegrator();
+void workInit(int items, int threads);
+int workNext(int thread, int chunk, int *start, int *end);
+int poolStart(int threads);
+void poolStop();
+void poolRun(void (*job)(int thread));
+int poolMainThread();
 void processFrame();
+void diagnosticsReset();
+int diagnosticsLog(char *fileName);
 void forceToCenter();
-void processCollisions();
 
 // frame-pp.c
-void processFramePP(int s, int n);
+
+// particle data in vector-friendly arrays, for the PP kernels
+typedef struct {
+    float * __restrict__ x;
+    float * __restrict__ y;
+    float * __restrict__ z;
+    float * __restrict__ mass;
+} particle_vectors;
+
+typedef struct {
+    float * __restrict__ x;
+    float * __restrict__ y;
+    float * __restrict__ z;
+} acc_vectors;
+
+// point masses with a quadrupole moment (octree nodes), for the list kernels
+typedef struct {
+    float * __restrict__ x;
+    float * __restrict__ y;
+    float * __restrict__ z;
+    float * __restrict__ mass;
+    float * __restrict__ q[6];      // xx yy zz xy xz yz
+} quad_vectors;
+
+/*
+ * pull of a particle on another one is m * dv / ppLawDivisor(distance^2):
+ * 1/r^2 for CLASSIC and MODIFIED, 1/r^3 for PROPER. physics has to be a
+ * constant, then only one case is left in the kernel
+ */
+KERNEL_INLINE float ppLawDivisor(float d2, const int physics) {
+
+    if (physics == PH_PROPER)
+        return d2 * sqrtf(d2);
+
+    return d2;
+
+}
+
+/*
+ * the pull between particles i and j, per unit of dv: fi for i, fj for j
+ */
+KERNEL_INLINE void ppPairForce(float mi, float mj, float d2, const int physics, float *fi, float *fj) {
+
+    if (physics == PH_CLASSIC) {
+        *fi = *fj = mi * mj / d2;
+        return;
+    }
+
+    d2 = 1 / ppLawDivisor(d2, physics);
+    *fi = mj * d2;
+    *fj = mi * d2;
+
+}
+
+// PP kernel for one tile: particles i0 .. i1-1 against j0 .. j1-1, only j < i
+// soft2 is the softening length^2, added to every distance^2
+typedef void (*ppTile_t)(particle_vectors pos, acc_vectors accel, int i0, int i1, int j0, int j1, float soft2, int physics);
+
+int ppPrepare(int threads, int jerk);
+void processFramePP(int thread, ppTile_t tile);
+void processFrameJerkPP(int thread);
+void ppReduce(int start, int end);
+void ppFreeMemory();
+void processTilePP(particle_vectors pos, acc_vectors accel, int i0, int i1, int j0, int j1, float soft2, int physics);
+void processTileJerkPP(particle_vectors pos, acc_vectors vel, acc_vectors accel, acc_vectors jerk, int i0, int i1, int j0, int j1, float soft2, int physics);
+void processListPP(particle_vectors list, int n, float *pos, float *acc, float soft2, int physics);
+void processListQuadPP(quad_vectors list, int n, float *pos, float *acc, float soft2, int physics);
+void processActivePP(int thread, float soft2, int physics, int mixed);
+double processListPotentialPP(particle_vectors list, int n, float *pos, float soft2, int physics);
+double processListQuadPotentialPP(quad_vectors list, int n, float *pos, float soft2, int physics);
 
 // frame-pp_sse.c
-void processFramePP_SSE(int s, int n);
+#define SIMD_SSE 0
+#define SIMD_AVX2 1
+#define SIMD_AVX512 2
+#define SIMD_LAST 3
+extern char *simdNames[SIMD_LAST];
+int ppSimdLevel();
+void processTilePP_SSE(particle_vectors pos, acc_vectors accel, int i0, int i1, int j0, int j1, float soft2, int physics);
+void processListPP_SSE(particle_vectors list, int n, float *pos, float *acc, float soft2, int physics);
+void processListQuadPP_SSE(quad_vectors list, int n, float *pos, float *acc, float soft2, int physics);
+
+// frame-pp_vector.c
+void processTilePP_Vector(particle_vectors pos, acc_vectors accel, int i0, int i1, int j0, int j1, float soft2, int physics);
 
 // frame-ot.c
 typedef struct node_s {
@@ -821,20 +1119,43 @@ typedef struct node_s {
     VectorNew(c);
     VectorNew(cm);
 
-    particle_t *p;
-    struct node_t *b[8];
     float mass;
     float length2;
+    float quad[6];          // quadrupole moment around cm: xx yy zz xy xz yz (if state.quadrupole)
+
+    int first;              // particles of this node: otIndex[first] .. otIndex[first+count-1]
+    int count;
+
+    int child;              // children sit next to each other in the node pool: child .. child+children-1
+    int children;
 
 } node_t;
 
+// the tree is shared with the FMM solver
+extern node_t *otNodes;
+extern int otNodesUsed;
+extern int *otIndex;
+
+node_t *otGetRoot();
 void otDrawTree();
 void otFreeTree();
-void processFrameOT(int,int);
+void otFreeMemory();
+void otBuildTree();
+int otPrepareGroups();
+void processFrameOT(int thread);
+void processPotentialOT(int thread, float *phi);
 void otDrawFieldRecursive(float *pos, node_t *node, float *force);
 
 // void frDoGravity(particle_t *p, node_t *n, float d);
 
+// frame-fmm.c
+int fmmPrepare(int threads);
+void fmmUpward(int thread);
+void fmmUpwardTop();
+int fmmActiveTargets();
+void processFrameFMM(int thread);
+void fmmFreeMemory();
+
 extern float fpsCurrentAverageFPS;
 extern float fpsCurrentAverageFT;
 void fpsInit();
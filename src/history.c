@@ -0,0 +1,1010 @@
+/*
+
+Gravit - A gravity simulator
+Copyright 2003-2005 Gerald Kaszuba
+
+Gravit is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+Gravit is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Gravit; if not, write to the Free Software
+Foundation, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+
+*/
+
+#include "gravit.h"
+#include <limits.h>
+
+#ifndef WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+
+
+/*  Particle history:
+    =================
+    By default, state.particleHistory is one calloc()ed block in memory.
+
+    With "historydisk" set (MB), it is a memory mapped file in SAVE_PATH
+    instead. The operating system keeps the frames that are used in memory
+    and writes the others to disk: recording only touches the frame that is
+    written, playback only the frames that are drawn. So a recording can be
+    much bigger than memory before frameCompression has to throw away
+    every other frame.
+
+    The file is only scratch space - it is deleted right away (UNIX) or
+    when it is closed (Windows). Use "save" to keep a recording. Its disk
+    space is reserved when it is made (historyReserve()): if the disk is
+    too full, the history gets fewer frames, instead of the recording
+    crashing when it gets there.
+
+    Loading a save maps the frames that are stored as they are straight
+    from the save file instead (historyMapFrames(), not on Windows): no
+    frame is read before it is drawn, and the file is mapped copy on write,
+    so frames written later only change the history, never the file. Frames
+    in a save are not right after each other - there is a chunk head in
+    between - so slots are historyStride bytes apart, not FRAMESIZE.
+
+    Compact history:
+    ================
+    With "historycompact" set, only every HISTORY_KEYFRAME-th frame is
+    kept as it is (particle_t, positions and velocities). The frames in
+    between only store positions, as 16 bit offsets from the position in
+    their keyframe, scaled per frame and axis:
+        pos = keyframe pos + q * scale
+    That is 6 instead of 24 bytes per particle, so about 3.5 times as many
+    frames fit into the same memory. Every frame can still be read on its
+    own, no other frames have to be decoded first. The error of a frame is
+    at most half a step (scale / 2) per axis when it is written, and does
+    not depend on the frames before it - but see historyMerge() below.
+    Velocities of these frames are estimated from the positions, which is
+    good enough for colouring. The last frame that was written is also kept
+    as it is (historyLast), so a recording always continues exactly.
+
+    Frames and slots:
+    =================
+    particleHistory is split into slots of one frame each, and historyMap
+    says which slot holds which frame. When the history is full,
+    historyCompress() keeps every second frame by handing the slots around
+    in historyMap - no frame is copied, so recording does not stall for
+    a while at multi GB histories. The slots of the dropped frames are
+    used for the next frames.
+
+    A compact history is split into groups of HISTORY_KEYFRAME slots, the
+    first one is the keyframe. New frames fill an empty group, slot by
+    slot. After historyCompress() every group is about half empty, and
+    the slots can only be reused for frames that are close to the keyframe.
+    So when no group is empty, historyMerge() moves the frames of one group
+    into the free slots of the group before it - that is half a group of
+    frames once every HISTORY_KEYFRAME recorded frames, instead of the
+    whole history at once. There are a few more slots than frames, for
+    the keyframes that stay around for the other frames in their group.
+
+    A moved frame is decoded and quantised again against the other
+    keyframe, which adds up to half a step of its new slot. The scale of
+    the new slot is usually coarser, as the frame is further away from
+    the earlier keyframe. A group is only a source for historyMerge()
+    while it lies behind the group being filled, so a frame moves at most
+    once between two historyCompress() calls: a frame that survived k
+    compressions is off by at most k + 1 half steps of the coarsest slot
+    it has been in. In practice frames move no more than twice before
+    they are dropped, and the error stays below 3 half steps (measured
+    over 20000 and 2000000 recorded frames).
+
+    Everything that reads the history goes through historyParticle(), and
+    new frames are written with historyWriteFrame() / historyCommitFrame().
+*/
+
+#define HISTORY_FILE "history.tmp"
+
+#define HISTORY_KEYFRAME 32
+#define HISTORY_KEYFRAME_SIZE ((size_t)sizeof(particle_t) * state.particleCount)
+// scale per axis (padded to 16 bytes), then x,y,z per particle. multiple of 8 bytes
+#define HISTORY_DELTA_SIZE ((16 + (size_t)sizeof(short) * 3 * state.particleCount + 7) & ~(size_t)7)
+#define HISTORY_GROUP_SIZE (HISTORY_KEYFRAME_SIZE + (HISTORY_KEYFRAME - 1) * HISTORY_DELTA_SIZE)
+#define HISTORY_Q_MAX 32767
+
+// a compact history needs a few groups to be worth it
+#define HISTORY_MIN_FRAMES (4 * HISTORY_KEYFRAME)
+
+// some decoded particles, so a few historyParticle() results can be used at the same time
+#define HISTORY_DECODED 8
+
+static int historyMapped = 0;       // 1: particleHistory is a mapped file
+static int historyDiskFull = 0;     // 1: the last historyMapFile() did not find the disk space
+static char *historyRegion = NULL;  // mapped: where the mapping starts, particleHistory can be a bit after it
+static size_t historyBytes = 0;
+static size_t historyStride = 0;    // uncompact: bytes from one slot to the next
+
+static int historyCompact = 0;      // 1: the allocated history is compact
+static particle_t *historyLast = NULL;  // compact: full copy of historyLastFrame
+static int historyLastFrame = -1;
+static particle_t historyDecoded[HISTORY_DECODED];
+static int historyDecodedNext = 0;
+
+static int *historyMap = NULL;          // frame -> slot, -1 if not recorded
+static int historySlots = 0;
+static int *historySlotFrame = NULL;    // compact: slot -> frame, -1 if free
+static int *historyGroupFrames = NULL;  // compact: frames in each group
+static int historyWriteGroup = -1;      // compact: group that new frames go to
+static int historyWriteSlot = 0;
+static particle_t *historyScratch = NULL;   // compact: a frame while it is moved
+
+#ifdef WIN32
+static HANDLE historyFile = INVALID_HANDLE_VALUE;
+static HANDLE historyMapping = NULL;
+#endif
+
+#ifndef WIN32
+/*
+ * make fd bytes long, with the disk space for all of it. A sparse file
+ * would only find out that the disk is full when a frame is written to
+ * it - and that kills the process (SIGBUS). returns 0 if there is no space
+ */
+static int historyReserve(int fd, size_t bytes) {
+
+#ifdef __APPLE__
+    fstore_t store;
+
+    memset(&store, 0, sizeof(store));
+    store.fst_flags = F_ALLOCATEALL;
+    store.fst_posmode = F_PEOFPOSMODE;
+    store.fst_offset = 0;
+    store.fst_length = (off_t)bytes;
+
+    if (fcntl(fd, F_PREALLOCATE, &store) == -1)
+        return 0;
+
+    return ftruncate(fd, (off_t)bytes) == 0;
+#else
+    return posix_fallocate(fd, 0, (off_t)bytes) == 0;
+#endif
+
+}
+#endif
+
+/*
+ * map a new file of the given size, filled with zeros.
+ * returns NULL if that did not work
+ */
+static particle_t *historyMapFile(size_t bytes) {
+
+    char *fileName;
+    void *p;
+
+    if (!checkHomePath())
+        return NULL;
+
+    mymkdir(SAVE_PATH);
+    fileName = va("%s/%s", SAVE_PATH, HISTORY_FILE);
+
+#ifdef WIN32
+    {
+        LARGE_INTEGER size;
+
+        size.QuadPart = (LONGLONG)bytes;
+
+        historyFile = CreateFile(fileName, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                                 FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+        if (historyFile == INVALID_HANDLE_VALUE) {
+            conAdd(LERR, "Could not create %s", fileName);
+            return NULL;
+        }
+
+        historyMapping = CreateFileMapping(historyFile, NULL, PAGE_READWRITE, size.HighPart, size.LowPart, NULL);
+        if (!historyMapping) {
+            conAdd(LERR, "Could not map %lu bytes of %s", (unsigned long)bytes, fileName);
+            CloseHandle(historyFile);
+            historyFile = INVALID_HANDLE_VALUE;
+            return NULL;
+        }
+
+        p = MapViewOfFile(historyMapping, FILE_MAP_ALL_ACCESS, 0, 0, bytes);
+        if (!p) {
+            conAdd(LERR, "Could not map %lu bytes of %s", (unsigned long)bytes, fileName);
+            CloseHandle(historyMapping);
+            CloseHandle(historyFile);
+            historyMapping = NULL;
+            historyFile = INVALID_HANDLE_VALUE;
+            return NULL;
+        }
+    }
+#else
+    {
+        int fd;
+
+        fd = open(fileName, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0) {
+            conAdd(LERR, "Could not create %s", fileName);
+            return NULL;
+        }
+
+        // nobody else needs to see it, the mapping keeps it alive
+        unlink(fileName);
+
+        if (!historyReserve(fd, bytes)) {
+            conAdd(LERR, "Not enough disk space for %lu bytes of history in %s", (unsigned long)bytes, fileName);
+            historyDiskFull = 1;
+            close(fd);
+            return NULL;
+        }
+
+        p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (p == MAP_FAILED) {
+            conAdd(LERR, "Could not map %lu bytes of %s", (unsigned long)bytes, fileName);
+            return NULL;
+        }
+    }
+#endif
+
+    return (particle_t *)p;
+
+}
+
+/*
+ * where slot starts in the history (bytes). compact: slots up to
+ * (not including) slot
+ */
+static size_t historyOffset(int compact, int slot) {
+
+    size_t group;
+    int k;
+
+    if (!compact)
+        return historyStride * slot;
+
+    group = (size_t)(slot / HISTORY_KEYFRAME);
+    k = slot % HISTORY_KEYFRAME;
+
+    if (!k)
+        return group * HISTORY_GROUP_SIZE;
+
+    return group * HISTORY_GROUP_SIZE + HISTORY_KEYFRAME_SIZE + (k - 1) * HISTORY_DELTA_SIZE;
+
+}
+
+#define historySlotData(slot) ((char *)state.particleHistory + historyOffset(historyCompact, (slot)))
+#define historyKeyframe(slot) ((particle_t *)historySlotData((slot) - (slot) % HISTORY_KEYFRAME))
+
+/*
+ * slots for frames frames. compact: whole groups, and enough of them that
+ * historyFreeGroup() always finds one, see "Frames and slots"
+ */
+static int historySlotsFor(int compact, int frames) {
+
+    if (!compact)
+        return frames;
+
+    return ((frames + 2 * HISTORY_KEYFRAME) / (HISTORY_KEYFRAME - 1) + 2) * HISTORY_KEYFRAME;
+
+}
+
+/*
+ * how many frames of state.particleCount particles fit into bytes, with
+ * the encoding that the next historyAlloc() will use
+ */
+int historyFramesFor(size_t bytes) {
+
+    size_t groups;
+    size_t frames;
+
+    if (state.particleCount < 1)
+        return 0;
+
+    if (state.historyCompact) {
+
+        // the inverse of historySlotsFor()
+        groups = bytes / HISTORY_GROUP_SIZE;
+
+        if (groups > 2 + HISTORY_MIN_FRAMES / (HISTORY_KEYFRAME - 1)) {
+
+            frames = (groups - 2) * (HISTORY_KEYFRAME - 1) - 2 * HISTORY_KEYFRAME;
+
+            if (frames > INT_MAX / 2)
+                frames = INT_MAX / 2;
+
+            if (frames >= HISTORY_MIN_FRAMES)
+                return (int)frames;
+
+        }
+
+        // not enough for a compact history, see historyAlloc()
+
+    }
+
+    frames = bytes / FRAMESIZE;
+
+    if (frames > INT_MAX)
+        frames = INT_MAX;
+
+    return (int)frames;
+
+}
+
+/*
+ * forget all frames but frame 0, which stays in slot 0
+ */
+static void historyReset() {
+
+    int i;
+
+    historyLastFrame = -1;
+
+    for (i = 0; i < state.historyFrames; i++)
+        historyMap[i] = historyCompact ? -1 : i;
+
+    if (!historyCompact)
+        return;
+
+    for (i = 0; i < historySlots; i++)
+        historySlotFrame[i] = -1;
+
+    for (i = 0; i < historySlots / HISTORY_KEYFRAME; i++)
+        historyGroupFrames[i] = 0;
+
+    historyMap[0] = 0;
+    historySlotFrame[0] = 0;
+    historyGroupFrames[0] = 1;
+
+    historyWriteGroup = 0;
+    historyWriteSlot = 1;
+
+}
+
+/*
+ * allocate state.particleHistory for state.historyFrames frames of
+ * state.particleCount particles, all zero. Goes to disk if state.historyDisk
+ * is set. returns 0 if there was not enough memory (or disk)
+ */
+int historyAlloc() {
+
+    size_t bytes;
+
+    historyFree();
+
+    // too short for a compact history, historyFramesFor() knows about this
+    historyCompact = (state.historyCompact && state.historyFrames >= HISTORY_MIN_FRAMES) ? 1 : 0;
+    historySlots = historySlotsFor(historyCompact, state.historyFrames);
+    historyStride = FRAMESIZE;
+    bytes = historyOffset(historyCompact, historySlots);
+
+    historyMap = (int *)malloc(sizeof(int) * (state.historyFrames + 1));
+    if (!historyMap)
+        return 0;
+
+    if (historyCompact) {
+
+        historyLast = (particle_t *)calloc(sizeof(particle_t), state.particleCount);
+        historyScratch = (particle_t *)calloc(sizeof(particle_t), state.particleCount);
+        historySlotFrame = (int *)malloc(sizeof(int) * historySlots);
+        historyGroupFrames = (int *)malloc(sizeof(int) * (historySlots / HISTORY_KEYFRAME));
+
+        if (!historyLast || !historyScratch || !historySlotFrame || !historyGroupFrames) {
+            historyFree();
+            return 0;
+        }
+
+    }
+
+    if (state.historyDisk > 0) {
+
+        historyDiskFull = 0;
+        state.particleHistory = historyMapFile(bytes);
+
+        // more than fits into memory too, initFrame() tries again with fewer frames
+        if (historyDiskFull) {
+            historyFree();
+            return 0;
+        }
+
+        if (state.particleHistory) {
+            historyMapped = 1;
+            historyRegion = (char *)state.particleHistory;
+            historyBytes = bytes;
+            historyReset();
+            return 1;
+        }
+
+    }
+
+    state.particleHistory = (particle_t *)calloc(1, bytes);
+
+    if (!state.particleHistory) {
+        historyFree();
+        return 0;
+    }
+
+    historyBytes = bytes;
+    historyReset();
+    return 1;
+
+}
+
+void historyFree() {
+
+    free(historyLast);
+    free(historyScratch);
+    free(historyMap);
+    free(historySlotFrame);
+    free(historyGroupFrames);
+    historyLast = NULL;
+    historyScratch = NULL;
+    historyMap = NULL;
+    historySlotFrame = NULL;
+    historyGroupFrames = NULL;
+    historyLastFrame = -1;
+    historySlots = 0;
+    historyWriteGroup = -1;
+    historyWriteSlot = 0;
+
+    if (!state.particleHistory)
+        return;
+
+    if (!historyMapped) {
+
+        free(state.particleHistory);
+
+    } else {
+
+#ifdef WIN32
+        UnmapViewOfFile(state.particleHistory);
+        CloseHandle(historyMapping);
+        CloseHandle(historyFile);
+        historyMapping = NULL;
+        historyFile = INVALID_HANDLE_VALUE;
+#else
+        munmap(historyRegion, historyBytes);
+#endif
+
+        historyMapped = 0;
+        historyRegion = NULL;
+
+    }
+
+    historyBytes = 0;
+    state.particleHistory = 0;
+
+}
+
+// 1 if particleHistory lives on disk
+int historyOnDisk() {
+
+    return historyMapped;
+
+}
+
+// bytes used by particleHistory
+size_t historySize() {
+
+    return historyBytes;
+
+}
+
+#ifndef WIN32
+static void historyAdvise(size_t start, size_t end) {
+
+    char *p = (char *)state.particleHistory + start;
+    size_t lead;
+
+    // particleHistory is only page aligned if it is not in a save file
+    lead = (size_t)(p - historyRegion) % (size_t)sysconf(_SC_PAGESIZE);
+
+    madvise(p - lead, end - start + lead, MADV_WILLNEED);
+
+}
+#endif
+
+/*
+ * hint that frame will be needed soon, so it can be read from disk while
+ * the current frame is drawn. does nothing if the history is in memory
+ */
+void historyPrefetch(int frame) {
+
+#ifndef WIN32
+    int slot;
+
+    if (!historyMapped || frame < 0 || frame >= state.historyFrames)
+        return;
+
+    slot = historyMap[frame];
+    if (slot < 0)
+        return;
+
+    historyAdvise(historyOffset(historyCompact, slot), historyOffset(historyCompact, slot + 1));
+
+    // a compact frame needs its keyframe too
+    if (historyCompact && slot % HISTORY_KEYFRAME) {
+        slot -= slot % HISTORY_KEYFRAME;
+        historyAdvise(historyOffset(1, slot), historyOffset(1, slot + 1));
+    }
+#endif
+
+}
+
+// 1 if the history is compact
+int historyIsCompact() {
+
+    return historyCompact;
+
+}
+
+// position of particle i in a compact slot
+static void historyDecodePos(int slot, int i, float *pos) {
+
+    particle_t *key;
+    float *scale;
+    short *q;
+
+    key = historyKeyframe(slot) + i;
+
+    if (!(slot % HISTORY_KEYFRAME)) {
+        VectorCopy(key->pos, pos);
+        return;
+    }
+
+    scale = (float *)historySlotData(slot);
+    q = (short *)(scale + 4) + 3 * i;
+
+    pos[0] = key->pos[0] + q[0] * scale[0];
+    pos[1] = key->pos[1] + q[1] * scale[1];
+    pos[2] = key->pos[2] + q[2] * scale[2];
+
+}
+
+/*
+ * store the particles of src in a compact slot: all of it in a keyframe,
+ * only the positions otherwise
+ */
+static void historyEncode(int slot, particle_t *src) {
+
+    particle_t *key;
+    float *scale;
+    short *q;
+    float max[3];
+    int i, k;
+
+    if (!(slot % HISTORY_KEYFRAME)) {
+        memcpy(historySlotData(slot), src, HISTORY_KEYFRAME_SIZE);
+        return;
+    }
+
+    key = historyKeyframe(slot);
+    scale = (float *)historySlotData(slot);
+    q = (short *)(scale + 4);
+
+    // biggest distance from the keyframe, per axis
+    VectorZero(max);
+    for (i = 0; i < state.particleCount; i++) {
+        for (k = 0; k < 3; k++) {
+            float d = (float)fabs(src[i].pos[k] - key[i].pos[k]);
+            if (d > max[k])
+                max[k] = d;
+        }
+    }
+
+    for (k = 0; k < 3; k++)
+        scale[k] = max[k] / HISTORY_Q_MAX;
+    scale[3] = 0;
+
+    for (i = 0; i < state.particleCount; i++) {
+        for (k = 0; k < 3; k++) {
+
+            float d = src[i].pos[k] - key[i].pos[k];
+
+            if (scale[k] > 0)
+                d = (float)floor(d / scale[k] + 0.5f);
+            else
+                d = 0;
+
+            if (d > HISTORY_Q_MAX) d = HISTORY_Q_MAX;
+            if (d < -HISTORY_Q_MAX) d = -HISTORY_Q_MAX;
+
+            q[i * 3 + k] = (short)d;
+
+        }
+    }
+
+}
+
+/*
+ * particle i of frame. Points into the history if possible, otherwise to
+ * one of HISTORY_DECODED decoded copies - so only the last few results stay
+ * valid. Only frame 0 (or an uncompact history) may be written to this way.
+ * Frames that have not been recorded read as all zero.
+ */
+particle_t *historyParticle(int frame, int i) {
+
+    particle_t *p;
+    int slot;
+    VectorNew(last);
+
+    slot = (frame >= 0 && frame < state.historyFrames) ? historyMap[frame] : -1;
+
+    if (slot >= 0) {
+
+        if (!historyCompact)
+            return (particle_t *)historySlotData(slot) + i;
+
+        if (frame == historyLastFrame)
+            return historyLast + i;
+
+        if (!(slot % HISTORY_KEYFRAME))
+            return historyKeyframe(slot) + i;
+
+    }
+
+    p = historyDecoded + historyDecodedNext;
+    historyDecodedNext = (historyDecodedNext + 1) % HISTORY_DECODED;
+
+    if (slot < 0) {
+        memset(p, 0, sizeof(particle_t));
+        return p;
+    }
+
+    historyDecodePos(slot, i, p->pos);
+
+    // velocity from the previous frame
+    historyDecodePos(historyMap[frame - 1], i, last);
+    VectorSub(p->pos, last, p->vel);
+    VectorDivide(p->vel, (float)state.historyNFrame, p->vel);
+
+    return p;
+
+}
+
+// frame is now stored in slot (compact)
+static void historyAssign(int frame, int slot) {
+
+    historyMap[frame] = slot;
+    historySlotFrame[slot] = frame;
+    historyGroupFrames[slot / HISTORY_KEYFRAME]++;
+
+}
+
+// frame is not stored anymore, its slot can be reused (compact)
+static void historyRelease(int frame) {
+
+    int slot;
+
+    slot = historyMap[frame];
+    if (slot < 0)
+        return;
+
+    historyMap[frame] = -1;
+    historySlotFrame[slot] = -1;
+    historyGroupFrames[slot / HISTORY_KEYFRAME]--;
+
+}
+
+// a free slot in group that is not its keyframe, or -1
+static int historyGroupSlot(int group) {
+
+    int slot;
+
+    for (slot = group * HISTORY_KEYFRAME + 1; slot < (group + 1) * HISTORY_KEYFRAME; slot++)
+        if (historySlotFrame[slot] < 0)
+            return slot;
+
+    return -1;
+
+}
+
+/*
+ * empty a group: go through the frames in order, and move the frames of
+ * each group into the free slots of the group before it. Every group
+ * stays a run of consecutive frames that are close to their keyframe.
+ * a moved frame is quantised again, which adds up to half a step of its
+ * new slot (see "Frames and slots" above).
+ * returns the empty group, or -1 if there was not enough space
+ */
+static int historyMerge() {
+
+    int into = -1;
+    int group = -1;
+    int frame, slot, g, i;
+
+    for (frame = 0; frame < state.historyFrames && historyMap[frame] >= 0; frame++) {
+
+        g = historyMap[frame] / HISTORY_KEYFRAME;
+
+        // new frames go there
+        if (g == historyWriteGroup)
+            break;
+
+        if (g == into)
+            continue;
+
+        // the first frame of the next group
+        if (g != group) {
+
+            group = g;
+
+            if (into < 0 && historyGroupSlot(g) >= 0) {
+                into = g;
+                continue;
+            }
+
+        }
+
+        // no free slots so far
+        if (into < 0)
+            continue;
+
+        slot = historyGroupSlot(into);
+
+        if (slot < 0) {
+            // full, the free slots of g (if any) are next
+            into = g;
+            continue;
+        }
+
+        for (i = 0; i < state.particleCount; i++)
+            historyDecodePos(historyMap[frame], i, historyScratch[i].pos);
+
+        historyEncode(slot, historyScratch);
+        historyRelease(frame);
+        historyAssign(frame, slot);
+
+        if (!historyGroupFrames[g])
+            return g;
+
+    }
+
+    return -1;
+
+}
+
+// an empty group for new frames, or -1
+static int historyFreeGroup() {
+
+    int g;
+
+    for (g = 0; g < historySlots / HISTORY_KEYFRAME; g++)
+        if (!historyGroupFrames[g] && g != historyWriteGroup)
+            return g;
+
+    return historyMerge();
+
+}
+
+/*
+ * buffer for a new frame. Fill in all particles, then call
+ * historyCommitFrame(frame). Frames have to be written in order, starting
+ * with frame 0.
+ */
+particle_t *historyWriteFrame(int frame) {
+
+    if (!historyCompact)
+        return (particle_t *)historySlotData(historyMap[frame]);
+
+    return historyLast;
+
+}
+
+void historyCommitFrame(int frame) {
+
+    int g;
+
+    if (!historyCompact)
+        return;
+
+    historyLastFrame = frame;
+
+    // a new recording, frame 0 is the keyframe in slot 0
+    if (!frame) {
+        historyReset();
+        historyLastFrame = 0;
+        historyEncode(0, historyLast);
+        return;
+    }
+
+    historyRelease(frame);
+
+    if (historyWriteGroup < 0 || historyWriteSlot >= (historyWriteGroup + 1) * HISTORY_KEYFRAME) {
+
+        historyWriteGroup = -1;
+        g = historyFreeGroup();
+
+        if (g < 0) {
+            conAdd(LERR, "No space left in the history for frame %i", frame);
+            return;
+        }
+
+        historyWriteGroup = g;
+        historyWriteSlot = g * HISTORY_KEYFRAME;
+
+    }
+
+    historyEncode(historyWriteSlot, historyLast);
+    historyAssign(frame, historyWriteSlot);
+    historyWriteSlot++;
+
+}
+
+/*
+ * keep every second frame: frame 2i becomes frame i, for i = 1 .. frames.
+ * Only the slots are handed around, no frame is copied
+ */
+void historyCompress(int frames) {
+
+    int slot;
+    int i;
+
+    if (!historyCompact) {
+
+        // frame i gets the slot of frame 2i, frame 2i the old slot of frame i
+        for (i = 1; i <= frames; i++) {
+            slot = historyMap[i];
+            historyMap[i] = historyMap[i * 2];
+            historyMap[i * 2] = slot;
+        }
+
+        return;
+
+    }
+
+    for (i = 1; i < state.historyFrames; i++)
+        if (i % 2 || i > frames * 2)
+            historyRelease(i);
+
+    for (i = 1; i <= frames; i++) {
+        slot = historyMap[i * 2];
+        historyMap[i * 2] = -1;
+        historyMap[i] = slot;
+        historySlotFrame[slot] = i;
+    }
+
+    if (historyLastFrame == frames * 2)
+        historyLastFrame = frames;
+    else
+        historyLastFrame = -1;
+
+}
+
+/*
+ * all particles of frame, as one array: straight from the history, or
+ * copied into buffer (state.particleCount particles) if it is compact
+ */
+particle_t *historyFrame(int frame, particle_t *buffer) {
+
+    int i;
+
+    if (!historyCompact)
+        return historyParticle(frame, 0);
+
+    for (i = 0; i < state.particleCount; i++)
+        memcpy(buffer + i, historyParticle(frame, i), sizeof(particle_t));
+
+    return buffer;
+
+}
+
+/*
+ * read frames 0 .. frames-1 from fileName, one particle_t array per frame
+ * (the .particles file of saves from before the .gravit format)
+ */
+int historyLoad(char *fileName, int frames) {
+
+    FILE *fp;
+    size_t bytes;
+    int f;
+
+    if (!historyCompact) {
+        // the file is the history as it is
+        if (historyMapFrames(fileName, 0, FRAMESIZE, frames))
+            return 1;
+        // frame f in slot f
+        historyReset();
+        bytes = FRAMESIZE * frames;
+        return LoadMemoryDump(fileName, (unsigned char *)state.particleHistory, bytes, 0) >= bytes;
+    }
+
+    fp = fopen(fileName, "rb");
+    if (!fp) {
+        conAdd(LNORM, "Count not open %s for reading.", fileName);
+        return 0;
+    }
+
+    for (f = 0; f < frames; f++) {
+
+        if (fread(historyWriteFrame(f), FRAMESIZE, 1, fp) != 1) {
+            conAdd(LERR, "Short read on %s (frame %i)", fileName, f);
+            fclose(fp);
+            return 0;
+        }
+
+        historyCommitFrame(f);
+
+    }
+
+    fclose(fp);
+
+    return 1;
+
+}
+
+/*
+ * make frames frames of fileName, frame i at offset + i * stride, the first
+ * frames of the history - without reading them, see "Particle history".
+ * The other frames start out as zeros. returns 0 if the history can not be
+ * mapped (compact, Windows), it stays as it is then
+ */
+int historyMapFrames(char *fileName, long long offset, size_t stride, int frames) {
+
+#ifdef WIN32
+    return 0;
+#else
+    struct stat st;
+    size_t page;
+    size_t lead;
+    size_t bytes;
+    size_t length;
+    char *region;
+    int *map;
+    int fd;
+
+    if (historyCompact || stride < FRAMESIZE || frames < 1 || frames > state.historyFrames)
+        return 0;
+
+    // the file has to start on a page
+    page = (size_t)sysconf(_SC_PAGESIZE);
+    lead = (size_t)(offset % (long long)page);
+    bytes = lead + stride * state.historyFrames;
+    length = lead + stride * (frames - 1) + FRAMESIZE;
+
+    fd = open(fileName, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    // past its end it would crash instead of reading zeros
+    if (fstat(fd, &st) != 0 || (long long)st.st_size < offset + (long long)(length - lead)) {
+        close(fd);
+        return 0;
+    }
+
+    map = (int *)malloc(sizeof(int) * (state.historyFrames + 1));
+
+    // zeros, then the file over the frames that are in it. Writing only changes the memory
+    region = (char *)mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (!map || region == MAP_FAILED || mmap(region, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, (off_t)(offset - lead)) == MAP_FAILED) {
+        conAdd(LLOW, "Could not map %s, reading it instead", fileName);
+        if (region != MAP_FAILED)
+            munmap(region, bytes);
+        free(map);
+        close(fd);
+        return 0;
+    }
+
+    close(fd);
+
+    // the rest of the last page is the next chunk, not the next frame
+    if (length % page)
+        memset(region + length, 0, page - length % page);
+
+    historyFree();
+
+    historyCompact = 0;
+    historySlots = state.historyFrames;
+    historyMap = map;
+    historyStride = stride;
+    historyMapped = 1;
+    historyRegion = region;
+    historyBytes = bytes;
+    state.particleHistory = (particle_t *)(region + lead);
+    historyReset();
+
+    return 1;
+#endif
+
+}
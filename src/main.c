@@ -42,6 +42,8 @@ void loadDefaults() {
 
     state.memoryAvailable = 0;
     state.memoryPercentage = 50;
+    state.historyDisk = 0;
+    state.historyCompact = 0;
 
 #ifndef NO_GUI
 
@@ -71,12 +73,10 @@ void loadDefaults() {
 
 void cleanMemory() {
 
-    if (state.particleHistory) {
+    // nothing may use the history after this
+    saveCancel();
 
-        free(state.particleHistory);
-        state.particleHistory = 0;
-
-    }
+    historyFree();
 
     if (state.particleDetail) {
 
@@ -85,6 +85,21 @@ void cleanMemory() {
 
     }
 
+    if (state.particleMerged) {
+
+        free(state.particleMerged);
+        state.particleMerged = 0;
+        state.particleMergedFrame = 0;
+        state.particleMass = 0;
+
+    }
+
+    wsFreeMemory();
+    colFreeMemory();
+    otFreeMemory();
+    ppFreeMemory();
+    fmmFreeMemory();
+
     state.memoryAllocated = 0;
 
 }
@@ -205,6 +220,7 @@ void stateInit() {
     state.dontExecuteDefaultScript = 0;
     state.autoSave = 0;
     state.lastSave = 0;
+    state.saveCompression = 1;
     state.autoRecord = 0;
     state.autoRecordNext = 0;
 
@@ -212,13 +228,29 @@ void stateInit() {
     state.g = -0.00001f;
 
     state.physics = PH_CLASSIC;
+    state.solver = SOLVER_AUTO;
+    state.integrator = INTEGRATOR_LEAPFROG;
+    state.fmmOrder = FMM_DEFAULT_ORDER;
+    state.theta = OT_DEFAULT_THETA;
+    state.quadrupole = 1;
+    state.timeSteps = 0;
+    state.timeStepAccuracy = TIMESTEP_DEFAULT_ACCURACY;
+    state.softening = SOFTENING_DEFAULT;
+    state.diagnostics = 0;
+    state.mixedPrecision = 0;
+    state.collisionRadius = 0;
 
 #ifdef _OPENMP
     state.processFrameThreads = omp_get_max_threads();
+#elif !defined(WIN32) || defined(USE_PTHREAD)
+    state.processFrameThreads = getProcessors();
 #else
     state.processFrameThreads = 1;
 #endif
 
+    // start the worker threads now, they wait for work between frames
+    poolStart(state.processFrameThreads);
+
     state.targetFrame = -1;
 }
 
@@ -266,6 +298,10 @@ int init(int argc, char *argv[]) {
                   state.processFrameThreads, omp_get_num_procs());
 #endif
 
+#ifdef HAVE_SSE
+    conAdd(LHELP, "vector unit: %s", simdNames[ppSimdLevel()]);
+#endif
+
 #ifndef NO_STDIO_REDIRECT
     // say hi (and keep stdout.txt alive on windows...)
     if(!view.useStdout && !view.screenSaver)
@@ -290,6 +326,7 @@ int init(int argc, char *argv[]) {
 void clean() {
 
     cleanMemory();
+    poolStop();
     freeFileName();
     cmdFree();
     conFree();
@@ -422,6 +459,9 @@ void run() {
         Uint32 ts;
         ts_before =  getMS();
 
+        // frames to or from a save in the background
+        saveUpdate(0);
+
         if (state.mode & SM_RECORD) {
 
             view.frameSkipCounter = 0;
@@ -436,7 +476,8 @@ void run() {
             view.deltaRecordFrame = ts - view.lastRecordFrame;
             view.lastRecordFrame = ts;
 
-            if (state.autoSave && (state.totalFrames - state.lastSave) >= state.autoSave) {
+            // while the last one is still being written, a new save would have to wait for it - try again later
+            if (state.autoSave && (state.totalFrames - state.lastSave) >= state.autoSave && saveProgress(NULL) != SAVE_SAVING) {
                 cmdSaveFrameDump(0);
                 state.lastSave = state.totalFrames;
             }
@@ -461,6 +502,9 @@ void run() {
                 view.frameSkipCounter = 0;
             }
 
+            // start reading the next frame, if the history is on disk
+            historyPrefetch(state.currentFrame + 1 + (view.frameSkip > 0 ? view.frameSkip : 0));
+
             //if (view.verboseMode)
             //    conAdd(LLOW, "P frame:%5i dt:%5i fs:%2i", state.currentFrame, view.deltaVideoFrame, state.historyNFrame);
 
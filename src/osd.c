@@ -35,6 +35,7 @@ void drawOSD() {
     float x;
     float y;
     float tab;
+    float saveDone;
 
     drawFrameSet2D();
     glEnable(GL_BLEND);
@@ -71,6 +72,15 @@ void drawOSD() {
             DUH("simulation name", "-");
         }
 
+        switch (saveProgress(&saveDone)) {
+        case SAVE_SAVING:
+            DUH("saving", va("%.0f%%", saveDone * 100));
+            break;
+        case SAVE_LOADING:
+            DUH("loading", va("%.0f%%", saveDone * 100));
+            break;
+        }
+
         DUH("particles", va("%i", state.particleCount));
 
         if (view.lastVideoFrameSkip == 0) {
@@ -93,11 +103,24 @@ void drawOSD() {
         }
         DUH("recorded frames", va("%i", state.frame));
         DUH("max frames", va("%i", state.historyFrames));
+        if (historyOnDisk()) {
+            DUH("history on disk", va("%.1fmb", (float)historySize() / 1024 / 1024));
+        }
         DUH("particle vertices", va("%i", view.vertices));
         
-#if NBODY_METHOD == METHOD_OT
-        DUH("tree nodes allocated", va("%i", view.recordNodes));
-#endif
+        DUH("solver", solverNames[getSolver()]);
+        DUH("integrator", integratorNames[getIntegrator()]);
+        if (state.timeSteps > 0 && getIntegrator() == INTEGRATOR_LEAPFROG) {
+            DUH("smallest time step", va("1/%i", 1 << workingSet.levelMax));
+        }
+        if (getSolver() == SOLVER_OT || getSolver() == SOLVER_FMM) {
+            DUH("tree nodes allocated", va("%i", view.recordNodes));
+        }
+        if (state.diagnostics > 0 && diagnostics.frame) {
+            DUH("energy", va("%.6g (drift %.2e)", diagnostics.kinetic + diagnostics.potential, diagnostics.drift));
+            DUH("momentum", va("%.4g %.4g %.4g", diagnostics.momentum[0], diagnostics.momentum[1], diagnostics.momentum[2]));
+            DUH("virial ratio", va("%.3f", diagnostics.virialRatio));
+        }
         
         DUH("memory allocated", va("%.1fmb", (float)state.memoryAllocated / 1024 / 1024));
         }
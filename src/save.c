@@ -0,0 +1,1970 @@
+/*
+
+Gravit - A gravity simulator
+Copyright 2003-2005 Gerald Kaszuba
+
+Gravit is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+Gravit is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Gravit; if not, write to the Free Software
+Foundation, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+
+*/
+
+// files bigger than 2 GB on 32 bit systems
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#include "gravit.h"
+
+#ifdef WIN32
+    // _commit()
+    #include <io.h>
+#endif
+
+/*  Save files:
+    ===========
+    A simulation is saved as one file, SAVE_PATH/name.gravit:
+
+        header      magic, version, byte order, where the newest index is
+        chunks      id, encoding, size, then the data
+
+    The chunks are:
+        INFO        saveInfo_t (frames, view, physics)
+        DETL        saveDetail_t of every particle (mass and colour)
+        MERG        state.particleMerged, then state.particleMergedFrame,
+                    see "collisionradius"
+        FRAM        one frame: its number, then particle_t of every particle
+        INDX        saveIndex_t, then the offsets of the FRAM chunks it adds
+
+    A save only ever adds chunks to the end of the file. If the file
+    already holds the first frames of the same recording, only the new
+    frames are written, with a new INFO/DETL/MERG and an INDX for them that
+    points back to the INDX before it. The header is written last, so a
+    save that does not finish leaves the old state of the file readable.
+    The new chunks are on the disk (fsync) before the header points to them,
+    and DETL and MERG are only written again if they changed. That way an
+    autosave (see "saveauto") costs about as much as the frames it adds, not
+    the whole recording.
+    Loading reads the INDX chain and then seeks to every FRAM it needs,
+    no other frame has to be read first. Uncompressed frames right after
+    each other are not read at all, they are mapped as the history (see
+    "Particle history" in history.c).
+
+    Compression:
+    ============
+    With "savecompression" set, FRAM chunks are SAVE_PACKED encoded, and
+    still lossless. Floats hardly compress as they are, but a particle moves
+    only a little from one frame to the next. So every float (its bits, as
+    a 32 bit integer) is predicted from the same float in the frames
+    before - a keyframe (every SAVE_KEYFRAME frames, and the first frame of
+    each save) from nothing, the frame after it from the keyframe, the
+    others by going on in a straight line from the last two - and only the
+    difference is kept, with its sign in the lowest bit so that small
+    differences are small numbers. The differences are split into byte
+    planes - byte k of float w of every particle - in blocks of
+    SAVE_BLOCK_PARTICLES, and each block is stored as it is, run length
+    encoded or Huffman coded, whatever is smallest. Blocks are packed and
+    unpacked on their own, all at the same time: the thread of the save
+    job and its helpers (saveWorkers_t), "processors" of them, or one less
+    while recording so that the simulation is not slowed down.
+    After the frame head come saveCodecHead_t, the packed size of every
+    block, then the blocks. A frame can still be read on its own, by
+    unpacking the frames from its keyframe on - loading reads them in order
+    anyway. How much smaller a frame gets depends on how much the particles
+    move, usually between a third and a half.
+
+    Readers take the part of a chunk they know (INFO can grow at the end),
+    and skip chunks they do not know. The byte order is that of the machine
+    that wrote the file, other machines refuse it.
+    Saves from before this format (name.info, name.particledetail and
+    name.particles) can still be loaded, see cmdLoadFrameDump().
+*/
+
+/*  Saving and loading in the background:
+    =====================================
+    saveWrite() and saveRead() only start a job, a thread does the file
+    I/O while recording and drawing go on. The frames go through
+    a few frame buffers: when saving, the main thread copies the
+    next frames of the history into free buffers and the thread writes
+    them, when loading, the thread reads frames into the buffers and the
+    main thread moves them into the history. saveUpdate() is the main
+    thread's part, run() calls it every time around.
+
+    So a save is of the frames as they were when it was started - recording
+    only adds new frames after them. Compressing the history renumbers the
+    frames, that waits for the save to finish (saveFinish()), and so does
+    recording while frames are still being loaded. saveCancel() stops a
+    load, before the history is freed.
+*/
+
+#define SAVE_MAGIC "GRAVITSV"
+#define SAVE_VERSION 1
+#define SAVE_BYTE_ORDER 0x01020304
+
+typedef struct saveHeader_s {
+
+    char magic[8];          // SAVE_MAGIC
+    int version;            // SAVE_VERSION of the writer
+    int byteOrder;          // SAVE_BYTE_ORDER, as the writer sees it
+    long long index;        // newest INDX chunk, 0: not written yet
+
+} saveHeader_t;
+
+typedef struct saveChunk_s {
+
+    char id[4];
+    int encoding;           // SAVE_RAW or SAVE_PACKED (FRAM only)
+    long long size;         // bytes of data after this
+
+} saveChunk_t;
+
+typedef struct saveIndex_s {
+
+    long long previous;     // INDX chunk of the frames before first, 0: none
+    long long info;         // the INFO, DETL and MERG chunks of this save
+    long long detail;
+    long long merged;       // 0: nothing merged
+    int first;              // first frame of this save
+    int count;              // frames of this save, count offsets follow
+
+} saveIndex_t;
+
+typedef struct saveFrame_s {
+
+    int frame;
+    int particleCount;
+
+} saveFrame_t;
+
+#define SAVE_RAW 0
+#define SAVE_PACKED 1
+
+#define SAVE_KEYFRAME 32
+#define SAVE_BLOCK_PARTICLES 65536
+#define SAVE_WORDS ((int)(sizeof(particle_t) / sizeof(unsigned int)))
+// each thread packs or unpacks at least this much of a frame
+#define SAVE_CODEC_BYTES (1024 * 1024)
+
+// first byte of a packed block
+#define SAVE_BLOCK_RAW 0
+#define SAVE_BLOCK_RUNS 1
+#define SAVE_BLOCK_HUFFMAN 2
+
+#define SAVE_HUFFMAN_BITS 11
+// smaller blocks do not make up for the 128 bytes of code lengths
+#define SAVE_HUFFMAN_MIN 512
+
+// after saveFrame_t of a SAVE_PACKED frame
+typedef struct saveCodecHead_s {
+
+    int order;              // predicted from the 0 (keyframe), 1 or 2 frames before
+    int blocks;             // then the packed size of each block
+
+} saveCodecHead_t;
+
+#define SAVE_PACK 0
+#define SAVE_UNPACK 1
+#define SAVE_PREDICT 2
+
+struct saveCodec_s;
+
+/*
+ * threads that help the thread of a save job with the blocks of every
+ * frame. Started with the first frame that is worth it and kept until the
+ * job ends, they sleep between the passes (like the thread pool in frame.c,
+ * which belongs to the main thread)
+ */
+typedef struct saveWorkers_s {
+
+    int threads;            // "processors" when the job started
+    int ready;              // 1: mutex and conditions are set up
+    int started;            // 1: the threads have been started
+    pthread_t thread[MAX_THREADS];
+    int count;              // threads running, not counting the job's own one
+    int recording;          // SM_RECORD is set, one processor less (set by saveUpdate())
+    struct saveCodec_s *codec;
+    int generation;         // counts the passes
+    int active;             // threads that work on this pass
+    int joined;             // and how many of them have started
+    int busy;               // that have not finished yet
+    int quit;
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+
+} saveWorkers_t;
+
+// packing or unpacking one frame, a block at a time
+typedef struct saveCodec_s {
+
+    unsigned int *frame;            // the particles, as 32 bit words
+    unsigned int *previous;         // the frame before, and the one before that
+    unsigned int *previous2;
+    int order;
+    int particleCount;
+    unsigned char *packed;
+    long long *start;               // where each block starts in packed
+    int *size;                      // and how big it is
+    int blocks;
+    int unpack;                     // 0: frame -> packed, 1: packed -> frame
+    int failed;
+
+    saveWorkers_t *workers;         // NULL: only the calling thread
+    int pass;                       // SAVE_PACK, SAVE_UNPACK or SAVE_PREDICT
+    int work;                       // blocks, or ranges of particles for SAVE_PREDICT
+    int next;                       // next one to do
+    pthread_mutex_t mutex;
+
+} saveCodec_t;
+
+#ifdef WIN32
+#define saveSeek(fp, offset) _fseeki64(fp, (__int64)(offset), SEEK_SET)
+#define saveSeekEnd(fp) _fseeki64(fp, 0, SEEK_END)
+#define saveTell(fp) ((long long)_ftelli64(fp))
+#define saveFlushDisk(fp) _commit(_fileno(fp))
+#else
+#define saveSeek(fp, offset) fseeko(fp, (off_t)(offset), SEEK_SET)
+#define saveSeekEnd(fp) fseeko(fp, 0, SEEK_END)
+#define saveTell(fp) ((long long)ftello(fp))
+#define saveFlushDisk(fp) fsync(fileno(fp))
+#endif
+
+// everything written to fp so far is on the disk. returns 0 if not
+static int saveSync(FILE *fp) {
+
+    if (fflush(fp) != 0)
+        return 0;
+
+    return saveFlushDisk(fp) == 0;
+
+}
+
+/*
+ * append a chunk at the current position: head (headSize bytes) and data
+ * (size bytes) after each other. returns its offset, -1 if writing failed
+ */
+static long long saveWriteChunk(FILE *fp, const char *id, int encoding, void *head, size_t headSize, void *data, size_t size) {
+
+    saveChunk_t c;
+    long long offset;
+
+    offset = saveTell(fp);
+    if (offset < 0)
+        return -1;
+
+    memcpy(c.id, id, 4);
+    c.encoding = encoding;
+    c.size = (long long)(headSize + size);
+
+    if (fwrite(&c, sizeof(c), 1, fp) != 1)
+        return -1;
+    if (headSize && fwrite(head, headSize, 1, fp) != 1)
+        return -1;
+    if (size && fwrite(data, size, 1, fp) != 1)
+        return -1;
+
+    return offset;
+
+}
+
+// residual of word (particle * SAVE_WORDS + float) against its prediction, zigzag coded
+static unsigned int saveResidual(saveCodec_t *c, size_t word) {
+
+    unsigned int r = c->frame[word];
+
+    if (c->order == 1)
+        r -= c->previous[word];
+    else if (c->order == 2)
+        r -= 2 * c->previous[word] - c->previous2[word];
+
+    // small negative numbers become small numbers too
+    return (r << 1) ^ (0u - (r >> 31));
+
+}
+
+/*
+ * run length encode count bytes. A token below 128 is followed by token + 1
+ * bytes as they are, a token t from 128 on by one byte that repeats t - 125
+ * times. returns the size in out, at most SAVE_RUNS_BOUND(count)
+ */
+#define SAVE_RUNS_BOUND(count) ((count) + (count) / 128 + 1)
+
+static int savePackRuns(const unsigned char *src, int count, unsigned char *out) {
+
+    int o = 0;
+    int i = 0;
+    int start;
+    int run;
+
+    while (i < count) {
+
+        run = 1;
+        while (i + run < count && run < 130 && src[i + run] == src[i])
+            run++;
+
+        if (run >= 3) {
+            out[o++] = (unsigned char)(run + 125);
+            out[o++] = src[i];
+            i += run;
+            continue;
+        }
+
+        // up to the next run of three
+        start = i;
+        while (i < count && i - start < 128) {
+            if (i + 2 < count && src[i] == src[i + 1] && src[i] == src[i + 2])
+                break;
+            i++;
+        }
+
+        out[o++] = (unsigned char)(i - start - 1);
+        memcpy(out + o, src + start, i - start);
+        o += i - start;
+
+    }
+
+    return o;
+
+}
+
+// the other way round. returns 0 if in is broken
+static int saveUnpackRuns(const unsigned char *in, int size, int count, unsigned char *dst) {
+
+    int i = 0;
+    int n;
+
+    while (size > 0) {
+
+        if (*in < 128) {
+            n = *in + 1;
+            if (n > size - 1 || i + n > count)
+                return 0;
+            memcpy(dst + i, in + 1, n);
+            in += n + 1;
+            size -= n + 1;
+        } else {
+            n = *in - 125;
+            if (size < 2 || i + n > count)
+                return 0;
+            memset(dst + i, in[1], n);
+            in += 2;
+            size -= 2;
+        }
+
+        i += n;
+
+    }
+
+    return i == count;
+
+}
+
+/*
+ * Huffman code lengths for the byte frequencies freq, none longer than
+ * SAVE_HUFFMAN_BITS. 0 for bytes that do not occur
+ */
+static void saveHuffmanLengths(const unsigned int *freq, unsigned char *length) {
+
+    unsigned int f[256];
+    unsigned int weight[511];
+    int parent[511];
+    int alive[511];
+    int leaf[256];
+    int nodes;
+    int leaves;
+    int longest;
+    int depth;
+    int a;
+    int b;
+    int i;
+
+    for (i = 0; i < 256; i++)
+        f[i] = freq[i];
+
+    while (1) {
+
+        memset(length, 0, 256);
+
+        for (i = 0, nodes = 0; i < 256; i++) {
+            leaf[i] = -1;
+            if (f[i]) {
+                leaf[i] = nodes;
+                weight[nodes] = f[i];
+                parent[nodes] = -1;
+                alive[nodes] = 1;
+                nodes++;
+            }
+        }
+
+        leaves = nodes;
+        if (leaves < 2) {
+            for (i = 0; i < 256; i++)
+                if (leaf[i] >= 0)
+                    length[i] = 1;
+            return;
+        }
+
+        // join the two lightest nodes, until there is only one
+        while (nodes < 2 * leaves - 1) {
+
+            a = b = -1;
+            for (i = 0; i < nodes; i++) {
+                if (!alive[i])
+                    continue;
+                if (a < 0 || weight[i] < weight[a]) {
+                    b = a;
+                    a = i;
+                } else if (b < 0 || weight[i] < weight[b]) {
+                    b = i;
+                }
+            }
+
+            weight[nodes] = weight[a] + weight[b];
+            parent[nodes] = -1;
+            alive[nodes] = 1;
+            parent[a] = parent[b] = nodes;
+            alive[a] = alive[b] = 0;
+            nodes++;
+
+        }
+
+        longest = 0;
+        for (i = 0; i < 256; i++) {
+            if (leaf[i] < 0)
+                continue;
+            for (depth = 0, a = leaf[i]; parent[a] >= 0; a = parent[a])
+                depth++;
+            length[i] = (unsigned char)depth;
+            if (depth > longest)
+                longest = depth;
+        }
+
+        if (longest <= SAVE_HUFFMAN_BITS)
+            return;
+
+        // too long, even out the frequencies and try again
+        for (i = 0; i < 256; i++)
+            if (f[i])
+                f[i] = (f[i] >> 1) | 1;
+
+    }
+
+}
+
+/*
+ * canonical codes for length, bit reversed as they are written from the
+ * lowest bit on. returns 0 if the lengths are not a prefix code
+ */
+static int saveHuffmanCodes(const unsigned char *length, unsigned int *code) {
+
+    int count[SAVE_HUFFMAN_BITS + 1];
+    unsigned int next[SAVE_HUFFMAN_BITS + 1];
+    unsigned int c;
+    unsigned int r;
+    int space = 1 << SAVE_HUFFMAN_BITS;
+    int i;
+    int l;
+
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < 256; i++) {
+        if (length[i] > SAVE_HUFFMAN_BITS)
+            return 0;
+        if (length[i]) {
+            count[length[i]]++;
+            space -= 1 << (SAVE_HUFFMAN_BITS - length[i]);
+        }
+    }
+
+    if (space < 0)
+        return 0;
+
+    for (l = 1, c = 0; l <= SAVE_HUFFMAN_BITS; l++) {
+        c = (c + (l > 1 ? count[l - 1] : 0)) << 1;
+        next[l] = c;
+    }
+
+    for (i = 0; i < 256; i++) {
+        if (!length[i])
+            continue;
+        c = next[length[i]]++;
+        for (r = 0, l = 0; l < length[i]; l++, c >>= 1)
+            r = (r << 1) | (c & 1);
+        code[i] = r;
+    }
+
+    return 1;
+
+}
+
+// count bytes with the codes of length: 128 bytes of lengths, then the codes. returns the size
+static int savePackHuffman(const unsigned char *src, int count, const unsigned char *length, unsigned char *out) {
+
+    unsigned int code[256];
+    unsigned long long bits = 0;
+    int n = 0;
+    int o;
+    int i;
+
+    for (i = 0; i < 128; i++)
+        out[i] = (unsigned char)(length[i * 2] | (length[i * 2 + 1] << 4));
+    o = 128;
+
+    saveHuffmanCodes(length, code);
+
+    for (i = 0; i < count; i++) {
+        bits |= (unsigned long long)code[src[i]] << n;
+        n += length[src[i]];
+        while (n >= 8) {
+            out[o++] = (unsigned char)bits;
+            bits >>= 8;
+            n -= 8;
+        }
+    }
+
+    if (n)
+        out[o++] = (unsigned char)bits;
+
+    return o;
+
+}
+
+// the other way round. returns 0 if in is broken
+static int saveUnpackHuffman(const unsigned char *in, int size, int count, unsigned char *dst) {
+
+    unsigned char length[256];
+    unsigned int code[256];
+    unsigned short table[1 << SAVE_HUFFMAN_BITS];
+    unsigned long long bits = 0;
+    int n = 0;
+    int o = 128;
+    int e;
+    int i;
+
+    if (size < 128)
+        return 0;
+
+    for (i = 0; i < 256; i++)
+        length[i] = (in[i / 2] >> ((i & 1) * 4)) & 15;
+
+    if (!saveHuffmanCodes(length, code))
+        return 0;
+
+    // every SAVE_HUFFMAN_BITS bits that start with a code: its byte and length
+    memset(table, 0, sizeof(table));
+    for (i = 0; i < 256; i++)
+        if (length[i])
+            for (e = code[i]; e < (1 << SAVE_HUFFMAN_BITS); e += 1 << length[i])
+                table[e] = (unsigned short)((i << 4) | length[i]);
+
+    for (i = 0; i < count; i++) {
+
+        while (n <= 56 && o < size) {
+            bits |= (unsigned long long)in[o++] << n;
+            n += 8;
+        }
+
+        e = table[bits & ((1 << SAVE_HUFFMAN_BITS) - 1)];
+        if (!(e & 15) || (e & 15) > n)
+            return 0;
+
+        dst[i] = (unsigned char)(e >> 4);
+        bits >>= e & 15;
+        n -= e & 15;
+
+    }
+
+    return 1;
+
+}
+
+// how many blocks a frame of particleCount particles is split into
+static int saveBlocks(int particleCount) {
+
+    return (int)sizeof(particle_t) * ((particleCount + SAVE_BLOCK_PARTICLES - 1) / SAVE_BLOCK_PARTICLES);
+
+}
+
+/*
+ * block b of c: byte b % 4 of the residuals of float b / 4 % SAVE_WORDS, for
+ * its range of particles. Unpacking leaves the residual bytes in the frame,
+ * saveCodecPredict() turns them into floats after all blocks are done
+ */
+static void saveCodecBlock(saveCodec_t *c, int b) {
+
+    unsigned char plane[SAVE_BLOCK_PARTICLES];
+    unsigned int freq[256];
+    unsigned char length[256];
+    unsigned char *out = c->packed + c->start[b];
+    unsigned char *bytes = (unsigned char *)c->frame;
+    int first = b / (int)sizeof(particle_t) * SAVE_BLOCK_PARTICLES;
+    int count = c->particleCount - first < SAVE_BLOCK_PARTICLES ? c->particleCount - first : SAVE_BLOCK_PARTICLES;
+    int w = b / 4 % SAVE_WORDS;
+    int k = b % 4;
+    size_t word = (size_t)first * SAVE_WORDS + w;
+    long long bits;
+    int size;
+    int i;
+
+    if (c->pass == SAVE_UNPACK) {
+
+        size = c->size[b] - 1;
+        if (size < 0
+            || (out[0] == SAVE_BLOCK_RAW && (size != count || !memcpy(plane, out + 1, count)))
+            || (out[0] == SAVE_BLOCK_RUNS && !saveUnpackRuns(out + 1, size, count, plane))
+            || (out[0] == SAVE_BLOCK_HUFFMAN && !saveUnpackHuffman(out + 1, size, count, plane))
+            || out[0] > SAVE_BLOCK_HUFFMAN) {
+            c->failed = 1;
+            return;
+        }
+
+        for (i = 0; i < count; i++)
+            bytes[(word + (size_t)i * SAVE_WORDS) * 4 + k] = plane[i];
+
+        return;
+
+    }
+
+    memset(freq, 0, sizeof(freq));
+    for (i = 0; i < count; i++) {
+        plane[i] = (unsigned char)(saveResidual(c, word + (size_t)i * SAVE_WORDS) >> (k * 8));
+        freq[plane[i]]++;
+    }
+
+    out[0] = SAVE_BLOCK_RUNS;
+    c->size[b] = 1 + savePackRuns(plane, count, out + 1);
+
+    if (count >= SAVE_HUFFMAN_MIN) {
+
+        saveHuffmanLengths(freq, length);
+        for (i = 0, bits = 0; i < 256; i++)
+            bits += (long long)freq[i] * length[i];
+
+        if (1 + 128 + (bits + 7) / 8 < c->size[b]) {
+            out[0] = SAVE_BLOCK_HUFFMAN;
+            c->size[b] = 1 + savePackHuffman(plane, count, length, out + 1);
+        }
+
+    }
+
+    if (c->size[b] > 1 + count) {
+        out[0] = SAVE_BLOCK_RAW;
+        memcpy(out + 1, plane, count);
+        c->size[b] = 1 + count;
+    }
+
+}
+
+// unpacking, after all blocks: the residual bytes of the particles of range r become floats
+static void saveCodecPredict(saveCodec_t *c, int r) {
+
+    unsigned char *bytes = (unsigned char *)c->frame;
+    size_t word = (size_t)r * SAVE_BLOCK_PARTICLES * SAVE_WORDS;
+    size_t end = word + (size_t)SAVE_BLOCK_PARTICLES * SAVE_WORDS;
+    unsigned char *z;
+    unsigned int x;
+
+    if (end > (size_t)c->particleCount * SAVE_WORDS)
+        end = (size_t)c->particleCount * SAVE_WORDS;
+
+    for (; word < end; word++) {
+
+        z = bytes + word * 4;
+        x = z[0] | ((unsigned int)z[1] << 8) | ((unsigned int)z[2] << 16) | ((unsigned int)z[3] << 24);
+        x = (x >> 1) ^ (0u - (x & 1));
+
+        if (c->order == 1)
+            x += c->previous[word];
+        else if (c->order == 2)
+            x += 2 * c->previous[word] - c->previous2[word];
+
+        c->frame[word] = x;
+
+    }
+
+}
+
+static void saveCodecThread(saveCodec_t *c) {
+
+    int b;
+
+    while (1) {
+
+        pthread_mutex_lock(&c->mutex);
+        b = c->next++;
+        pthread_mutex_unlock(&c->mutex);
+
+        if (b >= c->work)
+            break;
+
+        if (c->pass == SAVE_PREDICT)
+            saveCodecPredict(c, b);
+        else
+            saveCodecBlock(c, b);
+
+    }
+
+}
+
+static void *saveWorker(void *arg) {
+
+    saveWorkers_t *w = (saveWorkers_t *)arg;
+    int generation = 0;
+
+    pthread_mutex_lock(&w->mutex);
+
+    for (;;) {
+
+        while (generation == w->generation && !w->quit)
+            pthread_cond_wait(&w->wake, &w->mutex);
+
+        if (w->quit)
+            break;
+
+        generation = w->generation;
+
+        // not needed for this pass
+        if (w->joined >= w->active)
+            continue;
+
+        w->joined++;
+        pthread_mutex_unlock(&w->mutex);
+
+        saveCodecThread(w->codec);
+
+        pthread_mutex_lock(&w->mutex);
+        if (--w->busy == 0)
+            pthread_cond_signal(&w->done);
+
+    }
+
+    pthread_mutex_unlock(&w->mutex);
+    return NULL;
+
+}
+
+// main thread, before the job starts
+static void saveInitWorkers(saveWorkers_t *w) {
+
+    w->threads = state.processFrameThreads;
+    w->recording = (state.mode & SM_RECORD) != 0;
+    pthread_mutex_init(&w->mutex, NULL);
+    pthread_cond_init(&w->wake, NULL);
+    pthread_cond_init(&w->done, NULL);
+    w->ready = 1;
+
+}
+
+// the job's thread: start one thread less than w->threads
+static void saveStartWorkers(saveWorkers_t *w) {
+
+    int n = w->threads < MAX_THREADS ? w->threads : MAX_THREADS;
+
+    w->started = 1;
+
+    for (w->count = 0; w->count < n - 1; w->count++)
+        if (pthread_create(&w->thread[w->count], NULL, saveWorker, (void *)w))
+            break;
+
+}
+
+// main thread, after the job's thread has finished
+static void saveStopWorkers(saveWorkers_t *w) {
+
+    int i;
+
+    if (!w->ready)
+        return;
+
+    pthread_mutex_lock(&w->mutex);
+    w->quit = 1;
+    pthread_cond_broadcast(&w->wake);
+    pthread_mutex_unlock(&w->mutex);
+
+    for (i = 0; i < w->count; i++)
+        pthread_join(w->thread[i], NULL);
+
+    pthread_mutex_destroy(&w->mutex);
+    pthread_cond_destroy(&w->wake);
+    pthread_cond_destroy(&w->done);
+    w->ready = 0;
+    w->started = 0;
+    w->count = 0;
+
+}
+
+/*
+ * do one pass of c, with the calling thread and as many of c->workers as
+ * pay off. returns 0 if unpacking found a broken block
+ */
+static int saveCodecPass(saveCodec_t *c, int pass) {
+
+    saveWorkers_t *w = c->workers;
+    size_t bytes = sizeof(particle_t) * c->particleCount;
+    int n = 0;
+
+    c->pass = pass;
+    c->work = pass == SAVE_PREDICT ? c->blocks / (int)sizeof(particle_t) : c->blocks;
+    c->next = 0;
+
+    pthread_mutex_init(&c->mutex, NULL);
+
+    // threads only pay off for big frames
+    if (w && w->ready && w->threads > 1 && bytes >= SAVE_CODEC_BYTES && c->work > 1) {
+
+        if (!w->started)
+            saveStartWorkers(w);
+
+        pthread_mutex_lock(&w->mutex);
+
+        // while recording, the simulation keeps one processor to itself
+        n = w->threads - 1 - (w->recording ? 1 : 0);
+        if (n > w->count)
+            n = w->count;
+        if (n > (int)(bytes / SAVE_CODEC_BYTES))
+            n = (int)(bytes / SAVE_CODEC_BYTES);
+        if (n > c->work - 1)
+            n = c->work - 1;
+
+        if (n > 0) {
+            w->codec = c;
+            w->active = w->busy = n;
+            w->joined = 0;
+            w->generation++;
+            pthread_cond_broadcast(&w->wake);
+        }
+
+        pthread_mutex_unlock(&w->mutex);
+
+    }
+
+    saveCodecThread(c);
+
+    if (n > 0) {
+        pthread_mutex_lock(&w->mutex);
+        while (w->busy)
+            pthread_cond_wait(&w->done, &w->mutex);
+        pthread_mutex_unlock(&w->mutex);
+    }
+
+    pthread_mutex_destroy(&c->mutex);
+
+    return !c->failed;
+
+}
+
+// pack c->frame into c->packed, or the other way round
+static int saveCodecRun(saveCodec_t *c) {
+
+    c->failed = 0;
+
+    if (!c->unpack)
+        return saveCodecPass(c, SAVE_PACK);
+
+    return saveCodecPass(c, SAVE_UNPACK) && saveCodecPass(c, SAVE_PREDICT);
+
+}
+
+/*
+ * report an error of f. The thread can not use the console, so in the
+ * background it is only kept in f->error for saveUpdate()
+ */
+static void saveError(saveFile_t *f, char *format, ...) {
+
+    char s[sizeof(f->error)];
+    va_list ap;
+
+    // file names can be long, and nobody would notice on the thread
+    va_start(ap, format);
+    vsnprintf(s, sizeof(s), format, ap);
+    va_end(ap);
+    s[sizeof(s) - 1] = 0;
+
+    memcpy(f->error, s, sizeof(f->error));
+
+    if (!f->background)
+        conAdd(LERR, "%s", s);
+
+}
+
+/*
+ * seek to the chunk at offset, which has to be an id chunk. Leaves the
+ * file at the start of its data. returns 0 if it is not there
+ */
+static int saveFindChunk(saveFile_t *f, long long offset, const char *id, saveChunk_t *c) {
+
+    if (offset <= 0 || saveSeek(f->fp, offset) != 0 || fread(c, sizeof(*c), 1, f->fp) != 1) {
+        saveError(f, "%s: could not read the %.4s chunk", f->fileName, id);
+        return 0;
+    }
+
+    if (memcmp(c->id, id, 4) || c->size < 0) {
+        saveError(f, "%s: expected a %.4s chunk at %lu", f->fileName, id, (unsigned long)offset);
+        return 0;
+    }
+
+    if (c->encoding != SAVE_RAW && (c->encoding != SAVE_PACKED || memcmp(id, "FRAM", 4))) {
+        saveError(f, "%s: %.4s chunk with unknown encoding %i", f->fileName, id, c->encoding);
+        return 0;
+    }
+
+    return 1;
+
+}
+
+void saveClose(saveFile_t *f) {
+
+    if (f->fp)
+        fclose(f->fp);
+
+    free(f->frame);
+    free(f->previous);
+    free(f->previous2);
+    free(f->packed);
+    memset(f, 0, sizeof(*f));
+
+}
+
+/*
+ * open fileName and read its header, index and INFO chunk.
+ * returns 0 if it is not a save file that can be read (quiet if the file
+ * does not exist)
+ */
+int saveOpen(saveFile_t *f, char *fileName) {
+
+    saveHeader_t h;
+    saveIndex_t idx;
+    saveChunk_t c;
+    long long offset;
+    long long last;
+    long long info;
+    int i;
+
+    memset(f, 0, sizeof(*f));
+    strncpy(f->fileName, fileName, sizeof(f->fileName) - 1);
+    f->previousFrame = -1;
+    f->previous2Frame = -1;
+
+    f->fp = fopen(fileName, "rb");
+    if (!f->fp)
+        return 0;
+
+    if (fread(&h, sizeof(h), 1, f->fp) != 1 || memcmp(h.magic, SAVE_MAGIC, 8)) {
+        conAdd(LERR, "%s is not a gravit save file", fileName);
+        saveClose(f);
+        return 0;
+    }
+
+    if (h.byteOrder != SAVE_BYTE_ORDER) {
+        conAdd(LERR, "%s was saved on a machine with a different byte order", fileName);
+        saveClose(f);
+        return 0;
+    }
+
+    if (h.version > SAVE_VERSION) {
+        conAdd(LERR, "%s is from a newer version of gravit (save format %i)", fileName, h.version);
+        saveClose(f);
+        return 0;
+    }
+
+    if (!h.index) {
+        conAdd(LERR, "%s is incomplete, saving it did not finish", fileName);
+        saveClose(f);
+        return 0;
+    }
+
+    // the newest index knows how many frames there are
+    if (!saveFindChunk(f, h.index, "INDX", &c) || fread(&idx, sizeof(idx), 1, f->fp) != 1 || idx.first < 0 || idx.count < 0) {
+        saveClose(f);
+        return 0;
+    }
+
+    f->index = h.index;
+    f->frames = idx.first + idx.count;
+    info = idx.info;
+    f->detail = idx.detail;
+    f->merged = idx.merged;
+
+    f->frame = calloc(f->frames + 1, sizeof(long long));
+    if (!f->frame) {
+        conAdd(LERR, "Could not allocate %lu bytes of memory for the frame index", (unsigned long)(sizeof(long long) * (f->frames + 1)));
+        saveClose(f);
+        return 0;
+    }
+
+    offset = h.index;
+    last = offset + 1;
+    while (offset) {
+
+        // always further back, so a broken file can not loop
+        if (offset >= last) {
+            conAdd(LERR, "%s: broken frame index", fileName);
+            saveClose(f);
+            return 0;
+        }
+
+        // the newest one was read above, its offsets follow
+        if (offset != h.index && (!saveFindChunk(f, offset, "INDX", &c) || fread(&idx, sizeof(idx), 1, f->fp) != 1)) {
+            saveClose(f);
+            return 0;
+        }
+
+        if (idx.first < 0 || idx.count < 0 || idx.first + idx.count > f->frames) {
+            conAdd(LERR, "%s: broken frame index", fileName);
+            saveClose(f);
+            return 0;
+        }
+
+        for (i = 0; i < idx.count; i++) {
+            long long o;
+            if (fread(&o, sizeof(o), 1, f->fp) != 1) {
+                conAdd(LERR, "%s: short frame index", fileName);
+                saveClose(f);
+                return 0;
+            }
+            if (!f->frame[idx.first + i])
+                f->frame[idx.first + i] = o;
+        }
+
+        last = offset;
+        offset = idx.previous;
+
+    }
+
+    for (i = 0; i < f->frames; i++) {
+        if (!f->frame[i]) {
+            conAdd(LERR, "%s: frame %i is missing", fileName, i);
+            saveClose(f);
+            return 0;
+        }
+    }
+
+    // newer versions may add to the end of saveInfo_t
+    if (!saveFindChunk(f, info, "INFO", &c)) {
+        saveClose(f);
+        return 0;
+    }
+
+    memset(&f->info, 0, sizeof(f->info));
+    if (fread(&f->info, c.size < (long long)sizeof(f->info) ? (size_t)c.size : sizeof(f->info), 1, f->fp) != 1) {
+        conAdd(LERR, "%s: could not read the INFO chunk", fileName);
+        saveClose(f);
+        return 0;
+    }
+
+    return 1;
+
+}
+
+// mass and colour of every particle
+int saveReadDetail(saveFile_t *f, saveDetail_t *sd) {
+
+    saveChunk_t c;
+
+    if (!saveFindChunk(f, f->detail, "DETL", &c))
+        return 0;
+
+    if (c.size != (long long)(sizeof(saveDetail_t) * f->info.particleCount) || fread(sd, sizeof(saveDetail_t), f->info.particleCount, f->fp) != (size_t)f->info.particleCount) {
+        conAdd(LERR, "%s: could not read the particle details", f->fileName);
+        return 0;
+    }
+
+    return 1;
+
+}
+
+/*
+ * state.particleMerged and state.particleMergedFrame as they were saved,
+ * one after the other: merged has room for 2 * particleCount ints.
+ * All -1 and 0 if nothing was merged. Older saves have no frames, their
+ * DETL already has the masses after the merges - frame 0 keeps them that way
+ */
+int saveReadMerged(saveFile_t *f, int *merged) {
+
+    saveChunk_t c;
+    int n = f->info.particleCount;
+    int frames;             // merge frames in the chunk
+
+    memset(merged + n, 0, sizeof(int) * n);
+
+    if (!f->merged) {
+        memset(merged, -1, sizeof(int) * n);
+        return 1;
+    }
+
+    if (!saveFindChunk(f, f->merged, "MERG", &c))
+        return 0;
+
+    frames = c.size == (long long)(sizeof(int) * n) ? 0 : n;
+
+    if (c.size != (long long)(sizeof(int) * (n + frames)) || fread(merged, sizeof(int), n + frames, f->fp) != (size_t)(n + frames)) {
+        conAdd(LERR, "%s: could not read the merged particles", f->fileName);
+        return 0;
+    }
+
+    return 1;
+
+}
+
+/*
+ * the rest of the SAVE_PACKED frame chunk c, after its saveFrame_t, into p.
+ * Reads the frames it is predicted from first, if they are not the last
+ * ones that were read
+ */
+static int saveReadPacked(saveFile_t *f, int frame, saveChunk_t *c, particle_t *p) {
+
+    saveCodecHead_t h;
+    saveCodec_t codec;
+    size_t bytes = sizeof(particle_t) * f->info.particleCount;
+    long long size;
+    long long start;
+    int i;
+
+    if (fread(&h, sizeof(h), 1, f->fp) != 1 || h.blocks != saveBlocks(f->info.particleCount) || h.order < 0 || h.order > 2 || h.order > frame) {
+        saveError(f, "%s: frame %i is broken", f->fileName, frame);
+        return 0;
+    }
+
+    if (!f->previous) {
+        f->previous = malloc(bytes);
+        f->previous2 = malloc(bytes);
+        if (!f->previous || !f->previous2) {
+            saveError(f, "Could not allocate %lu bytes of memory for loading", (unsigned long)(bytes * 2));
+            return 0;
+        }
+    }
+
+    if ((h.order >= 1 && f->previousFrame != frame - 1) || (h.order == 2 && f->previous2Frame != frame - 2)) {
+
+        // reading the frame before also keeps the one before that. p is free until the end
+        if (!saveReadFrame(f, frame - 1, p))
+            return 0;
+
+        if (!saveFindChunk(f, f->frame[frame], "FRAM", c) || saveSeek(f->fp, f->frame[frame] + sizeof(saveChunk_t) + sizeof(saveFrame_t) + sizeof(h)) != 0) {
+            saveError(f, "%s: could not read frame %i", f->fileName, frame);
+            return 0;
+        }
+
+        if (h.order == 2 && f->previous2Frame != frame - 2) {
+            saveError(f, "%s: frame %i is broken", f->fileName, frame);
+            return 0;
+        }
+
+    }
+
+    // block sizes, then the blocks
+    size = c->size - (long long)(sizeof(saveFrame_t) + sizeof(h));
+    if (size < (long long)sizeof(int) * h.blocks || size > (long long)(sizeof(int) + 1 + SAVE_RUNS_BOUND(SAVE_BLOCK_PARTICLES)) * h.blocks) {
+        saveError(f, "%s: frame %i is broken", f->fileName, frame);
+        return 0;
+    }
+
+    if (f->packedSize < (size_t)size) {
+        free(f->packed);
+        f->packedSize = 0;
+        f->packed = malloc((size_t)size);
+        if (!f->packed) {
+            saveError(f, "Could not allocate %lu bytes of memory for loading", (unsigned long)size);
+            return 0;
+        }
+        f->packedSize = (size_t)size;
+    }
+
+    if (fread(f->packed, (size_t)size, 1, f->fp) != 1) {
+        saveError(f, "%s: short read in frame %i", f->fileName, frame);
+        return 0;
+    }
+
+    memset(&codec, 0, sizeof(codec));
+    codec.frame = (unsigned int *)p;
+    codec.previous = (unsigned int *)f->previous;
+    codec.previous2 = (unsigned int *)f->previous2;
+    codec.order = h.order;
+    codec.particleCount = f->info.particleCount;
+    codec.size = (int *)f->packed;
+    codec.packed = f->packed + sizeof(int) * h.blocks;
+    codec.blocks = h.blocks;
+    codec.unpack = 1;
+    codec.workers = f->workers;
+
+    codec.start = malloc(sizeof(long long) * h.blocks);
+    if (!codec.start) {
+        saveError(f, "Could not allocate %lu bytes of memory for loading", (unsigned long)(sizeof(long long) * h.blocks));
+        return 0;
+    }
+
+    size -= sizeof(int) * h.blocks;
+    for (i = 0, start = 0; i < h.blocks; i++) {
+        if (codec.size[i] < 0 || codec.size[i] > size - start)
+            break;
+        codec.start[i] = start;
+        start += codec.size[i];
+    }
+
+    if (i < h.blocks || start != size || !saveCodecRun(&codec)) {
+        saveError(f, "%s: frame %i is broken", f->fileName, frame);
+        free(codec.start);
+        return 0;
+    }
+
+    free(codec.start);
+    return 1;
+
+}
+
+// frame (f->info.particleCount particles) into p
+int saveReadFrame(saveFile_t *f, int frame, particle_t *p) {
+
+    saveChunk_t c;
+    saveFrame_t fr;
+    particle_t *pp;
+
+    if (frame < 0 || frame >= f->frames) {
+        saveError(f, "%s has no frame %i", f->fileName, frame);
+        return 0;
+    }
+
+    if (!saveFindChunk(f, f->frame[frame], "FRAM", &c))
+        return 0;
+
+    if (fread(&fr, sizeof(fr), 1, f->fp) != 1 || fr.frame != frame || fr.particleCount != f->info.particleCount
+        || (c.encoding == SAVE_RAW && c.size != (long long)(sizeof(fr) + sizeof(particle_t) * fr.particleCount))) {
+        saveError(f, "%s: frame %i is broken", f->fileName, frame);
+        return 0;
+    }
+
+    if (c.encoding == SAVE_PACKED) {
+
+        if (!saveReadPacked(f, frame, &c, p))
+            return 0;
+
+    } else if (fread(p, sizeof(particle_t), fr.particleCount, f->fp) != (size_t)fr.particleCount) {
+
+        saveError(f, "%s: short read in frame %i", f->fileName, frame);
+        return 0;
+
+    }
+
+    // the next frames might be predicted from this one
+    if (f->previous) {
+        pp = f->previous2;
+        f->previous2 = f->previous;
+        f->previous2Frame = f->previousFrame;
+        f->previous = pp;
+        memcpy(f->previous, p, sizeof(particle_t) * fr.particleCount);
+        f->previousFrame = frame;
+    }
+
+    return 1;
+
+}
+
+/*
+ * how many frames of fileName are the first frames of the recording in
+ * memory, so that a save of frames frames only has to add the rest. 0 if
+ * it has to be written again. Frame 0 and (if the history is not compact,
+ * where frames come back slightly different) the last saved frame have to
+ * be the same, and frame compression must not have renumbered the frames.
+ * If the particle details (sd) and merged particles did not change either,
+ * idx gets the chunks that already have them.
+ */
+static int saveAppendable(char *fileName, int frames, saveDetail_t *sd, particle_t *buffer, particle_t *compare, saveIndex_t *idx) {
+
+    saveFile_t f;
+    int n = 0;
+
+    if (!saveOpen(&f, fileName))
+        return 0;
+
+    if (f.info.particleCount == state.particleCount && f.info.historyNFrame == state.historyNFrame
+        && f.frames > 0 && f.frames <= frames
+        && saveReadFrame(&f, 0, compare) && !memcmp(compare, historyFrame(0, buffer), FRAMESIZE)) {
+
+        n = f.frames;
+
+        if (!historyIsCompact() && (!saveReadFrame(&f, n - 1, compare) || memcmp(compare, historyFrame(n - 1, buffer), FRAMESIZE)))
+            n = 0;
+
+    }
+
+    // compare is a frame, big enough for both
+    if (n && saveReadDetail(&f, (saveDetail_t *)compare) && !memcmp(compare, sd, sizeof(saveDetail_t) * state.particleCount))
+        idx->detail = f.detail;
+
+    if (n && state.particlesMerged && f.merged && saveReadMerged(&f, (int *)compare) && !memcmp(compare, state.particleMerged, sizeof(int) * 2 * state.particleCount))
+        idx->merged = f.merged;
+
+    saveClose(&f);
+
+    return n;
+
+}
+
+
+// frame buffers between the main thread and the thread: about this much, at least 2 frames
+#define SAVE_BUFFER_BYTES (32 * 1024 * 1024)
+#define SAVE_BUFFERS_MAX 64
+
+// a save or load that runs in the background
+typedef struct saveJob_s {
+
+    int mode;               // SAVE_IDLE, SAVE_SAVING or SAVE_LOADING
+    pthread_t thread;
+    saveFile_t file;        // file.fp belongs to the thread while it runs
+    int particleCount;
+    int first;              // frames first .. last-1 go through the buffers
+    int last;
+
+    // saving
+    int newFile;            // 1: the header has to be written first
+    saveHeader_t header;
+    saveIndex_t index;
+    saveInfo_t info;
+    saveDetail_t *detail;   // NULL: already in the file (index.detail)
+    int *merged;            // particleMerged and particleMergedFrame. NULL: nothing merged, or already in the file
+    long long *offsets;
+    int encoding;           // of the frames, SAVE_RAW or SAVE_PACKED
+    saveWorkers_t workers;  // for packing and unpacking
+    particle_t *reference;  // SAVE_PACKED: the frame before, and the one before that
+    particle_t *reference2;
+    unsigned char *head;    // saveFrame_t, saveCodecHead_t and block sizes
+    unsigned char *packed;
+    long long *blockStart;  // where each block is packed to, before the gaps are closed
+
+    // frame i is in buffer[i % buffers]
+    particle_t *buffer[SAVE_BUFFERS_MAX];
+    int buffers;
+    int produced;           // frames put into the buffers
+    int consumed;           // frames taken out of them
+    int done;               // the thread is finished
+    int failed;
+    int cancel;
+
+} saveJob_t;
+
+static saveJob_t saveJob;
+static pthread_mutex_t saveMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t saveChanged = PTHREAD_COND_INITIALIZER;
+
+/*
+ * the thread: wait until frame i is in its buffer (saving), or its buffer
+ * is free (loading). returns 0 if the job was cancelled
+ */
+static int saveThreadWait(saveJob_t *j, int i) {
+
+    int ok;
+
+    pthread_mutex_lock(&saveMutex);
+
+    while (!j->cancel && (j->mode == SAVE_SAVING ? i >= j->produced : i - j->consumed >= j->buffers))
+        pthread_cond_wait(&saveChanged, &saveMutex);
+
+    ok = !j->cancel;
+    pthread_mutex_unlock(&saveMutex);
+
+    return ok;
+
+}
+
+// the thread is done with the frame it waited for
+static void saveThreadDone(saveJob_t *j) {
+
+    pthread_mutex_lock(&saveMutex);
+
+    if (j->mode == SAVE_SAVING)
+        j->consumed++;
+    else
+        j->produced++;
+
+    pthread_cond_broadcast(&saveChanged);
+    pthread_mutex_unlock(&saveMutex);
+
+}
+
+// is frame i of job j packed on its own (saveWritePacked())
+static int saveKeyframe(saveJob_t *j, int i) {
+
+    return i == j->first || i % SAVE_KEYFRAME == 0;
+
+}
+
+// the thread: frame i, SAVE_PACKED encoded. returns its offset, -1 if writing failed
+static long long saveWritePacked(saveJob_t *j, int i, particle_t *frame) {
+
+    saveCodec_t codec;
+    saveFrame_t *fr = (saveFrame_t *)j->head;
+    saveCodecHead_t *h = (saveCodecHead_t *)(j->head + sizeof(saveFrame_t));
+    particle_t *swap;
+    long long offset;
+    size_t size;
+    int b;
+
+    memset(&codec, 0, sizeof(codec));
+    codec.frame = (unsigned int *)frame;
+    // the two frames before are in j->reference and j->reference2 if this save wrote them
+    codec.previous = (unsigned int *)j->reference;
+    codec.previous2 = (unsigned int *)j->reference2;
+    codec.order = saveKeyframe(j, i) ? 0 : saveKeyframe(j, i - 1) ? 1 : 2;
+    codec.particleCount = j->particleCount;
+    codec.packed = j->packed;
+    codec.start = j->blockStart;
+    codec.size = (int *)(j->head + sizeof(saveFrame_t) + sizeof(saveCodecHead_t));
+    codec.blocks = saveBlocks(j->particleCount);
+    codec.workers = &j->workers;
+
+    saveCodecRun(&codec);
+
+    // close the gaps between the blocks, they only move to the left
+    for (b = 0, size = 0; b < codec.blocks; b++) {
+        memmove(j->packed + size, j->packed + codec.start[b], codec.size[b]);
+        size += codec.size[b];
+    }
+
+    fr->frame = i;
+    fr->particleCount = j->particleCount;
+    h->order = codec.order;
+    h->blocks = codec.blocks;
+
+    offset = saveWriteChunk(j->file.fp, "FRAM", SAVE_PACKED, j->head, sizeof(saveFrame_t) + sizeof(saveCodecHead_t) + sizeof(int) * codec.blocks, j->packed, size);
+
+    swap = j->reference2;
+    j->reference2 = j->reference;
+    j->reference = swap;
+    memcpy(j->reference, frame, sizeof(particle_t) * j->particleCount);
+
+    return offset;
+
+}
+
+/*
+ * the thread, saving: everything but the frames is in the job already, the
+ * frames come through the buffers. returns 0 if writing failed
+ */
+static int saveWriteFrames(saveJob_t *j) {
+
+    FILE *fp = j->file.fp;
+    saveFrame_t fr;
+    long long indexOffset;
+    int i;
+
+    if (j->newFile && fwrite(&j->header, sizeof(j->header), 1, fp) != 1)
+        return 0;
+
+    j->index.info = saveWriteChunk(fp, "INFO", SAVE_RAW, NULL, 0, &j->info, sizeof(j->info));
+    if (j->detail)
+        j->index.detail = saveWriteChunk(fp, "DETL", SAVE_RAW, NULL, 0, j->detail, sizeof(saveDetail_t) * j->particleCount);
+    if (j->merged)
+        j->index.merged = saveWriteChunk(fp, "MERG", SAVE_RAW, NULL, 0, j->merged, sizeof(int) * 2 * j->particleCount);
+
+    if (j->index.info < 0 || j->index.detail < 0 || j->index.merged < 0)
+        return 0;
+
+    for (i = j->first; i < j->last; i++) {
+
+        if (!saveThreadWait(j, i))
+            return 0;
+
+        if (j->encoding == SAVE_PACKED) {
+            j->offsets[i - j->first] = saveWritePacked(j, i, j->buffer[i % j->buffers]);
+        } else {
+            fr.frame = i;
+            fr.particleCount = j->particleCount;
+            j->offsets[i - j->first] = saveWriteChunk(fp, "FRAM", SAVE_RAW, &fr, sizeof(fr), j->buffer[i % j->buffers], sizeof(particle_t) * j->particleCount);
+        }
+
+        saveThreadDone(j);
+
+        if (j->offsets[i - j->first] < 0)
+            return 0;
+
+    }
+
+    indexOffset = saveWriteChunk(fp, "INDX", SAVE_RAW, &j->index, sizeof(j->index), j->offsets, sizeof(long long) * j->index.count);
+
+    // everything is on the disk, now the header can point to it
+    if (indexOffset <= 0 || !saveSync(fp))
+        return 0;
+
+    j->header.index = indexOffset;
+    if (saveSeek(fp, 0) != 0 || fwrite(&j->header, sizeof(j->header), 1, fp) != 1 || !saveSync(fp))
+        return 0;
+
+    j->file.fp = NULL;
+    return fclose(fp) == 0;
+
+}
+
+// the thread, loading: frames first .. last-1 into the buffers
+static int saveReadFrames(saveJob_t *j) {
+
+    int i;
+
+    for (i = j->first; i < j->last; i++) {
+
+        if (!saveThreadWait(j, i))
+            return 0;
+
+        if (!saveReadFrame(&j->file, i, j->buffer[i % j->buffers]))
+            return 0;
+
+        saveThreadDone(j);
+
+    }
+
+    return 1;
+
+}
+
+static void *saveThread(void *arg) {
+
+    saveJob_t *j = (saveJob_t *)arg;
+    int ok;
+
+    if (j->mode == SAVE_SAVING)
+        ok = saveWriteFrames(j);
+    else
+        ok = saveReadFrames(j);
+
+    pthread_mutex_lock(&saveMutex);
+    j->failed = !ok;
+    j->done = 1;
+    pthread_cond_broadcast(&saveChanged);
+    pthread_mutex_unlock(&saveMutex);
+
+    return NULL;
+
+}
+
+static void saveFreeJob(saveJob_t *j) {
+
+    int i;
+
+    saveStopWorkers(&j->workers);
+    saveClose(&j->file);
+
+    for (i = 0; i < j->buffers; i++)
+        free(j->buffer[i]);
+
+    free(j->detail);
+    free(j->merged);
+    free(j->offsets);
+    free(j->reference);
+    free(j->reference2);
+    free(j->head);
+    free(j->packed);
+    free(j->blockStart);
+
+    memset(j, 0, sizeof(*j));
+
+}
+
+// frame buffers for particleCount particles. returns 0 if there is no memory for them
+static int saveAllocBuffers(saveJob_t *j) {
+
+    size_t bytes = sizeof(particle_t) * j->particleCount;
+    int i;
+
+    j->buffers = (int)(SAVE_BUFFER_BYTES / (bytes ? bytes : 1));
+    if (j->buffers < 2)
+        j->buffers = 2;
+    if (j->buffers > SAVE_BUFFERS_MAX)
+        j->buffers = SAVE_BUFFERS_MAX;
+
+    for (i = 0; i < j->buffers; i++) {
+        j->buffer[i] = malloc(bytes);
+        if (!j->buffer[i]) {
+            conAdd(LERR, "Could not allocate %lu bytes of memory for the save buffers", (unsigned long)(bytes * j->buffers));
+            return 0;
+        }
+    }
+
+    return 1;
+
+}
+
+// buffers for packing the frames. returns 0 if there is no memory for them
+static int saveAllocPacking(saveJob_t *j) {
+
+    int blocks = saveBlocks(j->particleCount);
+    size_t bound = 1 + SAVE_RUNS_BOUND(SAVE_BLOCK_PARTICLES);
+    int b;
+
+    j->encoding = SAVE_PACKED;
+    j->reference = malloc(sizeof(particle_t) * j->particleCount);
+    j->reference2 = malloc(sizeof(particle_t) * j->particleCount);
+    j->head = malloc(sizeof(saveFrame_t) + sizeof(saveCodecHead_t) + sizeof(int) * blocks);
+    j->packed = malloc(bound * blocks);
+    j->blockStart = malloc(sizeof(long long) * blocks);
+
+    if (!j->reference || !j->reference2 || !j->head || !j->packed || !j->blockStart) {
+        conAdd(LERR, "Could not allocate %lu bytes of memory for compressing", (unsigned long)(bound * blocks + sizeof(particle_t) * j->particleCount * 2));
+        return 0;
+    }
+
+    for (b = 0; b < blocks; b++)
+        j->blockStart[b] = (long long)bound * b;
+
+    return 1;
+
+}
+
+static int saveStartThread(saveJob_t *j) {
+
+    saveInitWorkers(&j->workers);
+
+    if (pthread_create(&j->thread, NULL, saveThread, (void *)j)) {
+        conAdd(LERR, "Could not start a thread for %s", j->file.fileName);
+        saveFreeJob(j);
+        return 0;
+    }
+
+    return 1;
+
+}
+
+// the thread is done: tell how it went
+static void saveEndJob(saveJob_t *j) {
+
+    pthread_join(j->thread, NULL);
+
+    if (j->mode == SAVE_SAVING) {
+
+        if (j->failed) {
+            conAdd(LERR, "Could not write to %s", j->file.fileName);
+        } else {
+            if (j->first)
+                conAdd(LLOW, "added frames %i to %i to %s", j->first, j->last - 1, j->file.fileName);
+            else
+                conAdd(LLOW, "written %i frames to %s", j->last, j->file.fileName);
+            conAdd(LNORM, "Simulation saved sucesfully!");
+        }
+
+    } else if (j->failed && !j->cancel) {
+
+        if (j->file.error[0])
+            conAdd(LERR, "%s", j->file.error);
+        conAdd(LERR, "Only %i of %i frames could be loaded from %s", j->consumed, j->last, j->file.fileName);
+
+    } else if (!j->cancel) {
+
+        conAdd(LLOW, "loaded %i frames from %s", j->last, j->file.fileName);
+
+    }
+
+    saveFreeJob(j);
+
+}
+
+/*
+ * the main thread's part of a save or load: hand the next frames to the
+ * thread, or move the frames it read into the history. With wait it
+ * waits for the thread until the job is done. returns 1 while there is
+ * still something to do
+ */
+int saveUpdate(int wait) {
+
+    saveJob_t *j = &saveJob;
+    particle_t *p;
+    int done;
+    int i;
+
+    if (j->mode == SAVE_IDLE)
+        return 0;
+
+    // a save while recording leaves a processor to the simulation
+    pthread_mutex_lock(&j->workers.mutex);
+    j->workers.recording = (state.mode & SM_RECORD) != 0;
+    pthread_mutex_unlock(&j->workers.mutex);
+
+    pthread_mutex_lock(&saveMutex);
+
+    while (1) {
+
+        if (j->mode == SAVE_SAVING) {
+
+            // the history keeps changing while recording, the copies do not
+            while (!j->done && j->produced < j->last && j->produced - j->consumed < j->buffers) {
+
+                i = j->produced;
+                pthread_mutex_unlock(&saveMutex);
+
+                p = historyFrame(i, j->buffer[i % j->buffers]);
+                if (p != j->buffer[i % j->buffers])
+                    memcpy(j->buffer[i % j->buffers], p, sizeof(particle_t) * j->particleCount);
+
+                pthread_mutex_lock(&saveMutex);
+                j->produced++;
+                pthread_cond_broadcast(&saveChanged);
+
+            }
+
+        } else {
+
+            while (!j->cancel && j->consumed < j->produced) {
+
+                i = j->consumed;
+                pthread_mutex_unlock(&saveMutex);
+
+                memcpy(historyWriteFrame(i), j->buffer[i % j->buffers], sizeof(particle_t) * j->particleCount);
+                historyCommitFrame(i);
+                state.frame = i;
+
+                pthread_mutex_lock(&saveMutex);
+                j->consumed++;
+                pthread_cond_broadcast(&saveChanged);
+
+            }
+
+        }
+
+        if (j->done || !wait)
+            break;
+
+        pthread_cond_wait(&saveChanged, &saveMutex);
+
+    }
+
+    done = j->done;
+    pthread_mutex_unlock(&saveMutex);
+
+    if (!done)
+        return 1;
+
+    saveEndJob(j);
+    return 0;
+
+}
+
+// wait for the save or load to finish
+void saveFinish() {
+
+    while (saveUpdate(1));
+
+}
+
+// like saveFinish(), but a load stops where it is
+void saveCancel() {
+
+    if (saveJob.mode == SAVE_LOADING) {
+        pthread_mutex_lock(&saveMutex);
+        saveJob.cancel = 1;
+        pthread_cond_broadcast(&saveChanged);
+        pthread_mutex_unlock(&saveMutex);
+    }
+
+    saveFinish();
+
+}
+
+/*
+ * SAVE_IDLE, SAVE_SAVING or SAVE_LOADING. done (if not NULL) gets how far
+ * it is, 0 .. 1
+ */
+int saveProgress(float *done) {
+
+    saveJob_t *j = &saveJob;
+
+    if (j->mode == SAVE_IDLE)
+        return SAVE_IDLE;
+
+    if (done) {
+        pthread_mutex_lock(&saveMutex);
+        *done = j->last > j->first ? (float)(j->consumed - j->first) / (j->last - j->first) : 1;
+        pthread_mutex_unlock(&saveMutex);
+    }
+
+    return j->mode;
+
+}
+
+/*
+ * how many frames from frame 0 on are stored as they are (SAVE_RAW), each
+ * chunk right after the one before. Those are mapped as the history
+ * (historyMapFrames()) instead of being read. returns 0 if none are
+ */
+static int saveMapFrames(saveFile_t *f, int frames) {
+
+    saveChunk_t c;
+    saveFrame_t fr;
+    long long stride = sizeof(saveChunk_t) + sizeof(saveFrame_t) + sizeof(particle_t) * (long long)f->info.particleCount;
+    int n;
+
+    for (n = 0; n < frames; n++) {
+
+        if (f->frame[n] != f->frame[0] + stride * n || !saveFindChunk(f, f->frame[n], "FRAM", &c) || c.encoding != SAVE_RAW
+            || c.size != stride - (long long)sizeof(c) || fread(&fr, sizeof(fr), 1, f->fp) != 1 || fr.frame != n || fr.particleCount != f->info.particleCount)
+            break;
+
+    }
+
+    if (!n || !historyMapFrames(f->fileName, f->frame[0] + sizeof(saveChunk_t) + sizeof(saveFrame_t), (size_t)stride, n))
+        return 0;
+
+    return n;
+
+}
+
+/*
+ * start loading frames 0 .. frames-1 of f into the history, which has to be
+ * set up for f->info.particleCount particles already (initFrame()). The
+ * first frames are mapped from the file if they can be (saveMapFrames()),
+ * otherwise frame 0 is read right away. The others follow in the background
+ * and state.frame grows as they arrive. Takes over f (saveClose() is not
+ * needed anymore). returns 0 if that did not work
+ */
+int saveRead(saveFile_t *f, int frames) {
+
+    saveJob_t *j = &saveJob;
+    int first;
+
+    if (frames < 1 || frames > f->frames) {
+        conAdd(LERR, "%s only has %i frames", f->fileName, f->frames);
+        return 0;
+    }
+
+    saveFinish();
+
+    first = saveMapFrames(f, frames);
+
+    if (!first) {
+
+        // so there is something to show
+        if (!saveReadFrame(f, 0, historyWriteFrame(0)))
+            return 0;
+
+        historyCommitFrame(0);
+        first = 1;
+
+    }
+
+    state.frame = first - 1;
+
+    memset(j, 0, sizeof(*j));
+    j->file = *f;
+    j->file.workers = &j->workers;
+    memset(f, 0, sizeof(*f));
+
+    if (frames == first) {
+        saveFreeJob(j);
+        return 1;
+    }
+
+    j->file.background = 1;
+    j->particleCount = j->file.info.particleCount;
+    j->first = j->produced = j->consumed = first;
+    j->last = frames;
+    j->mode = SAVE_LOADING;
+
+    if (!saveAllocBuffers(j)) {
+        saveFreeJob(j);
+        return 0;
+    }
+
+    return saveStartThread(j);
+
+}
+
+/*
+ * start saving frames 0 .. frames-1 of the recording, with si and sd, to
+ * fileName. Only adds the new frames if fileName already has the first ones,
+ * see above. The frames are written in the background, see saveUpdate().
+ * returns 0 if that did not work
+ */
+int saveWrite(char *fileName, saveInfo_t *si, saveDetail_t *sd, int frames) {
+
+    saveJob_t *j = &saveJob;
+    int first;
+
+    // one at a time, and it might be this file
+    saveFinish();
+
+    memset(j, 0, sizeof(*j));
+    strncpy(j->file.fileName, fileName, sizeof(j->file.fileName) - 1);
+    j->particleCount = state.particleCount;
+    j->info = *si;
+
+    if (!saveAllocBuffers(j)) {
+        saveFreeJob(j);
+        return 0;
+    }
+
+    first = saveAppendable(fileName, frames, sd, j->buffer[0], j->buffer[1], &j->index);
+
+    j->offsets = malloc(sizeof(long long) * (frames - first + 1));
+    if (!j->index.detail)
+        j->detail = malloc(sizeof(saveDetail_t) * j->particleCount);
+    if (state.particlesMerged && !j->index.merged)
+        j->merged = malloc(sizeof(int) * 2 * j->particleCount);
+
+    if (!j->offsets || (!j->index.detail && !j->detail) || (state.particlesMerged && !j->index.merged && !j->merged)) {
+        conAdd(LERR, "Could not allocate %lu bytes of memory for saving", (unsigned long)((sizeof(long long) + sizeof(saveDetail_t) + sizeof(int) * 2) * j->particleCount));
+        saveFreeJob(j);
+        return 0;
+    }
+
+    if (state.saveCompression && !saveAllocPacking(j)) {
+        saveFreeJob(j);
+        return 0;
+    }
+
+    // the thread gets its own copies
+    if (j->detail)
+        memcpy(j->detail, sd, sizeof(saveDetail_t) * j->particleCount);
+    if (j->merged)
+        memcpy(j->merged, state.particleMerged, sizeof(int) * 2 * j->particleCount);
+
+    if (first) {
+
+        j->file.fp = fopen(fileName, "r+b");
+        if (!j->file.fp || fread(&j->header, sizeof(j->header), 1, j->file.fp) != 1 || saveSeekEnd(j->file.fp) != 0) {
+            conAdd(LERR, "Could not open %s for appending", fileName);
+            saveFreeJob(j);
+            return 0;
+        }
+
+        j->index.previous = j->header.index;
+
+    } else {
+
+        // the history might be mapped from the old file, that one has to stay as it is
+        remove(fileName);
+
+        j->file.fp = fopen(fileName, "wb");
+        if (!j->file.fp) {
+            conAdd(LERR, "Could not open %s for writing", fileName);
+            saveFreeJob(j);
+            return 0;
+        }
+
+        memcpy(j->header.magic, SAVE_MAGIC, 8);
+        j->header.version = SAVE_VERSION;
+        j->header.byteOrder = SAVE_BYTE_ORDER;
+        j->header.index = 0;
+        j->newFile = 1;
+
+    }
+
+    j->index.first = first;
+    j->index.count = frames - first;
+    j->first = j->produced = j->consumed = first;
+    j->last = frames;
+    j->mode = SAVE_SAVING;
+
+    if (!saveStartThread(j))
+        return 0;
+
+    // the first frames
+    saveUpdate(0);
+
+    return 1;
+
+}
@@ -501,6 +501,19 @@ size_t getMemory() {
     
 }
 
+int getProcessors() {
+
+#ifdef WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0) ? (int)n : 1;
+#endif
+
+}
+
 size_t getMemoryAvailable() {
     size_t realMemory;
     